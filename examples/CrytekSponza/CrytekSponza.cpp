@@ -125,7 +125,7 @@ private:
 		normalize(vLightToVertexX, vLightToVertexY, vLightToVertexZ);
 
 		__m128 vNormalLightDot = dot(vNormalizedX, vNormalizedY, vNormalizedZ, vLightToVertexX, vLightToVertexY, vLightToVertexZ);
-		__m128 vMask = _mm_cmp_ps(vNormalLightDot, _mm_setzero_ps(), _CMP_LT_OS);
+		__m128 vMask = _mm_cmplt_ps(vNormalLightDot, _mm_setzero_ps());
 		vNormalLightDot = _mm_and_ps(vNormalLightDot, vMask);
 
 		__m128 vSpecularFactor;
@@ -157,7 +157,7 @@ private:
 
 			vSpecularFactor = dot(vReflectDirectionX, vReflectDirectionY, vReflectDirectionZ,
 								vVectexToEyeX, vVectexToEyeY, vVectexToEyeZ);
-			__m128 vMask1 = _mm_cmp_ps(vSpecularFactor, _mm_setzero_ps(), _CMP_GT_OS);
+			__m128 vMask1 = _mm_cmpgt_ps(vSpecularFactor, _mm_setzero_ps());
 			vSpecularFactor = _mm_and_ps(_mm_and_ps(vSpecularFactor, vMask1), vMask);
 			vSpecularFactor = _mm_mul_ps(vSpecularFactor, _mm_set_ps1(mPointLight.SpecularIntensity));
 		}
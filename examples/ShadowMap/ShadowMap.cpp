@@ -133,7 +133,7 @@ private:
 		normalize(vLightToVertexX, vLightToVertexY, vLightToVertexZ);
 
 		__m128 vNormalLightDot = dot(vNormalizedX, vNormalizedY, vNormalizedZ, vLightToVertexX, vLightToVertexY, vLightToVertexZ);
-		__m128 vMask = _mm_cmp_ps(vNormalLightDot, _mm_setzero_ps(), _CMP_LT_OS);
+		__m128 vMask = _mm_cmplt_ps(vNormalLightDot, _mm_setzero_ps());
 		vNormalLightDot = _mm_and_ps(vNormalLightDot, vMask);
 
 		__m128 vSpecularFactor;
@@ -165,7 +165,7 @@ private:
 
 			vSpecularFactor = dot(vReflectDirectionX, vReflectDirectionY, vReflectDirectionZ,
 								vVectexToEyeX, vVectexToEyeY, vVectexToEyeZ);
-			__m128 vMask1 = _mm_cmp_ps(vSpecularFactor, _mm_setzero_ps(), _CMP_GT_OS);
+			__m128 vMask1 = _mm_cmpgt_ps(vSpecularFactor, _mm_setzero_ps());
 			vSpecularFactor = _mm_and_ps(_mm_and_ps(vSpecularFactor, vMask1), vMask);
 			vSpecularFactor = _mm_mul_ps(vSpecularFactor, _mm_set_ps1(mPointLight.SpecularIntensity));
 		}
@@ -184,7 +184,7 @@ private:
 
 		// Add depth bias to overcome shadow acne.
 		__m128 vBias = _mm_max_ps(_mm_mul_ps(_mm_add_ps(_mm_set_ps1(1.0f), vNormalLightDot), _mm_set_ps1(0.035f)), _mm_set_ps1(0.001f));
-		__m128 vShadowMask = _mm_cmp_ps(_mm_sub_ps(vLightSpaceZ, vBias), vClosestDepth[0], _CMP_GT_OS);
+		__m128 vShadowMask = _mm_cmpgt_ps(_mm_sub_ps(vLightSpaceZ, vBias), vClosestDepth[0]);
 		__m128 vShadowAdjust = _mm_sub_ps(_mm_set_ps1(1.0f), _mm_and_ps(vShadowMask, _mm_set_ps1(0.8f)));
 
 		__m128 vAmbientFactor = _mm_set_ps1(mPointLight.AmbientIntensity);
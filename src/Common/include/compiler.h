@@ -23,7 +23,9 @@ unsigned char _BitScanForward(unsigned int *Index, unsigned Mask)
 inline
 unsigned char _BitScanReverse(unsigned int *Index, unsigned Mask)
 {
-	*Index = __builtin_clz(Mask);
+	// Index of the most significant set bit, like the MSVC intrinsic.
+	if (Mask)
+		*Index = (sizeof(Mask) * 8 - 1) - __builtin_clz(Mask);
 	return (Mask != 0);
 }
 
@@ -58,7 +60,9 @@ unsigned char _BitScanForward(unsigned long *Index, unsigned long Mask)
 inline
 unsigned char _BitScanReverse(unsigned long *Index, unsigned long Mask)
 {
-	*Index = __builtin_clzl(Mask);
+	// Index of the most significant set bit, like the MSVC intrinsic.
+	if (Mask)
+		*Index = (sizeof(Mask) * 8 - 1) - __builtin_clzl(Mask);
 	return (Mask != 0);
 }
 
@@ -3,7 +3,6 @@
 #include <utility>
 
 #include "DataFlow.h"
-#include "DrawEngine.h"
 #include "MemoryPool.h"
 #include "compiler.h"
 
@@ -28,20 +27,6 @@ static glm::vec4 sPlanes[Clipper::MAX_PLANES] = {
 	glm::vec4( 0.0f, -1.0f,  0.0f, 0.0f)  // PLANE_GB_TOP
 };
 
-Clipper::Clipper():
-	PipeStage("Clipping", DrawEngine::getDrawEngine())
-{
-}
-
-void Clipper::emit(void *data)
-{
-	Batch *bat = static_cast<Batch *>(data);
-
-	onClipping(bat);
-
-	getNextStage()->emit(bat);
-}
-
 // Compute Cohen-Sutherland style outcodes against the view frustum
 void Clipper::ComputeOutcodesFrustum(const Primitive &prim, int outcodes[3])
 {
@@ -95,7 +80,7 @@ void Clipper::ComputeOutcodesGuardband(const Primitive &prim, int outcodes[3])
  * guard band, while another intersects with guard band)
  * after snapping to subpixel grids.
  */
-void Clipper::ClipAgainstGuardband(Primitive &prim, int outcodes_union, Primlist &out)
+int Clipper::ClipAgainstGuardband(Primitive &prim, int outcodes_union, Primitive *out[CLIP_MAX_PRIMS])
 {
 	/* Two round robin intermediate boxes
 	 * One src, one dst. Next loop, reverse!
@@ -106,6 +91,7 @@ void Clipper::ClipAgainstGuardband(Primitive &prim, int outcodes_union, Primlist
 	float dist[2];
 	int src = 0, dst = 1;
 	int tmpnr = 0;
+	int count = 0;
 
 	assert(prim.mType == Primitive::TRIANGLE);
 
@@ -175,81 +161,67 @@ void Clipper::ClipAgainstGuardband(Primitive &prim, int outcodes_union, Primlist
 			new_prim->mVert[1] = std::move(*rr[src][i]); /* OPT to avoid copy */
 			new_prim->mVert[2] = *rr[src][i+1];
 
-			out.push_back(new_prim);
+			out[count++] = new_prim;
 		}
 	}
+
+	return count;
 }
 
-void Clipper::onClipping(Batch *bat)
+int Clipper::ClipPrimitive(Primitive *prim, Primitive *out[CLIP_MAX_PRIMS])
 {
-	Primlist out;
-	Primlist &pl = bat->mPrims;
+	int outcodes[3] = {0, 0, 0};
 
-	auto it = pl.begin();
-	while (it != pl.end())
-	{
-		int   outcodes[3] = {0, 0, 0};
-		Primitive *prim = *it;
+	ComputeOutcodesFrustum(*prim, outcodes);
 
-		ComputeOutcodesFrustum(*prim, outcodes);
-
-		// trivially accepted
-		if ((outcodes[0] | outcodes[1] | outcodes[2]) == 0)
-		{
-			out.push_back(prim);
-			it = pl.erase(it);
-
-			continue;
-		}
-		auto orig_it = it;
-		++it;
+	// trivially accepted
+	if ((outcodes[0] | outcodes[1] | outcodes[2]) == 0)
+	{
+		out[0] = prim;
+		return 1;
+	}
 
-		// trivially rejected
-		if (outcodes[0] & outcodes[1] & outcodes[2])
-		{
-			continue;
-		}
+	// trivially rejected
+	if (outcodes[0] & outcodes[1] & outcodes[2])
+	{
+		DestroyPrimitive(prim);
+		return 0;
+	}
 
-		/* A bit tricky here:
-		 * Consider this particular outcode b1000000:
-		 * -w <= x <= w (true)
-		 * -w <= y <= w (true)
-		 * -w <= z <= w (true)
-		 * w > 0        (false)
-		 *
-		 * This can derive that (x, y, z, w) = (0, 0, 0, 0).
-		 * So it's an efficient way to catch this degenerated case.
-		 */
-		if (UNLIKELY(outcodes[0] == (1 << PLANE_ZEROW) ||
-					 outcodes[1] == (1 << PLANE_ZEROW) ||
-					 outcodes[2] == (1 << PLANE_ZEROW)))
-		{
-			continue;
-		}
+	/* A bit tricky here:
+	 * Consider this particular outcode b1000000:
+	 * -w <= x <= w (true)
+	 * -w <= y <= w (true)
+	 * -w <= z <= w (true)
+	 * w > 0        (false)
+	 *
+	 * This can derive that (x, y, z, w) = (0, 0, 0, 0).
+	 * So it's an efficient way to catch this degenerated case.
+	 */
+	if (UNLIKELY(outcodes[0] == (1 << PLANE_ZEROW) ||
+				 outcodes[1] == (1 << PLANE_ZEROW) ||
+				 outcodes[2] == (1 << PLANE_ZEROW)))
+	{
+		DestroyPrimitive(prim);
+		return 0;
+	}
 
-		ComputeOutcodesGuardband(*prim, outcodes);
+	ComputeOutcodesGuardband(*prim, outcodes);
 
-		unsigned outcodes_union = (outcodes[0] | outcodes[1] | outcodes[2]) & kGBClipMask;
+	unsigned outcodes_union = (outcodes[0] | outcodes[1] | outcodes[2]) & kGBClipMask;
 
-		if (LIKELY(outcodes_union == 0))
-		{
-			out.push_back(prim);
-			it = pl.erase(orig_it);
-		}
-		else
-		{
-			// need to do clipping
-			ClipAgainstGuardband(*prim, outcodes_union, out);
-		}
+	if (LIKELY(outcodes_union == 0))
+	{
+		out[0] = prim;
+		return 1;
 	}
 
-	pl.swap(out);
+	// need to do clipping
+	const int count = ClipAgainstGuardband(*prim, outcodes_union, out);
 
-	for (Primitive *prim: out)
-	{
-		prim->~Primitive();
-		MemoryPoolMT::get().deallocate(prim, sizeof(Primitive));
-	}
+	DestroyPrimitive(prim);
+
+	return count;
 }
 
 // vertex linear interpolation
@@ -274,8 +246,4 @@ void Clipper::ComputeGuardband(float width, float height)
 	sPlanes[PLANE_GB_BOTTOM].w = sPlanes[PLANE_GB_TOP   ].w = GUARDBAND_HEIGHT / height;
 }
 
-void Clipper::finalize()
-{
-}
-
 } // namespace glsp
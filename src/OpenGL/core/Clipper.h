@@ -10,12 +10,16 @@ namespace glsp {
 class Batch;
 class vertex_data;
 
-// TODO:
-// *.4 fixed point numbers conresponds to a 2048x2048 guard band.
-#define GUARDBAND_WIDTH  2048
-#define GUARDBAND_HEIGHT 2048
+// Guard band is +-4096 pixels around the viewport center, large enough for 4K.
+// *.4 fixed point coordinates fit in 32 bit, while edge equations need 64 bit.
+#define GUARDBAND_WIDTH  8192
+#define GUARDBAND_HEIGHT 8192
 
-class Clipper: public PipeStage
+// A triangle is clipped to a polygon of 6 vertices at most, i.e. 4 triangles.
+#define CLIP_MAX_PRIMS   4
+
+/* Clipping of the geometry stages, see GeometryPipeline. */
+class Clipper
 {
 public:
 	// TODO: Add support for user defined clip planes
@@ -42,17 +46,16 @@ public:
 		MAX_PLANES,
 	};
 
-	Clipper();
-	virtual ~Clipper() { }
-
-	virtual void emit(void *data);
-	virtual void finalize();
-
 	static void ComputeGuardband(float width, float height);
 
+	/* Clip one primitive, the results are written to out in order, and the
+	 * number of them is returned. prim is either passed through as out[0],
+	 * or freed.
+	 */
+	static int ClipPrimitive(Primitive *prim, Primitive *out[CLIP_MAX_PRIMS]);
+
 private:
-	static void onClipping(Batch *bat);
-	static void ClipAgainstGuardband(Primitive &prim, int outcodes_union, Primlist &out);
+	static int ClipAgainstGuardband(Primitive &prim, int outcodes_union, Primitive *out[CLIP_MAX_PRIMS]);
 	static void ComputeOutcodesFrustum(const Primitive &prim, int outcodes[3]);
 	static void ComputeOutcodesGuardband(const Primitive &prim, int outcodes[3]);
 	static void vertexLerp(vsOutput &new_vert,
@@ -12,6 +12,9 @@ namespace glsp {
 
 #define MAX_SHADER_REGISTERS 32
 
+// Max number of quads of one triangle shaded in one go, see FsiosimdGroup.
+#define MAX_QUADS_IN_GROUP   4
+
 struct DrawContext;
 struct RasterStates;
 
@@ -162,6 +165,13 @@ struct Primitive
 	float mAreaReciprocal;
 };
 
+// Free a primitive allocated from MemoryPoolMT.
+inline void DestroyPrimitive(Primitive *prim)
+{
+	prim->~Primitive();
+	MemoryPoolMT::get().deallocate(prim, sizeof(Primitive));
+}
+
 typedef std::vector<int> IBuffer_v;
 typedef std::vector<vsInput> vsInput_v;
 typedef std::list<Primitive *> Primlist;
@@ -256,9 +266,30 @@ struct ALIGN(16) Fsiosimd
 
 	int 	x, y;
 	int     mCoverageMask;
+	int     mSampleMask; // 4 bits of quad coverage per sample, see FsiosimdGroup::mSamples
 	int 	mIndex; // used to lookup the color/depth/stencil buffers
 
 	void *m_priv0;
 };
 
+/* The quads of one triangle, queued in the tile by the rasterizer and passed
+ * down the pixel pipe stages in one go, so the per triangle setup and the
+ * stage calls are paid once per group instead of once per quad.
+ */
+struct ALIGN(16) FsiosimdGroup
+{
+	Fsiosimd mQuads[MAX_QUADS_IN_GROUP];
+	int      mCount;
+
+	// Color buffer written by the quads, (mColorX, mColorY) is the window
+	// position of its first pixel. In a multisample pass it's the on-tile
+	// buffer of mSamples planes, mSamplePitch pixels apart.
+	uint32_t *mColorBuffer;
+	int       mColorPitch;
+	int       mColorX;
+	int       mColorY;
+	int       mSamples;
+	int       mSamplePitch;
+};
+
 } // namespace glsp
@@ -1,20 +1,20 @@
 #include "DrawEngine.h"
 
+#include <algorithm>
 #include <cstdlib>
 
 #include "GLContext.h"
 #include "VertexFetcher.h"
 #include "Rasterizer.h"
-#include "PrimitiveAssembler.h"
-#include "Clipper.h"
 #include "FaceCuller.h"
-#include "PerspectiveDivider.h"
-#include "ScreenMapper.h"
+#include "GeometryPipeline.h"
 #include "TBDR.h"
 #include "PixelBackend.h"
+#include "Kernels.h"
 #include "ThreadPool.h"
 #include "MemoryPool.h"
 #include "compiler.h"
+#include "glsp_debug.h"
 #include "khronos/GL/glspcorearb.h"
 
 
@@ -35,6 +35,12 @@ GLAPI void APIENTRY glDrawArrays (GLenum mode, GLint first, GLsizei count)
 	dc.mCount = count;
 	dc.mDrawType = DrawContext::kArrayDraw;
 	dc.mIndices = 0;
+
+	// A render pass flush reclaims the memory pool, so it must happen
+	// before anything of this draw is allocated from the pool.
+	if (!de->validateRenderPass())
+		return;
+
 	dc.mRasterStates = new(MemoryPoolMT::get()) RasterStates();
 
 	if (!dc.mRasterStates)
@@ -62,6 +68,12 @@ GLAPI void APIENTRY glDrawElements (GLenum mode, GLsizei count, GLenum type, con
 	dc.mDrawType = DrawContext::kElementDraw;
 	dc.mIndexSize = (type == GL_UNSIGNED_INT)? 4: ((type == GL_UNSIGNED_SHORT)? 2: 1);
 	dc.mIndices = indices;
+
+	// A render pass flush reclaims the memory pool, so it must happen
+	// before anything of this draw is allocated from the pool.
+	if (!de->validateRenderPass())
+		return;
+
 	dc.mRasterStates = new(MemoryPoolMT::get()) RasterStates();
 
 	if (!dc.mRasterStates)
@@ -78,7 +90,7 @@ GLAPI void APIENTRY glClear (GLbitfield mask)
 {
 	DrawEngine &de = DrawEngine::getDrawEngine();
 
-	if (!de.validateState(nullptr))
+	if (!de.validateRenderPass())
 		return;
 
 	de.prepareToDraw();
@@ -157,18 +169,18 @@ private:
 DrawEngine::DrawEngine():
 	mFirstStage(nullptr),
 	mGLContext(nullptr),
-	mDrawCount(0)
+	mDrawCount(0),
+	mBinMemoryBudget(0),
+	mBinMemoryBudgetWarned(false)
 {
 }
 
 DrawEngine::~DrawEngine()
 {
 	delete mVertexFetcher;
-	delete mPrimAsbl;
-	delete mClipper;
-	delete mDivider;
-	delete mMapper;
 	delete mCuller;
+	delete mGeometryPipelines[1];
+	delete mGeometryPipelines[0];
 	delete mBinning;
 	delete mTBDR;
 	delete mInterpolater;
@@ -198,21 +210,27 @@ void DrawEngine::init()
 
 void DrawEngine::SetNativeWindowInfo(NWMWindowInfo &win_info)
 {
-	mGLContext->mFBOM.GetDefaultFBO()->DefaultFBOInitRenderTarget(win_info.width, win_info.height, win_info.format);
+	mGLContext->mFBOM.GetDefaultFBO()->DefaultFBOInitRenderTarget(win_info.width, win_info.height, win_info.format, win_info.layout);
 	mGLContext->applyViewport(0, 0, win_info.width, win_info.height);
+
+	// The scissor box is initialized to the window size too.
+	GLScissor &scissor = mGLContext->mState.mScissor;
+	scissor.x      = 0;
+	scissor.y      = 0;
+	scissor.width  = win_info.width;
+	scissor.height = win_info.height;
 }
 
 void DrawEngine::initPipeline()
 {
 	mVertexFetcher = new VertexCachedFetcher();
-	mPrimAsbl      = new PrimitiveAssembler();
-	mClipper       = new Clipper();
-	mDivider       = new PerspectiveDivider();
-	mMapper        = new ScreenMapper();
 	mCuller        = new FaceCuller();
 	mBinning       = new Binning();
 	mTBDR          = new TBDR(*this);
 
+	mGeometryPipelines[0] = new GeometryPipeline<false>(*mCuller);
+	mGeometryPipelines[1] = new GeometryPipeline<true >(*mCuller);
+
 	mInterpolater  = new PerspectiveCorrectInterpolater();
 	mOwnershipTest = new OwnershipTester();
 	mScissorTest   = new ScissorTester();
@@ -227,9 +245,8 @@ void DrawEngine::initPipeline()
 
 	setFirstStage(mGeometry);
 
-	mPrimAsbl->setNextStage(mClipper);
-	mClipper ->setNextStage(mDivider);
-	mDivider ->setNextStage(mMapper);
+	mGeometryPipelines[0]->setNextStage(mBinning);
+	mGeometryPipelines[1]->setNextStage(mBinning);
 
 	mGeometry->setFirstChild(mVertexFetcher);
 	mGeometry->setLastChild(mBinning);
@@ -244,17 +261,10 @@ void DrawEngine::linkGeomertryPipeStages()
 	VertexShader *pVS = mGLContext->mPM.getCurrentProgram()->getVS();
 
 	mVertexFetcher->setNextStage(pVS);
-	pVS->setNextStage(mPrimAsbl);
 
-	if(enables & GLSP_CULL_FACE)
-	{
-		mMapper->setNextStage(mCuller);
-		mCuller->setNextStage(mBinning);
-	}
-	else
-	{
-		mMapper->setNextStage(mBinning);
-	}
+	// OPT: the stages from primitive assembly to face culling are fused,
+	// see GeometryPipeline.
+	pVS->setNextStage(mGeometryPipelines[(enables & GLSP_CULL_FACE) ? 1 : 0]);
 }
 
 void DrawEngine::linkRasterizerPipeStages()
@@ -319,70 +329,111 @@ void DrawEngine::linkRasterizerPipeStages()
 #endif
 }
 
+bool DrawEngine::validateRenderPass()
+{
+	bool ret = mGLContext->mFBOM.ValidateFramebufferStatus(mGLContext);
+	if (ret)
+	{
+		RenderTarget &rt = mGLContext->mRT;
+		bool depth_only = mGLContext->mFBOM.GetDrawFBO()->IsDepthOnly();
+
+		// Multisampling is a property of the whole render pass, the samples are
+		// resolved on tile store. Depth only targets are always single sampled.
+		int samples = (!depth_only && (mGLContext->mState.mEnables & GLSP_MULTISAMPLE)) ? MSAA_SAMPLES : 1;
+
+		// The tile grid can't be changed with primitives binned,
+		// e.g. tile size or sample count changed in the middle of a render pass.
+		if (mDrawCount && mTBDR->IsTileGridChanged(rt.width, rt.height, depth_only, samples))
+			Flush(false);
+
+		mTBDR->SetupTileGrid(rt.width, rt.height, depth_only, samples);
+	}
+
+	return ret;
+}
+
 // OPT: use dirty flag to optimize
 bool DrawEngine::validateState(DrawContext *dc)
 {
 	// TODO: some validation work
-	bool ret = true;
+	// NOTE: the render pass is validated by validateRenderPass() beforehand.
+	GLContext *gc = dc->gc;
+	VertexArrayObject *pVAO = gc->mVAOM.getActiveVAO();
+	BufferObject *pElementBO = gc->mBOM.getBoundBuffer(GL_ELEMENT_ARRAY_BUFFER);
 
-	if (dc)
+	for(size_t i = 0; i < MAX_VERTEX_ATTRIBS; ++i)
 	{
-		GLContext *gc = dc->gc;
-		VertexArrayObject *pVAO = gc->mVAOM.getActiveVAO();
-		BufferObject *pElementBO = gc->mBOM.getBoundBuffer(GL_ELEMENT_ARRAY_BUFFER);
-
-		for(size_t i = 0; i < MAX_VERTEX_ATTRIBS; ++i)
+		if(pVAO->mAttribEnables & (1 << i))
 		{
-			if(pVAO->mAttribEnables & (1 << i))
-			{
-				VertexAttribState *pVAS = &pVAO->mAttribState[i];
-
-				if(pVAS->mBO == NULL && pVAS->mOffset == 0)
-					return false;
-			}
-		}
+			VertexAttribState *pVAS = &pVAO->mAttribState[i];
 
-		if(dc->mDrawType == DrawContext::kElementDraw)
-		{
-			if(!pElementBO && !dc->mIndices)
+			if(pVAS->mBO == NULL && pVAS->mOffset == 0)
 				return false;
 		}
+	}
 
-		Program *prog = gc->mPM.getCurrentProgram();
-		if (!prog)
+	if(dc->mDrawType == DrawContext::kElementDraw)
+	{
+		if(!pElementBO && !dc->mIndices)
 			return false;
+	}
 
-		VertexShader   *pVS = prog->getVS();
-		FragmentShader *pFS = prog->getFS();
-		if (!pVS || !pFS)
-			return false;
+	Program *prog = gc->mPM.getCurrentProgram();
+	if (!prog)
+		return false;
+
+	VertexShader   *pVS = prog->getVS();
+	FragmentShader *pFS = prog->getFS();
+	if (!pVS || !pFS)
+		return false;
+
+	if(!gc->mTM.validateTextureState(pVS, pFS, dc))
+		return false;
+
+	dc->mRasterStates->mIsDepthTestEnable = (gc->mState.mEnables & GLSP_DEPTH_TEST) ? 1 : 0;
+	dc->mRasterStates->mIsBlendEnable     = (gc->mState.mEnables & GLSP_BLEND) ? 1 : 0;
+	dc->mRasterStates->mIsDepthOnly       = mGLContext->mFBOM.GetDrawFBO()->IsDepthOnly() ? 1 : 0;
+	dc->mRasterStates->mFS = pFS;
 
-		if(!gc->mTM.validateTextureState(pVS, pFS, dc))
+	if (dc->mRasterStates->mIsDepthOnly)
+	{
+		if (!dc->mRasterStates->mIsDepthTestEnable)
 			return false;
 
-		dc->mRasterStates->mIsDepthTestEnable = (gc->mState.mEnables & GLSP_DEPTH_TEST) ? 1 : 0;
-		dc->mRasterStates->mIsBlendEnable     = (gc->mState.mEnables & GLSP_BLEND) ? 1 : 0;
-		dc->mRasterStates->mIsDepthOnly       = mGLContext->mFBOM.GetDrawFBO()->IsDepthOnly() ? 1 : 0;
-		dc->mRasterStates->mFS = pFS;
+		dc->mRasterStates->mIsBlendEnable = 0;
+	}
 
-		if (dc->mRasterStates->mIsDepthOnly)
-		{
-			if (!dc->mRasterStates->mIsDepthTestEnable)
-				return false;
+	// There is no stencil test without a stencil buffer, which is only
+	// known once the framebuffer is validated.
+	if ((mGLContext->mState.mEnables & GLSP_STENCIL_TEST) && mGLContext->mRT.pStencilBuffer)
+	{
+		dc->mRasterStates->mIsStencilTestEnable = 1;
+		dc->mRasterStates->mStencilState = mGLContext->mState.mStencilState;
+		mTBDR->SetStencilTestFlag();
+	}
+	else
+	{
+		dc->mRasterStates->mIsStencilTestEnable = 0;
+	}
 
-			dc->mRasterStates->mIsBlendEnable = 0;
-		}
+	if (mGLContext->mState.mEnables & GLSP_SCISSOR_TEST)
+	{
+		const GLScissor &scissor = mGLContext->mState.mScissor;
+
+		dc->mRasterStates->mIsScissorTestEnable = 1;
+		dc->mRasterStates->mScissorXMin = (std::max)(scissor.x, 0);
+		dc->mRasterStates->mScissorYMin = (std::max)(scissor.y, 0);
+		dc->mRasterStates->mScissorXMax = (std::min)(scissor.x + scissor.width,  mGLContext->mRT.width)  - 1;
+		dc->mRasterStates->mScissorYMax = (std::min)(scissor.y + scissor.height, mGLContext->mRT.height) - 1;
 	}
 	else
 	{
-		// glClear path
+		dc->mRasterStates->mIsScissorTestEnable = 0;
 	}
 
-	ret = mGLContext->mFBOM.ValidateFramebufferStatus(mGLContext);
-	if (ret && dc)
-		dc->mRasterStates->mDrawID = mDrawCount++;
+	dc->mRasterStates->mDrawID = mDrawCount++;
 
-	return ret;
+	return true;
 }
 
 void DrawEngine::beginFrame(GLContext *gc)
@@ -404,6 +455,36 @@ void DrawEngine::PerformClear(unsigned int mask)
 {
 	RenderTarget &rt = mGLContext->mRT;
 
+	if (!(mask & (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT)))
+		return;
+
+	// The clears only touch the scissor box.
+	int xmin = 0;
+	int ymin = 0;
+	int xmax = rt.width  - 1;
+	int ymax = rt.height - 1;
+
+	if (mGLContext->mState.mEnables & GLSP_SCISSOR_TEST)
+	{
+		const GLScissor &scissor = mGLContext->mState.mScissor;
+
+		xmin = (std::max)(scissor.x, 0);
+		ymin = (std::max)(scissor.y, 0);
+		xmax = (std::min)(scissor.x + scissor.width,  rt.width)  - 1;
+		ymax = (std::min)(scissor.y + scissor.height, rt.height) - 1;
+
+		if (xmin > xmax || ymin > ymax)
+			return;
+	}
+
+	// The clears are done at the beginning of the tile pass, before anything
+	// binned, so the primitives drawn before the clear must be flushed first.
+	// So are the pending clears of another rectangle.
+	if (mDrawCount || mTBDR->IsClearRectChanged(xmin, ymin, xmax, ymax))
+		Flush(false);
+
+	mTBDR->SetClearRect(xmin, ymin, xmax, ymax);
+
 	if (mask & GL_COLOR_BUFFER_BIT && rt.pColorBuffer)
 	{
 		uint8_t r = static_cast<uint8_t>(mGLContext->mState.mClearState.red   * 256.0f);
@@ -412,19 +493,11 @@ void DrawEngine::PerformClear(unsigned int mask)
 		uint8_t a = static_cast<uint8_t>(mGLContext->mState.mClearState.alpha * 256.0f);
 
 		uint32_t color = (r << 0) | (g << 8) | (b << 16) | (a << 24);
-		__m128i vColor = _mm_set1_epi32(color);
 
-		int count = rt.width * rt.height;
-		__m128i *addr = (__m128i *)rt.pColorBuffer;
-
-		// Assume 64 bytes cache line size
-		for(int i = 0; i < count; i += 16, addr += 4)
-		{
-			_mm_stream_si128(addr    , vColor);
-			_mm_stream_si128(addr + 1, vColor);
-			_mm_stream_si128(addr + 2, vColor);
-			_mm_stream_si128(addr + 3, vColor);
-		}
+		// Defer clear until the rasterizer stage begin, the same as depth.
+		// Each tile is cleared in cache by its worker, and the tiles
+		// with nothing drawn are streamed out in parallel.
+		mTBDR->SetColorClearFlag(color);
 	}
 
 	if (mask & GL_DEPTH_BUFFER_BIT && rt.pDepthBuffer)
@@ -437,7 +510,12 @@ void DrawEngine::PerformClear(unsigned int mask)
 
 	if (mask & GL_STENCIL_BUFFER_BIT && rt.pStencilBuffer)
 	{
-		// TODO: clear stencil buffer
+		// Deferred like depth, only the bits enabled by the stencil write mask are cleared.
+		uint8_t stencil    = static_cast<uint8_t>(mGLContext->mState.mClearState.stencil);
+		uint8_t write_mask = static_cast<uint8_t>(mGLContext->mState.mStencilState.writeMask);
+
+		if (write_mask)
+			mTBDR->SetStencilClearFlag(stencil, write_mask);
 	}
 }
 
@@ -445,22 +523,69 @@ void DrawEngine::emit(DrawContext *dc)
 {
 	linkGeomertryPipeStages();
 	getFirstStage()->emit(dc);
+
+	// The depth, stencil and color are stored and loaded back by the next
+	// render pass, so the flush is transparent. It's done when an automatic
+	// immediate mode render pass turns out heavy, to defer the rest of the
+	// frame, or when the bin memory is over the budget.
+	// The multisample render passes are not flushed, their samples would be
+	// resolved on store, so neither applies to them.
+	// NOTE: it's checked between the draws, one draw is never split.
+	if (mDrawCount && !mTBDR->IsMultisample() && mTBDR->IsImmediateModeOverrun())
+		Flush(false);
+
+	if (mBinMemoryBudget && mDrawCount && mTBDR->GetBinMemorySize() > mBinMemoryBudget)
+	{
+		if (!mTBDR->IsMultisample())
+		{
+			Flush(false);
+		}
+		else if (!mBinMemoryBudgetWarned)
+		{
+			GLSP_DPF(GLSP_DPF_LEVEL_WARNING, "Bin memory budget exceeded, not enforced in multisample render passes\n");
+			mBinMemoryBudgetWarned = true;
+		}
+	}
 }
 
 bool DrawEngine::SwapBuffers(NWMBufferToDisplay *buf)
 {
 	Flush(true);
 
-	buf->addr   = mGLContext->mRT.pColorBuffer;
-	buf->width  = mGLContext->mRT.width;
-	buf->height = mGLContext->mRT.height;
-	buf->format = mGLContext->mRT.format;
+	const RenderTarget &rt = mGLContext->mRT;
+
+	if (rt.layout == NWM_BUFFER_LAYOUT_SWIZZLED)
+	{
+		mTBDR->DetileColorBuffer();
+
+		buf->addr   = rt.pDisplayBuffer;
+		buf->layout = NWM_BUFFER_LAYOUT_LINEAR;
+	}
+	else
+	{
+		buf->addr   = rt.pColorBuffer;
+		buf->layout = rt.layout;
+	}
+
+	buf->width  = rt.width;
+	buf->height = rt.height;
+	buf->format = rt.format;
 
 	mGLContext->mbInFrame = false;
 
 	return true;
 }
 
+bool DrawEngine::SetMacroTileSize(int tile_size, int depth_only_tile_size)
+{
+	return mTBDR->SetMacroTileSize(tile_size, depth_only_tile_size);
+}
+
+bool DrawEngine::SetRenderMode(int mode)
+{
+	return mTBDR->SetRenderMode(mode);
+}
+
 void DrawEngine::Flush(bool swap_buffer)
 {
 	linkRasterizerPipeStages();
@@ -475,6 +600,10 @@ void DrawEngine::Flush(bool swap_buffer)
 
 bool glspCreateRender()
 {
+	// Pick the kernels for the running CPU before anything is drawn.
+	if (!SetupKernelTable())
+		return false;
+
 	DrawEngine &de = DrawEngine::getDrawEngine();
 
 	de.init();
@@ -493,4 +622,20 @@ void glspSetNativeWindowInfo(NWMWindowInfo *win_info)
 		DrawEngine::getDrawEngine().SetNativeWindowInfo(*win_info);
 }
 
+bool glspSetMacroTileSize(int tile_size, int depth_only_tile_size)
+{
+	return DrawEngine::getDrawEngine().SetMacroTileSize(tile_size, depth_only_tile_size);
+}
+
+// NOTE: not enforced in the multisample render passes, see DrawEngine::emit().
+void glspSetBinMemoryBudget(size_t budget)
+{
+	DrawEngine::getDrawEngine().SetBinMemoryBudget(budget);
+}
+
+bool glspSetRenderMode(int mode)
+{
+	return DrawEngine::getDrawEngine().SetRenderMode(mode);
+}
+
 } // namespace glsp
@@ -3,16 +3,13 @@
 #include "DrawEngineExport.h"
 #include "DataFlow.h"
 #include "Texture.h"
+#include "GLContext.h"
 
 
 namespace glsp {
 
 class GLContext;
 class VertexFetcher;
-class PrimitiveAssembler;
-class Clipper;
-class PerspectiveDivider;
-class ScreenMapper;
 class FaceCuller;
 class Binning;
 class TBDR;
@@ -36,8 +33,20 @@ struct RasterStates
 		int mIsDepthTestEnable : 1;
 		int mIsBlendEnable     : 1;
 		int mIsDepthOnly       : 1;
+		int mIsStencilTestEnable : 1;
+		int mIsScissorTestEnable : 1;
 	};
 
+	// Only valid if stencil test is enabled.
+	StencilState         mStencilState;
+
+	// Scissor box in pixels(inclusive), clamped to the render target.
+	// Only valid if scissor test is enabled.
+	int                  mScissorXMin;
+	int                  mScissorXMax;
+	int                  mScissorYMin;
+	int                  mScissorYMax;
+
 	uint32_t mDrawID;
 	FragmentShader 		*mFS;
 	Texture				*mTextures[MAX_TEXTURE_UNITS];
@@ -74,6 +83,7 @@ public:
 
 	void init();
 	void SetNativeWindowInfo(NWMWindowInfo &win_info);
+	bool validateRenderPass();
 	bool validateState(DrawContext *dc);
 	void prepareToDraw();
 	void emit(DrawContext *dc);
@@ -93,7 +103,6 @@ public:
 	void setFirstStage(PipeStage *stage) { mFirstStage = stage; }
 
 	RasterizationStage* getRastStage() const { return mRast; }
-	Clipper& GetClipper() const { return *mClipper; }
 
 	GLContext* GetGLContext() const { return mGLContext; }
 
@@ -101,6 +110,10 @@ public:
 
 	void Flush(bool swap_buffer);
 
+	bool SetMacroTileSize(int tile_size, int depth_only_tile_size);
+	void SetBinMemoryBudget(size_t budget) { mBinMemoryBudget = budget; }
+	bool SetRenderMode(int mode);
+
 protected:
 	DrawEngine();
 	~DrawEngine();
@@ -115,13 +128,12 @@ private:
 	// Use pointer member because there may be serveral impls of this components.
 	// And we may need to switch between those dynamically.
 	VertexFetcher 			*mVertexFetcher;
-	PrimitiveAssembler 		*mPrimAsbl;
-	Clipper 				*mClipper;
-	PerspectiveDivider 		*mDivider;
-	ScreenMapper 			*mMapper;
 	FaceCuller 				*mCuller;
 	Binning  				*mBinning;
 
+	// The fused geometry stages, indexed by the cull face enable.
+	PipeStage				*mGeometryPipelines[2];
+
 	TBDR                    *mTBDR;
 	Interpolater            *mInterpolater;
 	OwnershipTester         *mOwnershipTest;
@@ -140,6 +152,12 @@ private:
 
 	GLContext              *mGLContext;
 	uint32_t                mDrawCount;
+
+	// Flush the render pass in the middle of the frame if the binned
+	// primitives take more memory than this, 0 for no limit.
+	// The multisample render passes are never flushed for it.
+	size_t                  mBinMemoryBudget;
+	bool                    mBinMemoryBudgetWarned;
 };
 
 } // namespace glsp
@@ -1,12 +1,46 @@
 #pragma once
 
+#include <cstddef>
+
 namespace glsp {
 
+/* Memory layout of the window buffers.
+ * In the swizzled layout the buffer is made of 128x128 super tiles in row major
+ * order, padded to a whole number of super tiles. The 16x16 blocks of a super
+ * tile are in morton order and the pixels of a block in row major order, so
+ * each macro tile is contiguous and the tile load/store is a streaming copy.
+ */
+enum NWMBufferLayout
+{
+	NWM_BUFFER_LAYOUT_LINEAR = 0,
+
+	// Detiled to a linear buffer in glspSwapBuffers().
+	NWM_BUFFER_LAYOUT_SWIZZLED,
+
+	// The swizzled buffer is handed to the display as is.
+	NWM_BUFFER_LAYOUT_SWIZZLED_NO_DETILE
+};
+
+/* The immediate mode renders the light frames without binning the triangles
+ * to the tiles, the tiles pick their triangles from the flat list of the frame.
+ * It saves the binning and the per tile tasks.
+ */
+enum GLSPRenderMode
+{
+	// Immediate mode if the last frame is light in triangles and triangle memory,
+	// deferred for the first frame. A render pass which turns out heavy is
+	// flushed, and the rest of the frame is deferred.
+	GLSP_RENDER_MODE_AUTO = 0,
+	GLSP_RENDER_MODE_DEFERRED,
+	GLSP_RENDER_MODE_IMMEDIATE
+};
+
 struct NWMWindowInfo
 {
 	int width;
 	int height;
 	int format;
+	int layout;	// NWMBufferLayout
 };
 
 struct NWMBufferToDisplay
@@ -15,10 +49,24 @@ struct NWMBufferToDisplay
 	int   width;
 	int   height;
 	int   format;
+	int   layout;	// NWMBufferLayout
 };
 
 bool glspCreateRender();
 void glspSetNativeWindowInfo(NWMWindowInfo *win_info);
 bool glspSwapBuffers(NWMBufferToDisplay *buf);
 
+// Macro tile size of color pass and depth only pass, takes effect from next render pass.
+// Must be a power of 2 in [16, 128], return false otherwise.
+bool glspSetMacroTileSize(int tile_size, int depth_only_tile_size);
+
+// Memory budget of the primitives binned in a render pass, in bytes, 0 for no limit.
+// The render pass is flushed in the middle of the frame once a draw exceeds it.
+// NOTE: the budget does not apply to the multisample(GL_MULTISAMPLE) render
+// passes, they are never split and their bin memory is unbounded.
+void glspSetBinMemoryBudget(size_t budget);
+
+// GLSPRenderMode, takes effect from next render pass. Return false if the mode is invalid.
+bool glspSetRenderMode(int mode);
+
 } // namespace glsp
@@ -1,13 +1,12 @@
 #pragma once
 
-#include "PipeStage.h"
+#include "DataFlow.h"
 
 
 namespace glsp {
 
-class Batch;
-
-class FaceCuller: public PipeStage
+// Face culling of the geometry stages, see GeometryPipeline.
+class FaceCuller
 {
 public:
 	enum orient_t
@@ -23,14 +22,19 @@ public:
 		FRONT_AND_BACK = 0x3
 	};
 
-	FaceCuller();
-	virtual ~FaceCuller() { }
+	FaceCuller():
+		mOrient(CCW),
+		mCullFace(BACK)
+	{
+	}
 
-	virtual void emit(void *data);
-	virtual void finalize();
+	bool IsCulled(const Primitive &prim) const
+	{
+		orient_t orient = (prim.mAreaReciprocal > 0)? CCW: CW;
+		face_t face = (mOrient == orient)? FRONT: BACK;
 
-private:
-	void culling(Batch *bat);
+		return (mCullFace & face) != 0;
+	}
 
 private:
 	orient_t mOrient;
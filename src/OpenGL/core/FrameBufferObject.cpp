@@ -5,6 +5,7 @@
 #include "GLContext.h"
 #include "Texture.h"
 #include "DrawEngine.h"
+#include "TBDR.h"
 #include "khronos/GL/glspcorearb.h"
 
 
@@ -434,6 +435,9 @@ FrameBufferObject::~FrameBufferObject()
 
 		if (mRenderTarget.pStencilBuffer)
 			free(mRenderTarget.pStencilBuffer);
+
+		if (mRenderTarget.pDisplayBuffer)
+			free(mRenderTarget.pDisplayBuffer);
 	}
 	else
 	{
@@ -534,6 +538,10 @@ bool FrameBufferObject::ValidateFramebufferStatus(GLContext *gc)
 		gc->mRT.width  = width;
 		gc->mRT.height = height;
 
+		// Textures are always sampled linearly.
+		gc->mRT.layout = NWM_BUFFER_LAYOUT_LINEAR;
+		gc->mRT.pDisplayBuffer = nullptr;
+
 		// TODO: Multi render targets support
 		FBOAttachPoint &color_attachment = mAttachPoints[GLSP_COLOR_ATTACHMENT0];
 		if (mDrawMask & (1 << GLSP_COLOR_ATTACHMENT0) && color_attachment.attachment)
@@ -597,15 +605,17 @@ bool FrameBufferObject::ValidateFramebufferStatus(GLContext *gc)
 	return true;
 }
 
-void FrameBufferObject::DefaultFBOInitRenderTarget(int width, int height, int format)
+void FrameBufferObject::DefaultFBOInitRenderTarget(int width, int height, int format, int layout)
 {
 	bool need_recreate = false;
-	if (mRenderTarget.width != width || mRenderTarget.height != height || mRenderTarget.format != format)
+	if (mRenderTarget.width != width || mRenderTarget.height != height ||
+		mRenderTarget.format != format || mRenderTarget.layout != layout)
 		need_recreate = true;
 
 	mRenderTarget.width  = width;
 	mRenderTarget.height = height;
 	mRenderTarget.format = format;
+	mRenderTarget.layout = layout;
 
 	if (need_recreate)
 	{
@@ -626,17 +636,36 @@ void FrameBufferObject::DefaultFBOInitRenderTarget(int width, int height, int fo
 			free(mRenderTarget.pStencilBuffer);
 			mRenderTarget.pStencilBuffer = nullptr;
 		}
+
+		if (mRenderTarget.pDisplayBuffer)
+		{
+			free(mRenderTarget.pDisplayBuffer);
+			mRenderTarget.pDisplayBuffer = nullptr;
+		}
+	}
+
+	// The swizzled buffers are padded to whole super tiles, see NWMBufferLayout.
+	size_t pixels = (size_t)width * height;
+
+	if (layout != NWM_BUFFER_LAYOUT_LINEAR)
+	{
+		pixels = (size_t)ROUND_UP(width,  SWIZZLE_SUPER_TILE_SIZE) *
+				 (size_t)ROUND_UP(height, SWIZZLE_SUPER_TILE_SIZE);
 	}
 
 	// TODO: get bpp from buffer format
 	if (!mRenderTarget.pColorBuffer)
-		mRenderTarget.pColorBuffer = malloc(width * height * 4);
+		mRenderTarget.pColorBuffer = malloc(pixels * 4);
 
 	if (!mRenderTarget.pDepthBuffer)
-		mRenderTarget.pDepthBuffer = (float *)malloc(width * height * sizeof(float));
+		mRenderTarget.pDepthBuffer = (float *)malloc(pixels * sizeof(float));
+
+	// 8 bit stencil
+	if (!mRenderTarget.pStencilBuffer)
+		mRenderTarget.pStencilBuffer = malloc(pixels);
 
-	// TODO: impl stencil buffer
-	mRenderTarget.pStencilBuffer = nullptr;
+	if (!mRenderTarget.pDisplayBuffer && layout == NWM_BUFFER_LAYOUT_SWIZZLED)
+		mRenderTarget.pDisplayBuffer = malloc((size_t)width * height * 4);
 }
 
 void FrameBufferObject::SetReadDrawBuffers(int mask, bool draw, bool append)
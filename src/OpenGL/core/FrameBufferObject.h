@@ -75,9 +75,11 @@ struct RenderTarget
 	int width;
 	int height;
 	int format;
+	int layout;	// NWMBufferLayout, only the default FBO can be swizzled
 	void  *pColorBuffer;
 	float *pDepthBuffer;
 	void  *pStencilBuffer;
+	void  *pDisplayBuffer;	// linear copy of a swizzled color buffer
 };
 
 class FrameBufferObject: public NameItem
@@ -92,7 +94,7 @@ public:
 	int  GetDrawMask() const { return mDrawMask; }
 	bool IsDepthOnly() const;
 
-	void DefaultFBOInitRenderTarget(int width, int height, int format);
+	void DefaultFBOInitRenderTarget(int width, int height, int format, int layout);
 	bool ValidateFramebufferStatus(GLContext *gc);
 
 	bool HasPendingDrawCommand() const { return mHasPendingDrawCommand; }
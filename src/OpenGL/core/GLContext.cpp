@@ -46,6 +46,21 @@ GLAPI void APIENTRY glEnable (GLenum cap)
 			gc->mState.mEnables |= GLSP_BLEND;
 			break;
 		}
+		case GL_MULTISAMPLE:
+		{
+			gc->mState.mEnables |= GLSP_MULTISAMPLE;
+			break;
+		}
+		case GL_STENCIL_TEST:
+		{
+			gc->mState.mEnables |= GLSP_STENCIL_TEST;
+			break;
+		}
+		case GL_SCISSOR_TEST:
+		{
+			gc->mState.mEnables |= GLSP_SCISSOR_TEST;
+			break;
+		}
 		default:
 		{
 			GLSP_DPF(GLSP_DPF_LEVEL_ERROR, "unknown cap\n");
@@ -75,6 +90,21 @@ GLAPI void APIENTRY glDisable (GLenum cap)
 			gc->mState.mEnables &= ~GLSP_BLEND;
 			break;
 		}
+		case GL_MULTISAMPLE:
+		{
+			gc->mState.mEnables &= ~GLSP_MULTISAMPLE;
+			break;
+		}
+		case GL_STENCIL_TEST:
+		{
+			gc->mState.mEnables &= ~GLSP_STENCIL_TEST;
+			break;
+		}
+		case GL_SCISSOR_TEST:
+		{
+			gc->mState.mEnables &= ~GLSP_SCISSOR_TEST;
+			break;
+		}
 		default:
 		{
 			GLSP_DPF(GLSP_DPF_LEVEL_ERROR, "unknown cap\n");
@@ -82,6 +112,102 @@ GLAPI void APIENTRY glDisable (GLenum cap)
 	}
 }
 
+GLAPI void APIENTRY glScissor (GLint x, GLint y, GLsizei width, GLsizei height)
+{
+	__GET_CONTEXT();
+
+	if (width < 0 || height < 0)
+	{
+		GLSP_DPF(GLSP_DPF_LEVEL_ERROR, "Scissor: invalid size %d x %d\n", width, height);
+		return;
+	}
+
+	GLScissor &scissor = gc->mState.mScissor;
+
+	scissor.x      = x;
+	scissor.y      = y;
+	scissor.width  = width;
+	scissor.height = height;
+}
+
+static bool IsValidStencilFunc(GLenum func)
+{
+	switch (func)
+	{
+		case GL_NEVER:
+		case GL_LESS:
+		case GL_LEQUAL:
+		case GL_GREATER:
+		case GL_GEQUAL:
+		case GL_EQUAL:
+		case GL_NOTEQUAL:
+		case GL_ALWAYS:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static bool IsValidStencilOp(GLenum op)
+{
+	switch (op)
+	{
+		case GL_KEEP:
+		case GL_ZERO:
+		case GL_REPLACE:
+		case GL_INCR:
+		case GL_INCR_WRAP:
+		case GL_DECR:
+		case GL_DECR_WRAP:
+		case GL_INVERT:
+			return true;
+		default:
+			return false;
+	}
+}
+
+GLAPI void APIENTRY glStencilFunc (GLenum func, GLint ref, GLuint mask)
+{
+	__GET_CONTEXT();
+
+	if (!IsValidStencilFunc(func))
+	{
+		GLSP_DPF(GLSP_DPF_LEVEL_ERROR, "StencilFunc: invalid func %d\n", func);
+		return;
+	}
+
+	// ref is clamped to the range of the 8 bit stencil buffer.
+	StencilState &stencil = gc->mState.mStencilState;
+
+	stencil.func      = func;
+	stencil.ref       = (ref < 0) ? 0 : ((ref > 0xFF) ? 0xFF : ref);
+	stencil.valueMask = mask;
+}
+
+GLAPI void APIENTRY glStencilOp (GLenum fail, GLenum zfail, GLenum zpass)
+{
+	__GET_CONTEXT();
+
+	if (!IsValidStencilOp(fail) || !IsValidStencilOp(zfail) || !IsValidStencilOp(zpass))
+	{
+		GLSP_DPF(GLSP_DPF_LEVEL_ERROR, "StencilOp: invalid op\n");
+		return;
+	}
+
+	StencilState &stencil = gc->mState.mStencilState;
+
+	stencil.fail      = fail;
+	stencil.depthFail = zfail;
+	stencil.depthPass = zpass;
+}
+
+GLAPI void APIENTRY glStencilMask (GLuint mask)
+{
+	__GET_CONTEXT();
+
+	gc->mState.mStencilState.writeMask = mask;
+}
+
 GLContext *g_GC = nullptr;
 
 GLContext* getCurrentContext()
@@ -121,6 +247,16 @@ void GLContext::initGC()
 	mState.mClearState.depth   = 1.0;
 	mState.mClearState.stencil = 0;
 
+	memset(&mState.mScissor, 0, sizeof(mState.mScissor));
+
+	mState.mStencilState.func      = GL_ALWAYS;
+	mState.mStencilState.ref       = 0;
+	mState.mStencilState.valueMask = ~0u;
+	mState.mStencilState.writeMask = ~0u;
+	mState.mStencilState.fail      = GL_KEEP;
+	mState.mStencilState.depthFail = GL_KEEP;
+	mState.mStencilState.depthPass = GL_KEEP;
+
 	mState.mEnables    = 0;
 
 	memset(&mRT, 0, sizeof(mRT));
@@ -141,7 +277,7 @@ void GLContext::applyViewport(int x, int y, int width, int height)
 	vp.xCenter = vp.x + vp.xScale;
 	vp.yCenter = vp.y + vp.yScale;
 
-	DrawEngine::getDrawEngine().GetClipper().ComputeGuardband((float)width, (float)height);
+	Clipper::ComputeGuardband((float)width, (float)height);
 }
 
 
@@ -41,6 +41,25 @@ struct ClearState
 	int    stencil;
 };
 
+struct GLScissor
+{
+	int x, y;
+	int width, height;
+};
+
+// Front and back faces share the same stencil states.
+struct StencilState
+{
+	GLenum func;
+	GLint  ref;
+	GLuint valueMask;
+	GLuint writeMask;
+
+	GLenum fail;
+	GLenum depthFail;
+	GLenum depthPass;
+};
+
 /* NOTE:
  * No alpha test now in core profile.
  * Replaced by discard instruction in fragment shader.
@@ -60,6 +79,8 @@ struct GLStateMachine
 	int        mEnables;
 	GLViewport mViewport;
 	ClearState mClearState;
+	GLScissor  mScissor;
+	StencilState mStencilState;
 };
 
 // GLContext needs to be accessed by most components.
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "PipeStage.h"
+#include "DataFlow.h"
+#include "DrawEngine.h"
+#include "PrimitiveAssembler.h"
+#include "Clipper.h"
+#include "PerspectiveDivider.h"
+#include "ScreenMapper.h"
+#include "FaceCuller.h"
+
+
+namespace glsp {
+
+/* The geometry stages after the vertex shader, composed at compile time:
+ * primitive assembly, clipping, perspective dividing, viewport transform
+ * and face culling. One instantiation per state permutation, picked by
+ * DrawEngine::linkGeomertryPipeStages().
+ * Each primitive runs through all of the stages in one loop, instead of
+ * one walk of Batch::mPrims per stage.
+ */
+template <bool CullEnable>
+class GeometryPipeline: public PipeStage
+{
+public:
+	GeometryPipeline(const FaceCuller &culler):
+		PipeStage(CullEnable ? "Geometry Pipeline(Culling)" : "Geometry Pipeline", DrawEngine::getDrawEngine()),
+		mCuller(culler)
+	{
+	}
+
+	virtual ~GeometryPipeline() { }
+
+	virtual void emit(void *data)
+	{
+		Batch *bat = static_cast<Batch *>(data);
+
+		onGeometry(bat);
+
+		getNextStage()->emit(bat);
+	}
+
+private:
+	void onGeometry(Batch *bat)
+	{
+		const vsOutput_v &vs_out   = bat->mVsOut;
+		const IBuffer_v  &index    = bat->mIndexBuf;
+		const GLViewport &viewport = bat->mDC->gc->mState.mViewport;
+		Primlist         &pl       = bat->mPrims;
+
+		assert(index.size() % 3 == 0);
+
+		// Free the memory in Batch.mVertexCache to avoid large memory occupy
+		vsInput_v().swap(bat->mVertexCache);
+
+		Primitive *clipped[CLIP_MAX_PRIMS];
+
+		for (size_t i = 0; i < index.size(); i += 3)
+		{
+			Primitive *prim = PrimitiveAssembler::AssembleTriangle(vs_out, &index[i]);
+
+			const int count = Clipper::ClipPrimitive(prim, clipped);
+
+			for (int j = 0; j < count; ++j)
+			{
+				prim = clipped[j];
+
+				PerspectiveDivider::DividePrimitive(*prim);
+
+				if (!ScreenMapper::MapPrimitive(*prim, viewport) ||
+					(CullEnable && mCuller.IsCulled(*prim)))
+				{
+					DestroyPrimitive(prim);
+					continue;
+				}
+
+				pl.push_back(prim);
+			}
+		}
+
+		vsOutput_v().swap(bat->mVsOut);
+		IBuffer_v().swap(bat->mIndexBuf);
+	}
+
+	const FaceCuller &mCuller;
+};
+
+} // namespace glsp
@@ -0,0 +1,98 @@
+#include "Kernels.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "glsp_debug.h"
+
+
+namespace glsp {
+
+KernelTable g_Kernels;
+
+bool SetupKernelTable()
+{
+	bool avx2   = false;
+	bool avx512 = false;
+
+#if defined(__GNUC__)
+	__builtin_cpu_init();
+
+	if (!__builtin_cpu_supports("sse4.1"))
+	{
+		GLSP_DPF(GLSP_DPF_LEVEL_FATAL, "SSE4.1 is required at least!\n");
+		return false;
+	}
+
+	avx2   = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	avx512 = avx2 &&
+			 __builtin_cpu_supports("avx512f") &&
+			 __builtin_cpu_supports("avx512vl") &&
+			 __builtin_cpu_supports("avx512dq");
+#elif defined(_MSC_VER)
+	int regs[4];
+
+	__cpuid(regs, 0);
+	const int max_leaf = regs[0];
+
+	__cpuid(regs, 1);
+	const int ecx1 = regs[2];
+
+	if (!(ecx1 & (1 << 19)))
+	{
+		GLSP_DPF(GLSP_DPF_LEVEL_FATAL, "SSE4.1 is required at least!\n");
+		return false;
+	}
+
+	int ebx7 = 0;
+	if (max_leaf >= 7)
+	{
+		__cpuidex(regs, 7, 0);
+		ebx7 = regs[1];
+	}
+
+	// The wide registers are only usable if the OS saves their state(XCR0):
+	// XMM and YMM for AVX2, plus the opmask and ZMM for AVX-512.
+	const bool osxsave = (ecx1 & (1 << 27)) != 0;
+	const unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+
+	avx2   = (xcr0 & 0x06) == 0x06 &&
+			 (ecx1 & (1 << 28)) &&	// AVX
+			 (ecx1 & (1 << 12)) &&	// FMA
+			 (ebx7 & (1 << 5));		// AVX2
+	avx512 = avx2 &&
+			 (xcr0 & 0xe0) == 0xe0 &&
+			 (ebx7 & (1 << 16)) &&	// AVX512F
+			 (ebx7 & (1 << 17)) &&	// AVX512DQ
+			 (ebx7 & (1 << 31));	// AVX512VL
+#endif
+
+	// The ISA level can be capped with GLSP_KERNEL_ISA=sse4.1|avx2,
+	// e.g. to reproduce the result of the old nodes.
+	const char *cap = std::getenv("GLSP_KERNEL_ISA");
+	if (cap && !std::strcmp(cap, "sse4.1"))
+	{
+		avx2 = avx512 = false;
+	}
+	else if (cap && !std::strcmp(cap, "avx2"))
+	{
+		avx512 = false;
+	}
+
+	if (avx512)
+		InitKernelTableAVX512(g_Kernels);
+	else if (avx2)
+		InitKernelTableAVX2(g_Kernels);
+	else
+		InitKernelTableSSE41(g_Kernels);
+
+	GLSP_DPF(GLSP_DPF_LEVEL_MESSAGE, "Kernels: %s\n", g_Kernels.mISAName);
+
+	return true;
+}
+
+} // namespace glsp
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+
+#include "compiler.h"
+
+
+namespace glsp {
+
+class Triangle;
+struct TriangleSetupInput8;
+struct TriangleSetup8;
+struct Fsiosimd;
+
+/* The hot kernels are built once per ISA level from KernelsImpl.h
+ * (KernelsSSE41.cpp, KernelsAVX2.cpp and KernelsAVX512.cpp, each one
+ * with its own compile flags), the best one supported by the running
+ * CPU is picked by SetupKernelTable() in glspCreateRender().
+ * The rest of the pipeline is built for the SSE4.1 baseline.
+ *
+ * NOTE: the kernel TUs must not call any non-static inline function or
+ * template(e.g. std::min, glm, STL containers), the linker could pick the
+ * copy built with a wider ISA for the baseline code.
+ */
+struct KernelTable
+{
+	const char *mISAName;
+
+	// Set up edge equations, bounding boxes and the z/w/barycentric planes of
+	// SETUP_BLOCK_SIZE triangles, see Binning::SetupTriangles().
+	// sample_extent is the max distance of the samples from the pixel centre, in subpixels.
+	void     (*SetupTriangles)(const TriangleSetupInput8 &in, int width, int height, int sample_extent,
+							   bool depth_test, bool depth_only, TriangleSetup8 &out);
+
+	// Fine rasterization of one 8x8 micro tile, see TBDR::FineRasterizing().
+	uint64_t (*DepthTestMicroTile)(float *zbuf_pos, __m128 vNewZ,
+								   __m128 vZStepQuadx, __m128 vZStepQuady,
+								   float &zmin, float &zmax);
+
+	void     (*DepthWriteMicroTile)(float *zbuf_pos, __m128 vNewZ,
+									__m128 vZStepQuadx, __m128 vZStepQuady,
+									float &zmin, float &zmax);
+
+	uint64_t (*RasterizeMicroTile)(int xp, int yp, const int A[3], const int B[3], const int C[3],
+								   float *zbuf_pos, __m128 vNewZ,
+								   __m128 vZStepQuadx, __m128 vZStepQuady,
+								   float *zmin);
+
+	// Perspective correct interpolation of the attributes [1, regs_num) of
+	// count quads of the triangle, vert2/ape_a/ape_b are its vec4 register arrays.
+	void     (*InterpolateQuads)(const Triangle *tri, const float *vert2,
+								 const float *ape_a, const float *ape_b,
+								 int regs_num, Fsiosimd quads[], int count);
+
+	// Write/blend the colors of the quad at (x, y) to a RGBA8 color buffer.
+	void     (*WriteQuadColor)(uint32_t *color_buf, int width, int x, int y,
+							   const __m128 color[4], int coverage_mask);
+
+	void     (*BlendQuadColor)(uint32_t *color_buf, int width, int x, int y,
+							   const __m128 color[4], int coverage_mask);
+};
+
+extern KernelTable g_Kernels;
+
+// Return false if the CPU doesn't even support the baseline ISA.
+bool SetupKernelTable();
+
+void InitKernelTableSSE41(KernelTable &table);
+void InitKernelTableAVX2(KernelTable &table);
+void InitKernelTableAVX512(KernelTable &table);
+
+} // namespace glsp
@@ -0,0 +1,9 @@
+// Built with AVX2 and FMA enabled, see src/OpenGL/CMakeLists.txt
+#if !defined(__AVX2__)
+#	error "KernelsAVX2.cpp must be built with AVX2 enabled"
+#endif
+
+#define GLSP_KERNEL_INIT     InitKernelTableAVX2
+#define GLSP_KERNEL_ISA_NAME "AVX2"
+
+#include "KernelsImpl.h"
@@ -0,0 +1,9 @@
+// Built with AVX-512 F/VL/DQ enabled, see src/OpenGL/CMakeLists.txt
+#if !defined(__AVX512F__) || !defined(__AVX512VL__) || !defined(__AVX512DQ__)
+#	error "KernelsAVX512.cpp must be built with AVX-512 F/VL/DQ enabled"
+#endif
+
+#define GLSP_KERNEL_INIT     InitKernelTableAVX512
+#define GLSP_KERNEL_ISA_NAME "AVX-512"
+
+#include "KernelsImpl.h"
@@ -0,0 +1,952 @@
+/* ISA agnostic implementation of the hot kernels, see Kernels.h.
+ * It is included by one TU per ISA level, the code paths are picked with the
+ * ISA macros of the compiler, which come from the compile flags of that TU.
+ * Everything in here must be static, so that nothing is shared between TUs.
+ */
+
+#if !defined(GLSP_KERNEL_INIT) || !defined(GLSP_KERNEL_ISA_NAME)
+#	error "define GLSP_KERNEL_INIT and GLSP_KERNEL_ISA_NAME before including KernelsImpl.h"
+#endif
+
+#include <cfloat>
+
+#include "Kernels.h"
+#include "TBDR.h"
+#include "utils.h"
+#include "compiler.h"
+
+
+namespace glsp {
+
+/* Fine rasterization kernels, one micro tile per call.
+ * They come in SSE(4-wide, a quad per iteration), AVX2(8-wide, a micro tile
+ * row per iteration) and AVX-512(16-wide, a pair of rows per iteration) flavors,
+ * depending on the ISA level this TU is built for.
+ * vNewZ is the depth of the first 4 pixels of the micro tile, the wide versions
+ * extend it with the same quad steps, so all of them get the same depth values.
+ */
+#if defined(__AVX512F__) && defined(__AVX512VL__) && defined(__AVX512DQ__)
+#	define GLSP_RASTER_AVX512
+#elif defined(__AVX2__)
+#	define GLSP_RASTER_AVX2
+#endif
+
+#if defined(GLSP_RASTER_AVX512) || defined(GLSP_RASTER_AVX2)
+
+// Depth of a micro tile row, built from the first quad of the row.
+static inline __m256 _simd256_row_z(__m128 vNewZ, __m128 vZStepQuadx)
+{
+	return _mm256_insertf128_ps(_mm256_castps128_ps256(vNewZ), _mm_add_ps(vNewZ, vZStepQuadx), 1);
+}
+
+static inline float _simd256_hmin_ps(__m256 v)
+{
+	return _simd_hmin_ps(_mm_min_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+static inline float _simd256_hmax_ps(__m256 v)
+{
+	return _simd_hmax_ps(_mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+#endif
+
+#if defined(GLSP_RASTER_AVX512)
+
+// Depth of two micro tile rows, row k in the lower half and row k + 1 in the upper half.
+static inline __m512 _simd512_rows_z(__m128 vNewZ, __m128 vZStepQuadx, __m128 vZStepQuady)
+{
+	__m256 vRow0 = _simd256_row_z(vNewZ, vZStepQuadx);
+	__m256 vRow1 = _simd256_row_z(_mm_add_ps(vNewZ, vZStepQuady), vZStepQuadx);
+	return _mm512_insertf32x8(_mm512_castps256_ps512(vRow0), vRow1, 1);
+}
+
+static inline __m512 _simd512_load_rows(const float *zbuf_pos)
+{
+	return _mm512_insertf32x8(_mm512_castps256_ps512(_mm256_loadu_ps(zbuf_pos)),
+							  _mm256_loadu_ps(zbuf_pos + MAX_MACRO_TILE_SIZE), 1);
+}
+
+static inline void _simd512_mask_store_rows(float *zbuf_pos, __mmask16 mask, __m512 v)
+{
+	_mm256_mask_storeu_ps(zbuf_pos, (__mmask8)mask, _mm512_castps512_ps256(v));
+	_mm256_mask_storeu_ps(zbuf_pos + MAX_MACRO_TILE_SIZE, (__mmask8)(mask >> 8), _mm512_extractf32x8_ps(v, 1));
+}
+
+#endif
+
+// Depth test a micro tile fully covered by the triangle.
+// The exact min/max of the micro tile after the test are returned too.
+static inline uint64_t DepthTestMicroTile(float *zbuf_pos, __m128 vNewZ,
+										  __m128 vZStepQuadx, __m128 vZStepQuady,
+										  float &zmin, float &zmax)
+{
+	uint64_t coverage_mask = 0;
+
+#if defined(GLSP_RASTER_AVX512)
+	__m512 vZMin = _mm512_set1_ps( FLT_MAX);
+	__m512 vZMax = _mm512_set1_ps(-FLT_MAX);
+
+	for (int k = 0; k < MICRO_TILE_SIZE; k += 2, zbuf_pos += 2 * MAX_MACRO_TILE_SIZE)
+	{
+		__m512 vNewZx    = _simd512_rows_z(vNewZ, vZStepQuadx, vZStepQuady);
+		__m512 vCurrentZ = _simd512_load_rows(zbuf_pos);
+		__mmask16 mask   = _mm512_cmp_ps_mask(vNewZx, vCurrentZ, _CMP_LT_OS);
+		_simd512_mask_store_rows(zbuf_pos, mask, vNewZx);
+
+		__m512 vZ = _mm512_mask_blend_ps(mask, vCurrentZ, vNewZx);
+		vZMin = _mm512_min_ps(vZ, vZMin);
+		vZMax = _mm512_max_ps(vZ, vZMax);
+
+		coverage_mask |= ((uint64_t)mask << (k << MICRO_TILE_SIZE_SHIFT));
+
+		vNewZ = _mm_add_ps(_mm_add_ps(vNewZ, vZStepQuady), vZStepQuady);
+	}
+
+	zmin = _mm512_reduce_min_ps(vZMin);
+	zmax = _mm512_reduce_max_ps(vZMax);
+#elif defined(GLSP_RASTER_AVX2)
+	__m256 vZMin = _mm256_set1_ps( FLT_MAX);
+	__m256 vZMax = _mm256_set1_ps(-FLT_MAX);
+
+	for (int k = 0; k < MICRO_TILE_SIZE; ++k, zbuf_pos += MAX_MACRO_TILE_SIZE)
+	{
+		__m256 vNewZx    = _simd256_row_z(vNewZ, vZStepQuadx);
+		__m256 vCurrentZ = _mm256_loadu_ps(zbuf_pos);
+		__m256 vMask     = _mm256_cmp_ps(vNewZx, vCurrentZ, _CMP_LT_OS);
+		_mm256_maskstore_ps(zbuf_pos, _mm256_castps_si256(vMask), vNewZx);
+
+		__m256 vZ = _mm256_blendv_ps(vCurrentZ, vNewZx, vMask);
+		vZMin = _mm256_min_ps(vZ, vZMin);
+		vZMax = _mm256_max_ps(vZ, vZMax);
+
+		coverage_mask |= ((uint64_t)_mm256_movemask_ps(vMask) << (k << MICRO_TILE_SIZE_SHIFT));
+
+		vNewZ = _mm_add_ps(vNewZ, vZStepQuady);
+	}
+
+	zmin = _simd256_hmin_ps(vZMin);
+	zmax = _simd256_hmax_ps(vZMax);
+#else
+	__m128 vZMin = _mm_set_ps1( FLT_MAX);
+	__m128 vZMax = _mm_set_ps1(-FLT_MAX);
+
+	for (int k = 0; k < MICRO_TILE_SIZE; ++k)
+	{
+		float *zbuf_posx = zbuf_pos;
+		__m128 vNewZx = vNewZ;
+
+		for (int l = 0; l < MICRO_TILE_SIZE; l += 4)
+		{
+			__m128 vCurrentZ = _mm_load_ps(zbuf_posx);
+			__m128 vMask = _mm_cmplt_ps(vNewZx, vCurrentZ);
+
+			// The z buffer is private to this thread, blend and store the whole quad
+			__m128 vZ = _mm_blendv_ps(vCurrentZ, vNewZx, vMask);
+			_mm_store_ps(zbuf_posx, vZ);
+
+			vZMin = _mm_min_ps(vZ, vZMin);
+			vZMax = _mm_max_ps(vZ, vZMax);
+
+			uint64_t mask = (uint64_t)_mm_movemask_ps(vMask);
+			coverage_mask |= (mask << ((k << MICRO_TILE_SIZE_SHIFT) + l));
+
+			zbuf_posx   += 4;
+			vNewZx = _mm_add_ps(vNewZx, vZStepQuadx);
+		}
+
+		zbuf_pos   += MAX_MACRO_TILE_SIZE;
+		vNewZ = _mm_add_ps(vNewZ, vZStepQuady);
+	}
+
+	zmin = _simd_hmin_ps(vZMin);
+	zmax = _simd_hmax_ps(vZMax);
+#endif
+
+	return coverage_mask;
+}
+
+// HiZ said the whole micro tile passes the depth test, just write the depth.
+static inline void DepthWriteMicroTile(float *zbuf_pos, __m128 vNewZ,
+									   __m128 vZStepQuadx, __m128 vZStepQuady,
+									   float &zmin, float &zmax)
+{
+#if defined(GLSP_RASTER_AVX512)
+	__m512 vZMin = _mm512_set1_ps( FLT_MAX);
+	__m512 vZMax = _mm512_set1_ps(-FLT_MAX);
+
+	for (int k = 0; k < MICRO_TILE_SIZE; k += 2, zbuf_pos += 2 * MAX_MACRO_TILE_SIZE)
+	{
+		__m512 vNewZx = _simd512_rows_z(vNewZ, vZStepQuadx, vZStepQuady);
+		_simd512_mask_store_rows(zbuf_pos, 0xFFFF, vNewZx);
+
+		vZMin = _mm512_min_ps(vNewZx, vZMin);
+		vZMax = _mm512_max_ps(vNewZx, vZMax);
+
+		vNewZ = _mm_add_ps(_mm_add_ps(vNewZ, vZStepQuady), vZStepQuady);
+	}
+
+	zmin = _mm512_reduce_min_ps(vZMin);
+	zmax = _mm512_reduce_max_ps(vZMax);
+#elif defined(GLSP_RASTER_AVX2)
+	__m256 vZMin = _mm256_set1_ps( FLT_MAX);
+	__m256 vZMax = _mm256_set1_ps(-FLT_MAX);
+
+	for (int k = 0; k < MICRO_TILE_SIZE; ++k, zbuf_pos += MAX_MACRO_TILE_SIZE)
+	{
+		__m256 vNewZx = _simd256_row_z(vNewZ, vZStepQuadx);
+		_mm256_storeu_ps(zbuf_pos, vNewZx);
+
+		vZMin = _mm256_min_ps(vNewZx, vZMin);
+		vZMax = _mm256_max_ps(vNewZx, vZMax);
+
+		vNewZ = _mm_add_ps(vNewZ, vZStepQuady);
+	}
+
+	zmin = _simd256_hmin_ps(vZMin);
+	zmax = _simd256_hmax_ps(vZMax);
+#else
+	__m128 vZMin = _mm_set_ps1( FLT_MAX);
+	__m128 vZMax = _mm_set_ps1(-FLT_MAX);
+
+	for (int k = 0; k < MICRO_TILE_SIZE; ++k)
+	{
+		float *zbuf_posx = zbuf_pos;
+		__m128 vNewZx = vNewZ;
+
+		for (int l = 0; l < MICRO_TILE_SIZE; l += 4)
+		{
+			_mm_store_ps(zbuf_posx, vNewZx);
+
+			vZMin = _mm_min_ps(vNewZx, vZMin);
+			vZMax = _mm_max_ps(vNewZx, vZMax);
+
+			zbuf_posx   += 4;
+			vNewZx = _mm_add_ps(vNewZx, vZStepQuadx);
+		}
+
+		zbuf_pos   += MAX_MACRO_TILE_SIZE;
+		vNewZ = _mm_add_ps(vNewZ, vZStepQuady);
+	}
+
+	zmin = _simd_hmin_ps(vZMin);
+	zmax = _simd_hmax_ps(vZMax);
+#endif
+}
+
+/* Rasterize a micro tile partially covered by the triangle, with the tile
+ * relative edge equations from SetupTileEdges().
+ * (xp, yp) is the tile relative position of the micro tile.
+ * Depth test is done if zmin is not null, only the min depth can be tracked
+ * exactly in this case, the max depth is left as is, which is still conservative.
+ */
+static inline uint64_t RasterizeMicroTile(int xp, int yp, const int A[3], const int B[3], const int C[3],
+										  float *zbuf_pos, __m128 vNewZ,
+										  __m128 vZStepQuadx, __m128 vZStepQuady,
+										  float *zmin)
+{
+	uint64_t coverage_mask = 0;
+
+#if defined(GLSP_RASTER_AVX512)
+	const __m512i vX = _mm512_add_epi32(_mm512_set1_epi32(xp),
+										_mm512_set_epi32(7, 6, 5, 4, 3, 2, 1, 0, 7, 6, 5, 4, 3, 2, 1, 0));
+	const __m512i vY = _mm512_add_epi32(_mm512_set1_epi32(yp),
+										_mm512_set_epi32(1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0));
+
+	__m512i vArea0 = _mm512_add_epi32(_mm512_add_epi32(_mm512_mullo_epi32(_mm512_set1_epi32(A[0]), vX),
+													   _mm512_mullo_epi32(_mm512_set1_epi32(B[0]), vY)), _mm512_set1_epi32(C[0]));
+	__m512i vArea1 = _mm512_add_epi32(_mm512_add_epi32(_mm512_mullo_epi32(_mm512_set1_epi32(A[1]), vX),
+													   _mm512_mullo_epi32(_mm512_set1_epi32(B[1]), vY)), _mm512_set1_epi32(C[1]));
+	__m512i vArea2 = _mm512_add_epi32(_mm512_add_epi32(_mm512_mullo_epi32(_mm512_set1_epi32(A[2]), vX),
+													   _mm512_mullo_epi32(_mm512_set1_epi32(B[2]), vY)), _mm512_set1_epi32(C[2]));
+
+	const __m512i vAreaStep0 = _mm512_set1_epi32(B[0] << 1);
+	const __m512i vAreaStep1 = _mm512_set1_epi32(B[1] << 1);
+	const __m512i vAreaStep2 = _mm512_set1_epi32(B[2] << 1);
+
+	__m512 vZMin = _mm512_set1_ps(FLT_MAX);
+
+	for (int k = 0; k < MICRO_TILE_SIZE; k += 2,
+		vArea0 = _mm512_add_epi32(vArea0, vAreaStep0),
+		vArea1 = _mm512_add_epi32(vArea1, vAreaStep1),
+		vArea2 = _mm512_add_epi32(vArea2, vAreaStep2),
+		vNewZ  = _mm_add_ps(_mm_add_ps(vNewZ, vZStepQuady), vZStepQuady),
+		zbuf_pos += 2 * MAX_MACRO_TILE_SIZE)
+	{
+		// Inside all of the edges iff none of the areas is negative
+		__m512i vArea = _mm512_or_si512(_mm512_or_si512(vArea0, vArea1), vArea2);
+		__mmask16 mask = _mm512_cmpge_epi32_mask(vArea, _mm512_setzero_si512());
+
+		if (!mask)
+			continue;
+
+		if (zmin)
+		{
+			__m512 vNewZx    = _simd512_rows_z(vNewZ, vZStepQuadx, vZStepQuady);
+			__m512 vCurrentZ = _simd512_load_rows(zbuf_pos);
+			mask = _mm512_mask_cmp_ps_mask(mask, vNewZx, vCurrentZ, _CMP_LT_OS);
+			_simd512_mask_store_rows(zbuf_pos, mask, vNewZx);
+
+			vZMin = _mm512_min_ps(_mm512_mask_blend_ps(mask, vCurrentZ, vNewZx), vZMin);
+		}
+
+		coverage_mask |= ((uint64_t)mask << (k << MICRO_TILE_SIZE_SHIFT));
+	}
+
+	if (zmin)
+	{
+		const float micro_zmin = _mm512_reduce_min_ps(vZMin);
+		if (micro_zmin < *zmin)
+			*zmin = micro_zmin;
+	}
+#elif defined(GLSP_RASTER_AVX2)
+	const __m256i vX = _mm256_add_epi32(_mm256_set1_epi32(xp), _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+
+	__m256i vArea0 = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(A[0]), vX), _mm256_set1_epi32(B[0] * yp + C[0]));
+	__m256i vArea1 = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(A[1]), vX), _mm256_set1_epi32(B[1] * yp + C[1]));
+	__m256i vArea2 = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(A[2]), vX), _mm256_set1_epi32(B[2] * yp + C[2]));
+
+	const __m256i vAreaStep0 = _mm256_set1_epi32(B[0]);
+	const __m256i vAreaStep1 = _mm256_set1_epi32(B[1]);
+	const __m256i vAreaStep2 = _mm256_set1_epi32(B[2]);
+
+	__m256 vZMin = _mm256_set1_ps(FLT_MAX);
+
+	for (int k = 0; k < MICRO_TILE_SIZE; ++k,
+		vArea0 = _mm256_add_epi32(vArea0, vAreaStep0),
+		vArea1 = _mm256_add_epi32(vArea1, vAreaStep1),
+		vArea2 = _mm256_add_epi32(vArea2, vAreaStep2),
+		vNewZ  = _mm_add_ps(vNewZ, vZStepQuady),
+		zbuf_pos += MAX_MACRO_TILE_SIZE)
+	{
+		// Inside all of the edges iff none of the areas is negative
+		__m256i vArea = _mm256_or_si256(_mm256_or_si256(vArea0, vArea1), vArea2);
+		__m256i vMask = _mm256_cmpgt_epi32(vArea, _mm256_set1_epi32(-1));
+
+		if (_mm256_testz_si256(vMask, vMask))
+			continue;
+
+		if (zmin)
+		{
+			__m256 vNewZx    = _simd256_row_z(vNewZ, vZStepQuadx);
+			__m256 vCurrentZ = _mm256_loadu_ps(zbuf_pos);
+			vMask = _mm256_and_si256(vMask, _mm256_castps_si256(_mm256_cmp_ps(vNewZx, vCurrentZ, _CMP_LT_OS)));
+			_mm256_maskstore_ps(zbuf_pos, vMask, vNewZx);
+
+			vZMin = _mm256_min_ps(_mm256_blendv_ps(vCurrentZ, vNewZx, _mm256_castsi256_ps(vMask)), vZMin);
+		}
+
+		coverage_mask |= ((uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(vMask)) << (k << MICRO_TILE_SIZE_SHIFT));
+	}
+
+	if (zmin)
+	{
+		const float micro_zmin = _simd256_hmin_ps(vZMin);
+		if (micro_zmin < *zmin)
+			*zmin = micro_zmin;
+	}
+#else
+	__m128i vFactorA0 = _mm_set1_epi32(A[0]);
+	__m128i vFactorB0 = _mm_set1_epi32(B[0]);
+	__m128i vFactorC0 = _mm_set1_epi32(C[0]);
+
+	__m128i vFactorA1 = _mm_set1_epi32(A[1]);
+	__m128i vFactorB1 = _mm_set1_epi32(B[1]);
+	__m128i vFactorC1 = _mm_set1_epi32(C[1]);
+
+	__m128i vFactorA2 = _mm_set1_epi32(A[2]);
+	__m128i vFactorB2 = _mm_set1_epi32(B[2]);
+	__m128i vFactorC2 = _mm_set1_epi32(C[2]);
+
+	__m128i vAreaStepQuadx0 = _mm_slli_epi32(vFactorA0, 2);
+	__m128i vAreaStepQuadx1 = _mm_slli_epi32(vFactorA1, 2);
+	__m128i vAreaStepQuadx2 = _mm_slli_epi32(vFactorA2, 2);
+
+	__m128 vZMin = _mm_set_ps1(FLT_MAX);
+
+	__m128i vQuadX = _mm_set_epi32(xp + 3, xp + 2, xp + 1, xp);
+	__m128i vQuadY = _mm_set_epi32(yp, yp, yp, yp);
+	__m128i vArea0 = MAWrapper(vFactorB0, vQuadY, MAWrapper(vFactorA0, vQuadX, vFactorC0));
+	__m128i vArea1 = MAWrapper(vFactorB1, vQuadY, MAWrapper(vFactorA1, vQuadX, vFactorC1));
+	__m128i vArea2 = MAWrapper(vFactorB2, vQuadY, MAWrapper(vFactorA2, vQuadX, vFactorC2));
+
+	// OPT: narrow down to triangle's [min max] range?
+	for (int k = 0; k < MICRO_TILE_SIZE; ++k)
+	{
+		__m128  vNewZx  = vNewZ;
+		__m128i vArea0x = vArea0;
+		__m128i vArea1x = vArea1;
+		__m128i vArea2x = vArea2;
+
+		for (int l = 0; l < MICRO_TILE_SIZE; l += 4,
+			vArea0x = _mm_add_epi32(vArea0x, vAreaStepQuadx0),
+			vArea1x = _mm_add_epi32(vArea1x, vAreaStepQuadx1),
+			vArea2x = _mm_add_epi32(vArea2x, vAreaStepQuadx2),
+			vNewZx  = _mm_add_ps(vNewZx, vZStepQuadx))
+		{
+			__m128i vTest0 = _mm_cmplt_epi32(vArea0x, _mm_setzero_si128());
+			// This quad is totally outside the triangle
+			if (_mm_test_all_ones(vTest0))
+				continue;
+
+			__m128i vTest1 = _mm_cmplt_epi32(vArea1x, _mm_setzero_si128());
+			if (_mm_test_all_ones(vTest1))
+				continue;
+
+			__m128i vTest2 = _mm_cmplt_epi32(vArea2x, _mm_setzero_si128());
+			if (_mm_test_all_ones(vTest2))
+				continue;
+
+			__m128i vMask = _mm_andnot_si128(_mm_or_si128(_mm_or_si128(vTest0, vTest1), vTest2), _mm_set1_epi32(0xFFFFFFFF));
+
+			if (zmin)
+			{
+				float *zbuf_posx = zbuf_pos + k * MAX_MACRO_TILE_SIZE + l;
+				__m128 vCurrentZ = _mm_load_ps(zbuf_posx);
+				__m128i vTmp = _mm_castps_si128(_mm_cmplt_ps(vNewZx, vCurrentZ));
+				vMask = _mm_and_si128(vMask, vTmp);
+
+				__m128 vZ = _mm_blendv_ps(vCurrentZ, vNewZx, _mm_castsi128_ps(vMask));
+				_mm_store_ps(zbuf_posx, vZ);
+
+				vZMin = _mm_min_ps(vZ, vZMin);
+			}
+
+			uint64_t mask = (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(vMask));
+			coverage_mask |= (mask << ((k << MICRO_TILE_SIZE_SHIFT) + l));
+		}
+
+		vArea0 = _mm_add_epi32(vArea0, vFactorB0);
+		vArea1 = _mm_add_epi32(vArea1, vFactorB1);
+		vArea2 = _mm_add_epi32(vArea2, vFactorB2);
+		vNewZ  = _mm_add_ps(vNewZ, vZStepQuady);
+	}
+
+	if (zmin)
+	{
+		const float micro_zmin = _simd_hmin_ps(vZMin);
+		if (micro_zmin < *zmin)
+			*zmin = micro_zmin;
+	}
+#endif
+
+	return coverage_mask;
+}
+
+/* Triangle setup, SETUP_BLOCK_SIZE triangles per call.
+ * The AVX2 and AVX-512 versions do all of them 8-wide, the SSE one in two 4-wide passes.
+ */
+#if defined(GLSP_RASTER_AVX512) || defined(GLSP_RASTER_AVX2)
+
+#define SETUP_SIMD_WIDTH    8
+
+typedef __m256  setup_ps;
+typedef __m256i setup_si;
+
+#define _setup_load_ps      _mm256_load_ps
+#define _setup_store_ps     _mm256_store_ps
+#define _setup_set1_ps      _mm256_set1_ps
+#define _setup_add_ps       _mm256_add_ps
+#define _setup_sub_ps       _mm256_sub_ps
+#define _setup_mul_ps       _mm256_mul_ps
+#define _setup_min_ps       _mm256_min_ps
+#define _setup_max_ps       _mm256_max_ps
+#define _setup_andnot_ps    _mm256_andnot_ps
+#define _setup_rcp_ps       _mm256_rcp_ps
+#define _setup_setzero_ps   _mm256_setzero_ps
+#define _setup_cvtps_epi32  _mm256_cvtps_epi32
+#define _setup_store_si     _mm256_store_si256
+#define _setup_setzero_si   _mm256_setzero_si256
+#define _setup_set1_epi32   _mm256_set1_epi32
+#define _setup_add_epi32    _mm256_add_epi32
+#define _setup_sub_epi32    _mm256_sub_epi32
+#define _setup_slli_epi32   _mm256_slli_epi32
+#define _setup_srai_epi32   _mm256_srai_epi32
+#define _setup_min_epi32    _mm256_min_epi32
+#define _setup_max_epi32    _mm256_max_epi32
+#define _setup_cmpgt_epi32  _mm256_cmpgt_epi32
+#define _setup_cmpeq_epi32  _mm256_cmpeq_epi32
+#define _setup_and_si       _mm256_and_si256
+#define _setup_or_si        _mm256_or_si256
+#define _setup_andnot_si    _mm256_andnot_si256
+#define _setup_mul_epi32    _mm256_mul_epi32
+#define _setup_add_epi64    _mm256_add_epi64
+#define _setup_sub_epi64    _mm256_sub_epi64
+#define _setup_srli_epi64   _mm256_srli_epi64
+
+// Store the 64 bit even/odd lanes of _mm256_mul_epi32() in order.
+static inline void _setup_store_epi64(int64_t *ptr, __m256i vEven, __m256i vOdd)
+{
+	__m256i vLo = _mm256_unpacklo_epi64(vEven, vOdd);
+	__m256i vHi = _mm256_unpackhi_epi64(vEven, vOdd);
+
+	_mm256_store_si256((__m256i *)&ptr[0], _mm256_permute2x128_si256(vLo, vHi, 0x20));
+	_mm256_store_si256((__m256i *)&ptr[4], _mm256_permute2x128_si256(vLo, vHi, 0x31));
+}
+
+#else
+
+#define SETUP_SIMD_WIDTH    4
+
+typedef __m128  setup_ps;
+typedef __m128i setup_si;
+
+#define _setup_load_ps      _mm_load_ps
+#define _setup_store_ps     _mm_store_ps
+#define _setup_set1_ps      _mm_set_ps1
+#define _setup_add_ps       _mm_add_ps
+#define _setup_sub_ps       _mm_sub_ps
+#define _setup_mul_ps       _mm_mul_ps
+#define _setup_min_ps       _mm_min_ps
+#define _setup_max_ps       _mm_max_ps
+#define _setup_andnot_ps    _mm_andnot_ps
+#define _setup_rcp_ps       _mm_rcp_ps
+#define _setup_setzero_ps   _mm_setzero_ps
+#define _setup_cvtps_epi32  _mm_cvtps_epi32
+#define _setup_store_si     _mm_store_si128
+#define _setup_setzero_si   _mm_setzero_si128
+#define _setup_set1_epi32   _mm_set1_epi32
+#define _setup_add_epi32    _mm_add_epi32
+#define _setup_sub_epi32    _mm_sub_epi32
+#define _setup_slli_epi32   _mm_slli_epi32
+#define _setup_srai_epi32   _mm_srai_epi32
+#define _setup_min_epi32    _mm_min_epi32
+#define _setup_max_epi32    _mm_max_epi32
+#define _setup_cmpgt_epi32  _mm_cmpgt_epi32
+#define _setup_cmpeq_epi32  _mm_cmpeq_epi32
+#define _setup_and_si       _mm_and_si128
+#define _setup_or_si        _mm_or_si128
+#define _setup_andnot_si    _mm_andnot_si128
+#define _setup_mul_epi32    _mm_mul_epi32
+#define _setup_add_epi64    _mm_add_epi64
+#define _setup_sub_epi64    _mm_sub_epi64
+#define _setup_srli_epi64   _mm_srli_epi64
+
+// Store the 64 bit even/odd lanes of _mm_mul_epi32() in order.
+static inline void _setup_store_epi64(int64_t *ptr, __m128i vEven, __m128i vOdd)
+{
+	_mm_store_si128((__m128i *)&ptr[0], _mm_unpacklo_epi64(vEven, vOdd));
+	_mm_store_si128((__m128i *)&ptr[2], _mm_unpackhi_epi64(vEven, vOdd));
+}
+
+#endif
+
+// C = Xa * Yb - Xb * Ya + bias, the cross products are done in 64 bit.
+static inline void ComputeFactorC(setup_si vXa, setup_si vYb, setup_si vXb, setup_si vYa, setup_si vBias, int64_t *C)
+{
+	const setup_si vOne = _setup_set1_epi32(1);
+
+	// _mm_mul_epi32() only takes the even lanes, shift to get the odd ones.
+	setup_si vEven = _setup_sub_epi64(_setup_mul_epi32(vXa, vYb), _setup_mul_epi32(vXb, vYa));
+	vEven = _setup_add_epi64(vEven, _setup_mul_epi32(vBias, vOne));
+
+	setup_si vOdd = _setup_sub_epi64(_setup_mul_epi32(_setup_srli_epi64(vXa, 32), _setup_srli_epi64(vYb, 32)),
+									 _setup_mul_epi32(_setup_srli_epi64(vXb, 32), _setup_srli_epi64(vYa, 32)));
+	vOdd = _setup_add_epi64(vOdd, _setup_mul_epi32(_setup_srli_epi64(vBias, 32), vOne));
+
+	_setup_store_epi64(C, vEven, vOdd);
+}
+
+/* Top-left filling convention, the mask is -1 for the lanes whose edge
+ * is not a top or left one, which need C minus one.
+ * It's worth memtioning that for shared vertices case,
+ * the vertices will be drawn only if them are shared
+ * between top left edges, i.e. top-left or left-left.
+ * Other kind of shared vertices, like top-right, left-bottom,
+ * will all be abandoned.
+ */
+static inline setup_si TopLeftBias(setup_si vDy, setup_si vDx)
+{
+	const setup_si vZero = _setup_setzero_si();
+
+	setup_si vMask  = _setup_cmpgt_epi32(vDy, vZero);
+	setup_si vMask1 = _setup_and_si(_setup_cmpeq_epi32(vDy, vZero), _setup_cmpgt_epi32(vZero, vDx));
+	vMask = _setup_or_si(vMask, vMask1);
+
+	return _setup_sub_epi32(vZero, _setup_andnot_si(vMask, _setup_set1_epi32(1)));
+}
+
+// Edge equation i, from the edge (Xa, Ya) -> (Xb, Yb) and vDy = Ya - Yb, vDx = Xb - Xa.
+static inline void SetupEdge(TriangleSetup8 &out, int i, int k,
+							 setup_si vXa, setup_si vYa, setup_si vXb, setup_si vYb,
+							 setup_si vDy, setup_si vDx)
+{
+	_setup_store_si((setup_si *)&out.mFactorA[i][k], _setup_slli_epi32(vDy, RAST_SUBPIXEL_BITS));
+	_setup_store_si((setup_si *)&out.mFactorB[i][k], _setup_slli_epi32(vDx, RAST_SUBPIXEL_BITS));
+
+	/* Add an offset to C, because, we need take into
+	 * account the conversion between fixed-point coordinates
+	 * (origin is the left bottom of the screen) and the pixel
+	 * coordinates(center of a pixel grid).
+	 */
+	setup_si vBias = _setup_add_epi32(_setup_slli_epi32(vDy, RAST_SUBPIXEL_BITS - 1),
+									  _setup_slli_epi32(vDx, RAST_SUBPIXEL_BITS - 1));
+	vBias = _setup_add_epi32(vBias, TopLeftBias(vDy, vDx));
+	ComputeFactorC(vXa, vYb, vXb, vYa, vBias, &out.mFactorC[i][k]);
+}
+
+/* Bounding box on one axis, in pixels with a sample inside the extent of the
+ * vertices, clamped to the render target. It's empty(min > max) if the
+ * triangle can't cover any sample.
+ */
+static inline void SetupBounds(setup_si v0, setup_si v1, setup_si v2, int max_pixel, int sample_extent, int *vmin, int *vmax)
+{
+	// The samples of pixel i are in (i << RAST_SUBPIXEL_BITS) + half +/- sample_extent.
+	const setup_si vHalfMin = _setup_set1_epi32(RAST_SUBPIXELS / 2 + sample_extent);
+	const setup_si vHalfMax = _setup_set1_epi32(RAST_SUBPIXELS / 2 - sample_extent);
+
+	setup_si vMin = _setup_sub_epi32(_setup_min_epi32(_setup_min_epi32(v0, v1), v2), vHalfMin);
+	vMin = _setup_srai_epi32(_setup_add_epi32(vMin, _setup_set1_epi32(RAST_SUBPIXELS - 1)), RAST_SUBPIXEL_BITS);
+	_setup_store_si((setup_si *)vmin, _setup_max_epi32(vMin, _setup_setzero_si()));
+
+	setup_si vMax = _setup_sub_epi32(_setup_max_epi32(_setup_max_epi32(v0, v1), v2), vHalfMax);
+	vMax = _setup_srai_epi32(vMax, RAST_SUBPIXEL_BITS);
+	_setup_store_si((setup_si *)vmax, _setup_min_epi32(vMax, _setup_set1_epi32(max_pixel)));
+}
+
+static inline void SetupTrianglesSIMD(const TriangleSetupInput8 &in, int k, int width, int height, int sample_extent,
+									  bool depth_test, bool depth_only, TriangleSetup8 &out)
+{
+	const setup_ps vSubpixelsf = _setup_set1_ps(RAST_SUBPIXELS);
+	const setup_ps vOneHalf    = _setup_set1_ps(0.5f);
+
+	setup_ps vX0f = _setup_load_ps(&in.mX[0][k]);
+	setup_ps vY0f = _setup_load_ps(&in.mY[0][k]);
+	setup_ps vX1f = _setup_load_ps(&in.mX[1][k]);
+	setup_ps vY1f = _setup_load_ps(&in.mY[1][k]);
+	setup_ps vX2f = _setup_load_ps(&in.mX[2][k]);
+	setup_ps vY2f = _setup_load_ps(&in.mY[2][k]);
+
+	/* Fixed point rasterization algorithm
+	 */
+	setup_si vX0 = _setup_cvtps_epi32(_setup_add_ps(_setup_mul_ps(vX0f, vSubpixelsf), vOneHalf));
+	setup_si vY0 = _setup_cvtps_epi32(_setup_add_ps(_setup_mul_ps(vY0f, vSubpixelsf), vOneHalf));
+	setup_si vX1 = _setup_cvtps_epi32(_setup_add_ps(_setup_mul_ps(vX1f, vSubpixelsf), vOneHalf));
+	setup_si vY1 = _setup_cvtps_epi32(_setup_add_ps(_setup_mul_ps(vY1f, vSubpixelsf), vOneHalf));
+	setup_si vX2 = _setup_cvtps_epi32(_setup_add_ps(_setup_mul_ps(vX2f, vSubpixelsf), vOneHalf));
+	setup_si vY2 = _setup_cvtps_epi32(_setup_add_ps(_setup_mul_ps(vY2f, vSubpixelsf), vOneHalf));
+
+	SetupEdge(out, 0, k, vX1, vY1, vX2, vY2, _setup_sub_epi32(vY1, vY2), _setup_sub_epi32(vX2, vX1));
+	SetupEdge(out, 1, k, vX2, vY2, vX0, vY0, _setup_sub_epi32(vY2, vY0), _setup_sub_epi32(vX0, vX2));
+	SetupEdge(out, 2, k, vX0, vY0, vX1, vY1, _setup_sub_epi32(vY0, vY1), _setup_sub_epi32(vX1, vX0));
+
+	SetupBounds(vX0, vX1, vX2, width  - 1, sample_extent, &out.mXMin[k], &out.mXMax[k]);
+	SetupBounds(vY0, vY1, vY2, height - 1, sample_extent, &out.mYMin[k], &out.mYMax[k]);
+
+	setup_ps vAreaRecip = _setup_andnot_ps(_setup_set1_ps(-0.0f), _setup_load_ps(&in.mAreaReciprocal[k]));
+
+	setup_ps vY1Y2f = _setup_mul_ps(_setup_sub_ps(vY1f, vY2f), vAreaRecip);
+	setup_ps vY2Y0f = _setup_mul_ps(_setup_sub_ps(vY2f, vY0f), vAreaRecip);
+	setup_ps vY0Y1f = _setup_mul_ps(_setup_sub_ps(vY0f, vY1f), vAreaRecip);
+
+	setup_ps vX2X1f = _setup_mul_ps(_setup_sub_ps(vX2f, vX1f), vAreaRecip);
+	setup_ps vX0X2f = _setup_mul_ps(_setup_sub_ps(vX0f, vX2f), vAreaRecip);
+	setup_ps vX1X0f = _setup_mul_ps(_setup_sub_ps(vX1f, vX0f), vAreaRecip);
+
+	// Substracted by 0.5f because of the conversion b/w
+	// pixel index and window coodinates, this avoid per-pixel
+	// substraction.
+	setup_ps vXoffset = _setup_sub_ps(vX0f, vOneHalf);
+	setup_ps vYoffset = _setup_sub_ps(vY0f, vOneHalf);
+
+	if (depth_test)
+	{
+		setup_ps vZ0f = _setup_load_ps(&in.mZ[0][k]);
+		setup_ps vZ1f = _setup_load_ps(&in.mZ[1][k]);
+		setup_ps vZ2f = _setup_load_ps(&in.mZ[2][k]);
+
+		setup_ps vZGradientX = _setup_add_ps(_setup_add_ps(_setup_mul_ps(vY1Y2f, vZ0f), _setup_mul_ps(vY2Y0f, vZ1f)),
+											 _setup_mul_ps(vY0Y1f, vZ2f));
+		setup_ps vZGradientY = _setup_add_ps(_setup_add_ps(_setup_mul_ps(vX2X1f, vZ0f), _setup_mul_ps(vX0X2f, vZ1f)),
+											 _setup_mul_ps(vX1X0f, vZ2f));
+		setup_ps vZAtOrigin  = _setup_sub_ps(_setup_sub_ps(vZ0f, _setup_mul_ps(vZGradientX, vXoffset)),
+											 _setup_mul_ps(vZGradientY, vYoffset));
+
+		_setup_store_ps(&out.mZGradientX[k], vZGradientX);
+		_setup_store_ps(&out.mZGradientY[k], vZGradientY);
+		_setup_store_ps(&out.mZAtOrigin[k],  vZAtOrigin);
+		_setup_store_ps(&out.mZMin[k], _setup_min_ps(_setup_min_ps(vZ0f, vZ1f), vZ2f));
+		_setup_store_ps(&out.mZMax[k], _setup_max_ps(_setup_max_ps(vZ0f, vZ1f), vZ2f));
+	}
+
+	if (depth_only)
+		return;
+
+	setup_ps vWReciprocal0 = _setup_rcp_ps(_setup_load_ps(&in.mW[0][k]));
+	setup_ps vWReciprocal1 = _setup_rcp_ps(_setup_load_ps(&in.mW[1][k]));
+	setup_ps vWReciprocal2 = _setup_rcp_ps(_setup_load_ps(&in.mW[2][k]));
+
+	setup_ps vLambdax0 = _setup_mul_ps(vY1Y2f, vWReciprocal0);
+	setup_ps vLambdax1 = _setup_mul_ps(vY2Y0f, vWReciprocal1);
+	setup_ps vLambdax2 = _setup_mul_ps(vY0Y1f, vWReciprocal2);
+
+	setup_ps vLambday0 = _setup_mul_ps(vX2X1f, vWReciprocal0);
+	setup_ps vLambday1 = _setup_mul_ps(vX0X2f, vWReciprocal1);
+	setup_ps vLambday2 = _setup_mul_ps(vX1X0f, vWReciprocal2);
+
+	_setup_store_ps(&out.mPCBCOnW0GradientX[k], vLambdax0);
+	_setup_store_ps(&out.mPCBCOnW0GradientY[k], vLambday0);
+	_setup_store_ps(&out.mPCBCOnW0AtOrigin[k],
+					_setup_sub_ps(_setup_sub_ps(vWReciprocal0, _setup_mul_ps(vLambdax0, vXoffset)),
+								  _setup_mul_ps(vLambday0, vYoffset)));
+
+	_setup_store_ps(&out.mPCBCOnW1GradientX[k], vLambdax1);
+	_setup_store_ps(&out.mPCBCOnW1GradientY[k], vLambday1);
+	_setup_store_ps(&out.mPCBCOnW1AtOrigin[k],
+					_setup_sub_ps(_setup_sub_ps(_setup_setzero_ps(), _setup_mul_ps(vLambdax1, vXoffset)),
+								  _setup_mul_ps(vLambday1, vYoffset)));
+
+	setup_ps vWRecipGradientX = _setup_add_ps(_setup_add_ps(vLambdax0, vLambdax1), vLambdax2);
+	setup_ps vWRecipGradientY = _setup_add_ps(_setup_add_ps(vLambday0, vLambday1), vLambday2);
+
+	_setup_store_ps(&out.mWRecipGradientX[k], vWRecipGradientX);
+	_setup_store_ps(&out.mWRecipGradientY[k], vWRecipGradientY);
+	_setup_store_ps(&out.mWRecipAtOrigin[k],
+					_setup_sub_ps(_setup_sub_ps(vWReciprocal0, _setup_mul_ps(vWRecipGradientX, vXoffset)),
+								  _setup_mul_ps(vWRecipGradientY, vYoffset)));
+}
+
+static void SetupTriangles(const TriangleSetupInput8 &in, int width, int height, int sample_extent,
+						   bool depth_test, bool depth_only, TriangleSetup8 &out)
+{
+	for (int k = 0; k < SETUP_BLOCK_SIZE; k += SETUP_SIMD_WIDTH)
+	{
+		SetupTrianglesSIMD(in, k, width, height, sample_extent, depth_test, depth_only, out);
+	}
+}
+
+static inline void CalculatePlaneEquation(__m128 &A, __m128 &lambda0, __m128 &B, __m128 &lambda1, __m128 &C)
+{
+#if defined(__FMA__)
+	// FMA, relaxed floating-point precision
+	C = _mm_fmadd_ps(A, lambda0, C);
+	C = _mm_fmadd_ps(B, lambda1, C);
+#else
+	__m128 vTmp = _mm_mul_ps(A, lambda0);
+	C           = _mm_add_ps(C, vTmp);
+	vTmp        = _mm_mul_ps(B, lambda1);
+	C           = _mm_add_ps(C, vTmp);
+#endif
+}
+
+#if defined(GLSP_RASTER_AVX512) || defined(GLSP_RASTER_AVX2)
+
+static inline void CalculatePlaneEquation(__m256 &A, __m256 &lambda0, __m256 &B, __m256 &lambda1, __m256 &C)
+{
+#if defined(__FMA__)
+	C = _mm256_fmadd_ps(A, lambda0, C);
+	C = _mm256_fmadd_ps(B, lambda1, C);
+#else
+	__m256 vTmp = _mm256_mul_ps(A, lambda0);
+	C           = _mm256_add_ps(C, vTmp);
+	vTmp        = _mm256_mul_ps(B, lambda1);
+	C           = _mm256_add_ps(C, vTmp);
+#endif
+}
+
+// Two quads in one go, quad0 in the lower half and quad1 in the upper half.
+static inline void InterpolateQuadPair(const TriangleSetup8 &setup, int lane,
+									   const float *vert2, const float *ape_a, const float *ape_b,
+									   int regs_num, Fsiosimd &quad0, Fsiosimd &quad1)
+{
+	__m256 vX = _mm256_cvtepi32_ps(_mm256_set_epi32(quad1.x + 1, quad1.x, quad1.x + 1, quad1.x,
+													quad0.x + 1, quad0.x, quad0.x + 1, quad0.x));
+	__m256 vY = _mm256_cvtepi32_ps(_mm256_set_epi32(quad1.y + 1, quad1.y + 1, quad1.y, quad1.y,
+													quad0.y + 1, quad0.y + 1, quad0.y, quad0.y));
+
+	__m256 vGradX = _mm256_set1_ps(setup.mWRecipGradientX[lane]);
+	__m256 vGradY = _mm256_set1_ps(setup.mWRecipGradientY[lane]);
+	__m256 vW     = _mm256_set1_ps(setup.mWRecipAtOrigin[lane]);
+	CalculatePlaneEquation(vGradX, vX, vGradY, vY, vW);
+	vW = _mm256_rcp_ps(vW);
+
+	vGradX        = _mm256_set1_ps(setup.mPCBCOnW0GradientX[lane]);
+	vGradY        = _mm256_set1_ps(setup.mPCBCOnW0GradientY[lane]);
+	__m256 vPCBC0 = _mm256_set1_ps(setup.mPCBCOnW0AtOrigin[lane]);
+	CalculatePlaneEquation(vGradX, vX, vGradY, vY, vPCBC0);
+	vPCBC0 = _mm256_mul_ps(vPCBC0, vW);
+
+	vGradX        = _mm256_set1_ps(setup.mPCBCOnW1GradientX[lane]);
+	vGradY        = _mm256_set1_ps(setup.mPCBCOnW1GradientY[lane]);
+	__m256 vPCBC1 = _mm256_set1_ps(setup.mPCBCOnW1AtOrigin[lane]);
+	CalculatePlaneEquation(vGradX, vX, vGradY, vY, vPCBC1);
+	vPCBC1 = _mm256_mul_ps(vPCBC1, vW);
+
+	__m256 vRes;
+	__m256 vAPEA, vAPEB;
+	for (int i = 4; i < 4 * regs_num; ++i)
+	{
+		vRes  = _mm256_set1_ps(vert2[i]);
+		vAPEA = _mm256_set1_ps(ape_a[i]);
+		vAPEB = _mm256_set1_ps(ape_b[i]);
+		CalculatePlaneEquation(vAPEA, vPCBC0, vAPEB, vPCBC1, vRes);
+		_mm_store_ps((float *)&quad0.mInRegs[i], _mm256_castps256_ps128(vRes));
+		_mm_store_ps((float *)&quad1.mInRegs[i], _mm256_extractf128_ps(vRes, 1));
+	}
+}
+
+#endif
+
+static inline void InterpolateQuad(const TriangleSetup8 &setup, int lane,
+								   const float *vert2, const float *ape_a, const float *ape_b,
+								   int regs_num, Fsiosimd &quad)
+{
+	__m128 vX = _mm_cvtepi32_ps(_mm_set_epi32(quad.x + 1, quad.x, quad.x + 1, quad.x));
+	__m128 vY = _mm_cvtepi32_ps(_mm_set_epi32(quad.y + 1, quad.y + 1, quad.y, quad.y));
+
+	__m128 vGradX = _mm_set_ps1(setup.mWRecipGradientX[lane]);
+	__m128 vGradY = _mm_set_ps1(setup.mWRecipGradientY[lane]);
+	__m128 vW     = _mm_set_ps1(setup.mWRecipAtOrigin[lane]);
+	CalculatePlaneEquation(vGradX, vX, vGradY, vY, vW);
+	vW = _mm_rcp_ps(vW);
+
+	vGradX        = _mm_set_ps1(setup.mPCBCOnW0GradientX[lane]);
+	vGradY        = _mm_set_ps1(setup.mPCBCOnW0GradientY[lane]);
+	__m128 vPCBC0 = _mm_set_ps1(setup.mPCBCOnW0AtOrigin[lane]);
+	CalculatePlaneEquation(vGradX, vX, vGradY, vY, vPCBC0);
+	vPCBC0 = _mm_mul_ps(vPCBC0, vW);
+
+	vGradX        = _mm_set_ps1(setup.mPCBCOnW1GradientX[lane]);
+	vGradY        = _mm_set_ps1(setup.mPCBCOnW1GradientY[lane]);
+	__m128 vPCBC1 = _mm_set_ps1(setup.mPCBCOnW1AtOrigin[lane]);
+	CalculatePlaneEquation(vGradX, vX, vGradY, vY, vPCBC1);
+	vPCBC1 = _mm_mul_ps(vPCBC1, vW);
+
+	__m128 vRes;
+	__m128 vAPEA, vAPEB;
+	for (int i = 4; i < 4 * regs_num; ++i)
+	{
+		vRes  = _mm_set_ps1(vert2[i]);
+		vAPEA = _mm_set_ps1(ape_a[i]);
+		vAPEB = _mm_set_ps1(ape_b[i]);
+		CalculatePlaneEquation(vAPEA, vPCBC0, vAPEB, vPCBC1, vRes);
+		_mm_store_ps((float *)&quad.mInRegs[i], vRes);
+	}
+}
+
+// The wide versions do two quads(8 lanes) per iteration.
+static void InterpolateQuads(const Triangle *tri, const float *vert2,
+							 const float *ape_a, const float *ape_b,
+							 int regs_num, Fsiosimd quads[], int count)
+{
+	const TriangleSetup8 &setup = *tri->mSetup;
+	const int lane = tri->mSetupLane;
+	int q = 0;
+
+#if defined(GLSP_RASTER_AVX512) || defined(GLSP_RASTER_AVX2)
+	for (; q + 2 <= count; q += 2)
+	{
+		InterpolateQuadPair(setup, lane, vert2, ape_a, ape_b, regs_num, quads[q], quads[q + 1]);
+	}
+#endif
+
+	for (; q < count; ++q)
+	{
+		InterpolateQuad(setup, lane, vert2, ape_a, ape_b, regs_num, quads[q]);
+	}
+}
+
+// Convert the colors of a quad to RGBA8, pixel i in lane i.
+static inline __m128i PackQuadColor(const __m128 color[4])
+{
+	const __m128 vScale = _mm_set_ps1(256.0f);
+
+	__m128i vColor0 = _mm_cvtps_epi32(_mm_mul_ps(color[0], vScale));
+	__m128i vColor1 = _mm_cvtps_epi32(_mm_mul_ps(color[1], vScale));
+	__m128i vColor2 = _mm_cvtps_epi32(_mm_mul_ps(color[2], vScale));
+	__m128i vColor3 = _mm_cvtps_epi32(_mm_mul_ps(color[3], vScale));
+
+	// The saturation of the signed 32->16 and unsigned 16->8 packs is the [0, 255] clamp.
+	return _mm_packus_epi16(_mm_packs_epi32(vColor0, vColor1), _mm_packs_epi32(vColor2, vColor3));
+}
+
+/* Store the pixels of a quad enabled in coverage_mask,
+ * lane 0/1 to (x, y)/(x + 1, y), lane 2/3 to (x, y + 1)/(x + 1, y + 1).
+ */
+static inline void StoreQuadColor(uint32_t *color_buf, int width, int x, int y,
+								  __m128i vColor, int coverage_mask)
+{
+	uint32_t *row0 = color_buf + y * width + x;
+	uint32_t *row1 = row0 + width;
+
+#if defined(GLSP_RASTER_AVX512)
+	// Disabled lanes of the masked store never touch the memory.
+	_mm_mask_storeu_epi32(row0,     (__mmask8)(coverage_mask & 0x3), vColor);
+	_mm_mask_storeu_epi32(row1 - 2, (__mmask8)(coverage_mask & 0xC), vColor);
+#else
+	if ((coverage_mask & 0x3) == 0x3)
+	{
+		_mm_storel_epi64((__m128i *)row0, vColor);
+	}
+	else
+	{
+		if (coverage_mask & 0x1)
+			row0[0] = _mm_cvtsi128_si32(vColor);
+		if (coverage_mask & 0x2)
+			row0[1] = _mm_extract_epi32(vColor, 1);
+	}
+
+	if ((coverage_mask & 0xC) == 0xC)
+	{
+		_mm_storel_epi64((__m128i *)row1, _mm_unpackhi_epi64(vColor, vColor));
+	}
+	else
+	{
+		if (coverage_mask & 0x4)
+			row1[0] = _mm_extract_epi32(vColor, 2);
+		if (coverage_mask & 0x8)
+			row1[1] = _mm_extract_epi32(vColor, 3);
+	}
+#endif
+}
+
+static void WriteQuadColor(uint32_t *color_buf, int width, int x, int y,
+						   const __m128 color[4], int coverage_mask)
+{
+	StoreQuadColor(color_buf, width, x, y, PackQuadColor(color), coverage_mask);
+}
+
+static inline __m128 UnpackColor(uint32_t color)
+{
+	return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(color)));
+}
+
+static void BlendQuadColor(uint32_t *color_buf, int width, int x, int y,
+						   const __m128 color[4], int coverage_mask)
+{
+	const uint32_t *row0 = color_buf + y * width + x;
+	const uint32_t *row1 = row0 + width;
+	const uint32_t *dst[4] = { row0, row0 + 1, row1, row1 + 1 };
+
+	__m128 vBlended[4];
+
+	for (int i = 0; i < 4; ++i)
+	{
+		if (!(coverage_mask & (1 << i)))
+		{
+			vBlended[i] = _mm_setzero_ps();
+			continue;
+		}
+
+		// src * alpha + dst * (1 - alpha), dst is scaled back to [0, 1]
+		float src_alpha = _mm_cvtss_f32(_mm_shuffle_ps(color[i], color[i], _MM_SHUFFLE(0, 0, 0, 3)));
+		__m128 vDstColor = _mm_mul_ps(UnpackColor(*dst[i]), _mm_set_ps1(1.0f / 256.0f));
+		vBlended[i] = _simd_lerp_ps(vDstColor, color[i], src_alpha);
+	}
+
+	StoreQuadColor(color_buf, width, x, y, PackQuadColor(vBlended), coverage_mask);
+}
+
+void GLSP_KERNEL_INIT(KernelTable &table)
+{
+	table.mISAName            = GLSP_KERNEL_ISA_NAME;
+	table.SetupTriangles      = SetupTriangles;
+	table.DepthTestMicroTile  = DepthTestMicroTile;
+	table.DepthWriteMicroTile = DepthWriteMicroTile;
+	table.RasterizeMicroTile  = RasterizeMicroTile;
+	table.InterpolateQuads    = InterpolateQuads;
+	table.WriteQuadColor      = WriteQuadColor;
+	table.BlendQuadColor      = BlendQuadColor;
+}
+
+} // namespace glsp
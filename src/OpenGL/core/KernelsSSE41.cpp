@@ -0,0 +1,5 @@
+// Kernels for the SSE4.1 baseline, always available.
+#define GLSP_KERNEL_INIT     InitKernelTableSSE41
+#define GLSP_KERNEL_ISA_NAME "SSE4.1"
+
+#include "KernelsImpl.h"
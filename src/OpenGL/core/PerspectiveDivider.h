@@ -1,25 +1,27 @@
 #pragma once
 
-#include "PipeStage.h"
+#include "DataFlow.h"
 
 
 namespace glsp {
 
-class Batch;
-
-class PerspectiveDivider: public PipeStage
+// Perspective dividing of the geometry stages, see GeometryPipeline.
+class PerspectiveDivider
 {
 public:
-	PerspectiveDivider();
-	virtual ~PerspectiveDivider() { }
-
-	virtual void emit(void *data);
-	virtual void finalize();
-
-private:
-	void dividing(Batch *bat);
-
-private:
+	// From clip space to NDC
+	static inline void DividePrimitive(Primitive &prim)
+	{
+		for(size_t i = 0; i < 3; ++i)
+		{
+			glm::vec4 &pos = prim.mVert[i].position();
+			const float ZReciprocal = 1.0f / pos.w;
+
+			pos.x *= ZReciprocal;
+			pos.y *= ZReciprocal;
+			pos.z *= ZReciprocal;
+		}
+	}
 };
 
 } // namespace glsp
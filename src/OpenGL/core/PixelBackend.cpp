@@ -3,6 +3,7 @@
 #include <glm/glm.hpp>
 #include "DataFlow.h"
 #include "GLContext.h"
+#include "Kernels.h"
 #include "utils.h"
 
 namespace glsp {
@@ -62,7 +63,7 @@ bool ZTester::onDepthTestingSIMD(Fsiosimd &fsio)
 			g_GC->mRT.pDepthBuffer[index1],
 			g_GC->mRT.pDepthBuffer[index0]);
 
-	int result = _mm_movemask_ps(_mm_cmp_ps(fsio.mInRegs[3], vDepth, _CMP_LT_OS));
+	int result = _mm_movemask_ps(_mm_cmplt_ps(fsio.mInRegs[3], vDepth));
 	result &= fsio.mCoverageMask;
 	fsio.mCoverageMask = result;
 
@@ -104,9 +105,10 @@ void Blender::emit(void *data)
 	onBlending(*pFsio);
 #endif
 
-	Fsiosimd *pFsio = static_cast<Fsiosimd *>(data);
+	FsiosimdGroup *pGroup = static_cast<FsiosimdGroup *>(data);
 
-	onBlendingSIMD(*pFsio);
+	for (int i = 0; i < pGroup->mCount; ++i)
+		onBlendingSIMD(pGroup->mQuads[i], *pGroup);
 }
 
 // TODO: impl
@@ -123,62 +125,18 @@ void Blender::onBlending(Fsio &fsio)
 	return;
 }
 
-static inline void ColorBlending(int32_t *colorBuffer, int index, __m128 &vInputColor)
+// Each sample is blended on its own, with the color shaded once per pixel.
+void Blender::onBlendingSIMD(Fsiosimd &fsio, const FsiosimdGroup &group)
 {
-	__m128i vSrcColori;
-	__m128  vSrcColor;
-	__m128i vDestColori;
-	__m128  vDestColor;
-
-	static const __m128i mask = _mm_set_epi8(0x80, 0x80, 0x80, 0x80,
-								0x80, 0x80, 0x80, 0x80,
-								0x80, 0x80, 0x80, 0x80,
-								0x0C, 0x08, 0x04, 0x00);
-
-	vDestColori = _mm_cvtsi32_si128(colorBuffer[index]);
-	vDestColori = _mm_unpacklo_epi8 (vDestColori, _mm_setzero_si128());
-	vDestColori = _mm_unpacklo_epi16(vDestColori, _mm_setzero_si128());
-	vDestColor  = _mm_cvtepi32_ps(vDestColori);
-
-	float src_alpha = _mm_cvtss_f32(_mm_shuffle_ps(vInputColor, vInputColor, _MM_SHUFFLE(0, 0, 0, 3)));
-	vSrcColor  = _mm_mul_ps(vInputColor, _mm_set_ps1(256.0f));
-	vSrcColor  = _simd_lerp_ps(vDestColor, vSrcColor, src_alpha);
-	vSrcColori = _simd_clamp_epi32(_mm_cvtps_epi32(vSrcColor), _mm_setzero_si128(), _mm_set1_epi32(255));
-	vSrcColori = _mm_shuffle_epi8(vSrcColori, mask);
-	colorBuffer[index] = _mm_cvtsi128_si32(vSrcColori);;
-}
-
-void Blender::onBlendingSIMD(Fsiosimd &fsio)
-{
-	int32_t *colorBuffer = (int32_t *)g_GC->mRT.pColorBuffer;
-	int index;
-
-	// left-bottom pixel
-	if (fsio.mCoverageMask & 1)
-	{
-		index = fsio.y * g_GC->mRT.width + fsio.x;
-		ColorBlending(colorBuffer, index, fsio.mOutRegs[0]);
-	}
-
-	// right-bottom pixel
-	if (fsio.mCoverageMask & 2)
-	{
-		index = fsio.y * g_GC->mRT.width + fsio.x + 1;
-		ColorBlending(colorBuffer, index, fsio.mOutRegs[1]);
-	}
-
-	// left-top pixel
-	if (fsio.mCoverageMask & 4)
+	for (int s = 0; s < group.mSamples; ++s)
 	{
-		index = (fsio.y + 1) * g_GC->mRT.width + fsio.x;
-		ColorBlending(colorBuffer, index, fsio.mOutRegs[2]);
-	}
+		const int coverage_mask = (fsio.mSampleMask >> (s << 2)) & fsio.mCoverageMask & 0xF;
 
-	// right-top pixel
-	if (fsio.mCoverageMask & 8)
-	{
-		index = (fsio.y + 1) * g_GC->mRT.width + fsio.x + 1;
-		ColorBlending(colorBuffer, index, fsio.mOutRegs[3]);
+		if (coverage_mask)
+		{
+			g_Kernels.BlendQuadColor(group.mColorBuffer + s * group.mSamplePitch, group.mColorPitch,
+									 fsio.x - group.mColorX, fsio.y - group.mColorY, fsio.mOutRegs, coverage_mask);
+		}
 	}
 }
 
@@ -198,8 +156,10 @@ void FBWriter::emit(void *data)
 	Fsio *pFsio = static_cast<Fsio *>(data);
 	onFBWriting(*pFsio);
 #else
-	Fsiosimd *pFsio = static_cast<Fsiosimd *>(data);
-	onFBWritingSIMD(*pFsio);
+	FsiosimdGroup *pGroup = static_cast<FsiosimdGroup *>(data);
+
+	for (int i = 0; i < pGroup->mCount; ++i)
+		onFBWritingSIMD(pGroup->mQuads[i], *pGroup);
 #endif
 }
 
@@ -214,55 +174,17 @@ void FBWriter::onFBWriting(const Fsio &fsio)
 	colorBuffer[4 * index+3] = (uint8_t)(fsio.out.fragcolor().w * 256);
 }
 
-void FBWriter::onFBWritingSIMD(const Fsiosimd &fsio)
+void FBWriter::onFBWritingSIMD(const Fsiosimd &fsio, const FsiosimdGroup &group)
 {
-	int32_t *colorBuffer = (int32_t *)g_GC->mRT.pColorBuffer;
-	int index;
-
-	static __m128i mask = _mm_set_epi8(0x80, 0x80, 0x80, 0x80,
-								0x80, 0x80, 0x80, 0x80,
-								0x80, 0x80, 0x80, 0x80,
-								0x0C, 0x08, 0x04, 0x00);
-	__m128i tmp;
-
-	// left-bottom pixel
-	if (fsio.mCoverageMask & 1)
+	for (int s = 0; s < group.mSamples; ++s)
 	{
-		index = fsio.y * g_GC->mRT.width + fsio.x;
-		tmp   = _mm_cvtps_epi32(_mm_mul_ps(fsio.mOutRegs[0], _mm_set_ps1(256.0f)));
-		tmp   = _simd_clamp_epi32(tmp, _mm_setzero_si128(), _mm_set1_epi32(255));
-		tmp   = _mm_shuffle_epi8(tmp, mask);
-		colorBuffer[index] = _mm_cvtsi128_si32(tmp);;
-	}
+		const int coverage_mask = (fsio.mSampleMask >> (s << 2)) & fsio.mCoverageMask & 0xF;
 
-	// right-bottom pixel
-	if (fsio.mCoverageMask & 2)
-	{
-		index = fsio.y * g_GC->mRT.width + fsio.x + 1;
-		tmp   = _mm_cvtps_epi32(_mm_mul_ps(fsio.mOutRegs[1], _mm_set_ps1(256.0f)));
-		tmp   = _simd_clamp_epi32(tmp, _mm_setzero_si128(), _mm_set1_epi32(255));
-		tmp   = _mm_shuffle_epi8(tmp, mask);
-		colorBuffer[index] = _mm_cvtsi128_si32(tmp);;
-	}
-
-	// left-top pixel
-	if (fsio.mCoverageMask & 4)
-	{
-		index = (fsio.y + 1) * g_GC->mRT.width + fsio.x;
-		tmp   = _mm_cvtps_epi32(_mm_mul_ps(fsio.mOutRegs[2], _mm_set_ps1(256.0f)));
-		tmp   = _simd_clamp_epi32(tmp, _mm_setzero_si128(), _mm_set1_epi32(255));
-		tmp   = _mm_shuffle_epi8(tmp, mask);
-		colorBuffer[index] = _mm_cvtsi128_si32(tmp);;
-	}
-
-	// right-top pixel
-	if (fsio.mCoverageMask & 8)
-	{
-		index = (fsio.y + 1) * g_GC->mRT.width + fsio.x + 1;
-		tmp   = _mm_cvtps_epi32(_mm_mul_ps(fsio.mOutRegs[3], _mm_set_ps1(256.0f)));
-		tmp   = _simd_clamp_epi32(tmp, _mm_setzero_si128(), _mm_set1_epi32(255));
-		tmp   = _mm_shuffle_epi8(tmp, mask);
-		colorBuffer[index] = _mm_cvtsi128_si32(tmp);;
+		if (coverage_mask)
+		{
+			g_Kernels.WriteQuadColor(group.mColorBuffer + s * group.mSamplePitch, group.mColorPitch,
+									 fsio.x - group.mColorX, fsio.y - group.mColorY, fsio.mOutRegs, coverage_mask);
+		}
 	}
 }
 
@@ -67,7 +67,7 @@ public:
 
 private:
 	inline void onBlending(Fsio &fsio);
-	inline void onBlendingSIMD(Fsiosimd &fsio);
+	inline void onBlendingSIMD(Fsiosimd &fsio, const FsiosimdGroup &group);
 };
 
 class Dither: public PipeStage
@@ -91,7 +91,7 @@ public:
 
 private:
 	inline void onFBWriting(const Fsio &fsio);
-	void onFBWritingSIMD(const Fsiosimd &fsio);
+	void onFBWritingSIMD(const Fsiosimd &fsio, const FsiosimdGroup &group);
 };
 
 } // namespace glsp
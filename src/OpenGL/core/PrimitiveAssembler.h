@@ -1,22 +1,28 @@
 #pragma once
 
-#include "PipeStage.h"
+#include "DataFlow.h"
+#include "MemoryPool.h"
 
 namespace glsp {
 
-class Batch;
-
-class PrimitiveAssembler: public PipeStage
+// Primitive assembly of the geometry stages, see GeometryPipeline.
+// TODO: impl point/line assembly
+class PrimitiveAssembler
 {
 public:
-	PrimitiveAssembler();
-	virtual ~PrimitiveAssembler() { }
+	// Assemble the triangle of the vertices idx[0], idx[1] and idx[2].
+	static inline Primitive *AssembleTriangle(const vsOutput_v &vs_out, const int *idx)
+	{
+		Primitive *prim = new(MemoryPoolMT::get()) Primitive();
 
-	virtual void emit(void *data);
-	virtual void finalize();
+		prim->mType		= Primitive::TRIANGLE;
+		prim->mVertNum	= 3;
+		prim->mVert[0]	= vs_out[idx[0]];
+		prim->mVert[1]	= vs_out[idx[1]];
+		prim->mVert[2]	= vs_out[idx[2]];
 
-private:
-	void assemble(Batch *bat);
+		return prim;
+	}
 };
 
 } // namespace glsp
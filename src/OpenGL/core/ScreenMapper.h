@@ -1,31 +1,46 @@
 #pragma once
 
-#include "PipeStage.h"
+#include <cmath>
 
+#include "DataFlow.h"
+#include "GLContext.h"
 
-namespace glsp {
 
-class Batch;
+namespace glsp {
 
-class ScreenMapper: public PipeStage
+// Viewport transform of the geometry stages, see GeometryPipeline.
+class ScreenMapper
 {
 public:
-	ScreenMapper();
-	virtual ~ScreenMapper() { }
-
-	virtual void emit(void *data);
-	virtual void finalize();
-
-private:
-	void viewportTransform(Batch *bat);
-
-private:
-	struct {
-		unsigned int x;
-		unsigned int y;
-		unsigned int w;
-		unsigned int h;
-	} mViewport;
+	// Map one primitive to the window, return false if it's degenerate.
+	static inline bool MapPrimitive(Primitive &prim, const GLViewport &viewport)
+	{
+		for(size_t i = 0; i < 3; ++i)
+		{
+			// TODO: snap to sub-pixel grids
+			glm::vec4 &pos = prim.mVert[i].position();
+			pos.x = viewport.xCenter + pos.x * viewport.xScale;
+			pos.y = viewport.yCenter + pos.y * viewport.yScale;
+			pos.z = (pos.z + 1) * 0.5f;
+		}
+
+		const glm::vec4 &pos0 = prim.mVert[0].position();
+		const glm::vec4 &pos1 = prim.mVert[1].position();
+		const glm::vec4 &pos2 = prim.mVert[2].position();
+
+		const float ex = pos1.x - pos0.x;
+		const float ey = pos1.y - pos0.y;
+		const float fx = pos2.x - pos0.x;
+		const float fy = pos2.y - pos0.y;
+		const float area = ex * fy - ey * fx;
+
+		// Discard degenerate triangles
+		if(std::abs(area) == 0.0f)
+			return false;
+
+		prim.mAreaReciprocal = 1.0f / area;
+		return true;
+	}
 };
 
 } // namespace glsp
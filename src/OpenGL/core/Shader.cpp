@@ -282,10 +282,17 @@ void FragmentShader::ExecuteSISD(void *data)
 
 void FragmentShader::ExecuteSIMD(void *data)
 {
-	Fsiosimd &fsio = *static_cast<Fsiosimd *>(data);
-	//const Triangle *tri = static_cast<Triangle *>(fsio.m_priv0);
+	FsiosimdGroup &group = *static_cast<FsiosimdGroup *>(data);
+
+	OnExecuteQuadsSIMD(group.mQuads, group.mCount);
+}
 
-	OnExecuteSIMD(fsio);
+void FragmentShader::OnExecuteQuadsSIMD(Fsiosimd quads[], int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		OnExecuteSIMD(quads[i]);
+	}
 }
 
 void FragmentShader::compile()
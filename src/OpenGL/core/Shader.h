@@ -285,6 +285,10 @@ private:
 	virtual void execute(fsInput& in, fsOutput& out);
 	virtual void OnExecuteSIMD(Fsiosimd &fsio) { return; }
 
+	// Shade the quads of one triangle, override it to share the uniform loads,
+	// texture lookups etc. among the quads.
+	virtual void OnExecuteQuadsSIMD(Fsiosimd quads[], int count);
+
 	void ExecuteSIMD(void *data);
 	void ExecuteSISD(void *data);
 
@@ -1,6 +1,8 @@
 #include "TBDR.h"
 
 #include <algorithm>
+#include <cfloat>
+#include <cstdlib>
 #include <cstring>
 
 #include "ThreadPool.h"
@@ -8,722 +10,667 @@
 #include "GLContext.h"
 #include "DrawEngine.h"
 #include "PixelBackend.h"
-#include "glsp_spinlock.h"
+#include "Kernels.h"
 #include "utils.h"
 #include "compiler.h"
 
 
 namespace glsp {
 
-struct TriangleBinningPoint
+// Display list of a tile, a linked list of the chunks in a BinArena.
+struct BinTile
 {
-	Triangle *tri;
-	bool      full_cover; // Indicate this triangle fully cover a macro tile.
+	uint32_t mHead;
+	uint32_t mTail;
 };
 
-static std::vector<TriangleBinningPoint> s_DispList[MAX_TILES_IN_HEIGHT][MAX_TILES_IN_WIDTH];
+// Every thread bins into its own set of display lists, so no lock is needed
+// in CoarseRasterizing(). The lists of one tile are merged by batch id in
+// FineRasterizing(). Indexed by ThreadPool::getThreadID(), the extra one is
+// reserved for the main thread. The entries are stored in the BinArena of the
+// thread, see below.
+static vector<BinTile>     *s_DispList = nullptr;
+static int                  s_DispListNum = 0;
+
+// Per thread bitmap of the tiles with prims binned, and the estimated cost
+// of the tiles in pixels. Indexed the same way as s_DispList.
+static vector<uint64_t>    *s_TileActiveMask = nullptr;
+static vector<uint32_t>    *s_TileCost       = nullptr;
+
+/* OPT: the large triangles, e.g. the full screen quads of the post process
+ * passes and skyboxes, are binned once per super tile rather than once per
+ * tile, and picked up by the tiles of the super tile in GetTileDisplayList().
+ * A super tile is a whole number of tiles of any macro tile size.
+ */
+#define BIN_SUPER_TILE_SIZE        256
+#define BIN_SUPER_TILE_SIZE_SHIFT  8
+
+// A triangle is binned to the super tiles if its bounding box spans this many tiles.
+#define BIN_LARGE_TRIANGLE_TILES   64
+
+// Per thread display lists of the super tiles, the bitmap of the super tiles
+// with prims binned, and their estimated cost per tile.
+// Indexed the same way as s_DispList.
+static vector<BinTile>     *s_SuperTileList       = nullptr;
+static vector<uint64_t>    *s_SuperTileActiveMask = nullptr;
+static vector<uint32_t>    *s_SuperTileCost       = nullptr;
+
+// Per thread number of the triangles binned since the last flush, used to
+// pick the render mode. Indexed the same way as s_DispList.
+static size_t              *s_BinnedTriangles = nullptr;
+
+// Per thread memory of the primitives referenced by the binned triangles and
+// their vertex registers, kept in MemoryPoolMT until the flush.
+static size_t              *s_BinnedPrimMemory = nullptr;
+
+// Render mode of current render pass, see TBDR::PickRenderMode().
+// The triangles of an immediate mode render pass are not binned to the tiles,
+// but appended to the per thread flat lists in submission order, see
+// TBDR::onRasterizingImmediate(). Indexed the same way as s_DispList.
+static bool                 s_ImmediateMode   = false;
+static DisplayList         *s_ImmediateList   = nullptr;
+
+// Display list of the tiles with nothing drawn but partially cleared.
+static const DisplayList    s_EmptyDisplayList;
+
+// Number of TriangleSetup8 blocks in one chunk of SetupArena.
+#define SETUP_ARENA_CHUNK_SIZE  64
+
+/* Per thread storage of the triangle setup blocks. The blocks live until the
+ * display lists are flushed, then the chunks are recycled for the next frame.
+ * NOTE: a block is too big for MemoryPoolMT.
+ */
+class SetupArena
+{
+public:
+	SetupArena(): mUsed(0) { }
 
-static ::glsp::SpinLock s_DispListLock;
-static ::glsp::SpinLock s_FullCoverDispListLock;
+	~SetupArena()
+	{
+		for (TriangleSetup8 *chunk: mChunks)
+			_mm_free(chunk);
+	}
 
+	TriangleSetup8 *allocate()
+	{
+		const size_t chunk = mUsed / SETUP_ARENA_CHUNK_SIZE;
 
-Binning::Binning():
-	PipeStage("Binning", DrawEngine::getDrawEngine())
-{
-}
+		if (chunk == mChunks.size())
+		{
+			void *mem = _mm_malloc(sizeof(TriangleSetup8) * SETUP_ARENA_CHUNK_SIZE, 32);
+			assert(mem);
+			mChunks.push_back(static_cast<TriangleSetup8 *>(mem));
+		}
 
-Binning::~Binning()
-{
-}
+		return mChunks[chunk] + (mUsed++ % SETUP_ARENA_CHUNK_SIZE);
+	}
 
-void Binning::emit(void *data)
-{
-	Batch *bat = static_cast<Batch *>(data);
+	void reset() { mUsed = 0; }
 
-	onBinning(bat);
-}
+	size_t size() const { return mUsed; }
 
-void Binning::onBinning(Batch *bat)
+private:
+	vector<TriangleSetup8 *> mChunks;
+	size_t                   mUsed;
+};
+
+// Indexed the same way as s_DispList.
+static SetupArena          *s_SetupArena = nullptr;
+
+// Size of one chunk of AttrArena in floats, i.e. 64KB.
+#define ATTR_ARENA_CHUNK_SIZE   (16 * 1024)
+
+/* Per thread storage of the attribute blocks of the batches, see
+ * Binning::onBinning(). Recycled along with SetupArena.
+ * NOTE: a block is too big for MemoryPoolMT.
+ */
+class AttrArena
 {
-	Primitive *prim[4];
-	int i;
+public:
+	AttrArena(): mChunk(0), mUsed(0), mUsedSize(0) { }
 
-	auto iter = bat->mPrims.begin();
+	~AttrArena()
+	{
+		for (AttrChunk &chunk: mChunks)
+			_mm_free(chunk.mData);
+	}
 
-	while(true)
+	// size in floats, the block is 16 bytes aligned if size is a multiple of 4.
+	float *allocate(size_t size)
 	{
-		// Fetch four primitives in one go.
-		for (i = 0; i < 4; ++i, ++iter)
+		while (mChunk < mChunks.size() && mUsed + size > mChunks[mChunk].mSize)
 		{
-			if (iter != bat->mPrims.end())
-			{
-				prim[i] = *iter;
-			}
-			else
-			{
-				break;
-			}
+			mChunk++;
+			mUsed = 0;
 		}
 
-		if (i != 4)
-			break;
+		if (mChunk == mChunks.size())
+		{
+			const size_t chunk_size = (std::max)(size, (size_t)ATTR_ARENA_CHUNK_SIZE);
+			void *mem = _mm_malloc(sizeof(float) * chunk_size, 32);
+			assert(mem);
+			mChunks.push_back({ static_cast<float *>(mem), chunk_size });
+		}
 
-		Triangle *tri0 = new(MemoryPoolMT::get()) Triangle(*prim[0], bat);
-		Triangle *tri1 = new(MemoryPoolMT::get()) Triangle(*prim[1], bat);
-		Triangle *tri2 = new(MemoryPoolMT::get()) Triangle(*prim[2], bat);
-		Triangle *tri3 = new(MemoryPoolMT::get()) Triangle(*prim[3], bat);
+		float *block = mChunks[mChunk].mData + mUsed;
+		mUsed     += size;
+		mUsedSize += sizeof(float) * size;
 
-		SetupTriangleSIMD(tri0, tri1, tri2, tri3);
+		return block;
+	}
 
-		CoarseRasterizing(tri0);
-		CoarseRasterizing(tri1);
-		CoarseRasterizing(tri2);
-		CoarseRasterizing(tri3);
+	void reset()
+	{
+		mChunk    = 0;
+		mUsed     = 0;
+		mUsedSize = 0;
 	}
 
-	for (int j = 0; j < i; j++)
+	// in bytes
+	size_t size() const { return mUsedSize; }
+
+private:
+	struct AttrChunk
 	{
-		Triangle *tri = new(MemoryPoolMT::get()) Triangle(*prim[j], bat);
+		float *mData;
+		size_t mSize;
+	};
 
-		SetupTriangle(tri);
-		CoarseRasterizing(tri);
-	}
-}
+	vector<AttrChunk> mChunks;
+	size_t            mChunk;
+	size_t            mUsed;
+	size_t            mUsedSize;
+};
+
+// Indexed the same way as s_DispList.
+static AttrArena           *s_AttrArena = nullptr;
+
+/* A display list entry is packed in 32 bits: the index of the triangle in the
+ * table of the BinArena it's binned by, and the full cover bit.
+ */
+#define BIN_ENTRY_FULL_COVER    1u
+#define BIN_ENTRY_TRI_SHIFT     1
+
+// A chunk is 128 bytes, allocated BIN_ARENA_BLOCK_SIZE chunks at a time.
+#define BIN_CHUNK_ENTRIES       30
+#define BIN_ARENA_BLOCK_SIZE    512
+#define BIN_CHUNK_NONE          0xFFFFFFFFu
 
-void Binning::SetupTriangleSIMD(Triangle *tri0, Triangle *tri1, Triangle *tri2, Triangle *tri3)
+struct BinChunk
 {
-	Primitive *prim0 = &tri0->mPrim;
-	Primitive *prim1 = &tri1->mPrim;
-	Primitive *prim2 = &tri2->mPrim;
-	Primitive *prim3 = &tri3->mPrim;
+	uint32_t mNext;
+	uint32_t mCount;
+	uint32_t mEntries[BIN_CHUNK_ENTRIES];
+};
 
-	vsOutput *v00, *v01, *v02;
-	vsOutput *v10, *v11, *v12;
-	vsOutput *v20, *v21, *v22;
-	vsOutput *v30, *v31, *v32;
+/* Per thread storage of the display lists, the table of the binned triangles
+ * and the chunks of the lists, which are linked per tile.
+ * Like SetupArena it's reset when the display lists are flushed, and the
+ * blocks are recycled, so nothing is reallocated in the binning hot path
+ * once warmed up.
+ */
+class BinArena
+{
+public:
+	BinArena(): mUsedChunks(0) { }
 
-	if (prim0->mAreaReciprocal > 0.0f)
+	~BinArena()
 	{
-		v00 = &prim0->mVert[0];
-		v01 = &prim0->mVert[1];
-		v02 = &prim0->mVert[2];
+		for (BinChunk *block: mBlocks)
+			free(block);
 	}
-	else
+
+	uint32_t AddTriangle(Triangle *tri)
 	{
-		v00 = &prim0->mVert[2];
-		v01 = &prim0->mVert[1];
-		v02 = &prim0->mVert[0];
+		mTriangles.push_back(tri);
+		return (uint32_t)(mTriangles.size() - 1);
 	}
-	tri0->mVert2 = v02;
 
-	if (prim1->mAreaReciprocal > 0.0f)
+	Triangle *GetTriangle(uint32_t entry) const
 	{
-		v10 = &prim1->mVert[0];
-		v11 = &prim1->mVert[1];
-		v12 = &prim1->mVert[2];
+		return mTriangles[entry >> BIN_ENTRY_TRI_SHIFT];
 	}
-	else
+
+	const BinChunk &GetChunk(uint32_t chunk) const
 	{
-		v10 = &prim1->mVert[2];
-		v11 = &prim1->mVert[1];
-		v12 = &prim1->mVert[0];
+		return mBlocks[chunk / BIN_ARENA_BLOCK_SIZE][chunk % BIN_ARENA_BLOCK_SIZE];
 	}
-	tri1->mVert2 = v12;
 
-	if (prim2->mAreaReciprocal > 0.0f)
+	void append(BinTile &tile, uint32_t entry)
 	{
-		v20 = &prim2->mVert[0];
-		v21 = &prim2->mVert[1];
-		v22 = &prim2->mVert[2];
+		if (tile.mTail == BIN_CHUNK_NONE || GetChunk(tile.mTail).mCount == BIN_CHUNK_ENTRIES)
+		{
+			const uint32_t chunk = AllocateChunk();
+
+			if (tile.mTail == BIN_CHUNK_NONE)
+				tile.mHead = chunk;
+			else
+				GetChunk(tile.mTail).mNext = chunk;
+
+			tile.mTail = chunk;
+		}
+
+		BinChunk &chunk = GetChunk(tile.mTail);
+		chunk.mEntries[chunk.mCount++] = entry;
 	}
-	else
+
+	// Bytes in use.
+	size_t size() const
 	{
-		v20 = &prim2->mVert[2];
-		v21 = &prim2->mVert[1];
-		v22 = &prim2->mVert[0];
+		return mUsedChunks * sizeof(BinChunk) + mTriangles.size() * sizeof(Triangle *);
 	}
-	tri2->mVert2 = v22;
 
-	if (prim3->mAreaReciprocal > 0.0f)
+	void reset()
 	{
-		v30 = &prim3->mVert[0];
-		v31 = &prim3->mVert[1];
-		v32 = &prim3->mVert[2];
+		mTriangles.clear();
+		mUsedChunks = 0;
 	}
-	else
-	{
-		v30 = &prim3->mVert[2];
-		v31 = &prim3->mVert[1];
-		v32 = &prim3->mVert[0];
-	}
-	tri3->mVert2 = v32;
-
-	__m128 vSubpixelsf = _mm_set_ps1(RAST_SUBPIXELS);
-	__m128 vX0f = _mm_set_ps(v30->position().x, v20->position().x, v10->position().x, v00->position().x);
-	__m128 vY0f = _mm_set_ps(v30->position().y, v20->position().y, v10->position().y, v00->position().y);
-	__m128 vX1f = _mm_set_ps(v31->position().x, v21->position().x, v11->position().x, v01->position().x);
-	__m128 vY1f = _mm_set_ps(v31->position().y, v21->position().y, v11->position().y, v01->position().y);
-	__m128 vX2f = _mm_set_ps(v32->position().x, v22->position().x, v12->position().x, v02->position().x);
-	__m128 vY2f = _mm_set_ps(v32->position().y, v22->position().y, v12->position().y, v02->position().y);
-
-	/* Fixed point rasterization algorithm
-	 * FXIME: it's possible to overflow integer's range in current guard band setting.
-	 */
-	const __m128  vOneHalf = _mm_set_ps1(0.5f);
-	__m128i vX0 = _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(vX0f, vSubpixelsf), vOneHalf));
-	__m128i vY0 = _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(vY0f, vSubpixelsf), vOneHalf));
-	__m128i vX1 = _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(vX1f, vSubpixelsf), vOneHalf));
-	__m128i vY1 = _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(vY1f, vSubpixelsf), vOneHalf));
-	__m128i vX2 = _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(vX2f, vSubpixelsf), vOneHalf));
-	__m128i vY2 = _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(vY2f, vSubpixelsf), vOneHalf));
-
-	__m128i vX1X0 = _mm_sub_epi32(vX1, vX0);
-	__m128i vX2X1 = _mm_sub_epi32(vX2, vX1);
-	__m128i vX0X2 = _mm_sub_epi32(vX0, vX2);
-
-	__m128i vY0Y1 = _mm_sub_epi32(vY0, vY1);
-	__m128i vY1Y2 = _mm_sub_epi32(vY1, vY2);
-	__m128i vY2Y0 = _mm_sub_epi32(vY2, vY0);
-
-	__m128i vC0 = _mm_sub_epi32(_mm_mullo_epi32(vX1, vY2), _mm_mullo_epi32(vX2, vY1));
-	__m128i vC1 = _mm_sub_epi32(_mm_mullo_epi32(vX2, vY0), _mm_mullo_epi32(vX0, vY2));
-	__m128i vC2 = _mm_sub_epi32(_mm_mullo_epi32(vX0, vY1), _mm_mullo_epi32(vX1, vY0));
-
-	__m128i vMask;
-	__m128i vMask1;
-	__m128i vMaskedOne;
-
-	/* Apply top-left filling convention
-	 * It's worth memtioning that for shared vertices case,
-	 * the vertices will be drawn only if them are shared
-	 * between top left edges, i.e. top-left or left-left.
-	 * Other kind of shared vertices, like top-right, left-bottom,
-	 * will all be abandoned.
-	 */
-	vMask  = _mm_cmpgt_epi32(vY1Y2, _mm_setzero_si128());
-	vMask1 = _mm_and_si128(_mm_cmpeq_epi32(vY1Y2, _mm_setzero_si128()), _mm_cmplt_epi32(vX2X1, _mm_setzero_si128()));
-	vMask  = _mm_or_si128(vMask, vMask1);
-	vMaskedOne = _mm_andnot_si128(vMask, _mm_set1_epi32(1));
-	vC0  = _mm_sub_epi32(vC0, vMaskedOne);
-
-
-	vMask  = _mm_cmpgt_epi32(vY2Y0, _mm_setzero_si128());
-	vMask1 = _mm_and_si128(_mm_cmpeq_epi32(vY2Y0, _mm_setzero_si128()), _mm_cmplt_epi32(vX0X2, _mm_setzero_si128()));
-	vMask  = _mm_or_si128(vMask, vMask1);
-	vMaskedOne = _mm_andnot_si128(vMask, _mm_set1_epi32(1));
-	vC1  = _mm_sub_epi32(vC1, vMaskedOne);
-
-
-	vMask  = _mm_cmpgt_epi32(vY0Y1, _mm_setzero_si128());
-	vMask1 = _mm_and_si128(_mm_cmpeq_epi32(vY0Y1, _mm_setzero_si128()), _mm_cmplt_epi32(vX1X0, _mm_setzero_si128()));
-	vMask  = _mm_or_si128(vMask, vMask1);
-	vMaskedOne = _mm_andnot_si128(vMask, _mm_set1_epi32(1));
-	vC2  = _mm_sub_epi32(vC2, vMaskedOne);
-
-
-	ALIGN(16) int tmp[4];
-	__m128i vFactor;
-
-	// vertex 0: mFactorA
-	vFactor = _mm_slli_epi32(vY1Y2, RAST_SUBPIXEL_BITS);
-	_mm_store_si128((__m128i *)tmp, vFactor);
-	tri0->mVert[0].mFactorA = tmp[0];
-	tri1->mVert[0].mFactorA = tmp[1];
-	tri2->mVert[0].mFactorA = tmp[2];
-	tri3->mVert[0].mFactorA = tmp[3];
-
-	// vertex 0: mFactorB
-	vFactor = _mm_slli_epi32(vX2X1, RAST_SUBPIXEL_BITS);
-	_mm_store_si128((__m128i *)tmp, vFactor);
-	tri0->mVert[0].mFactorB = tmp[0];
-	tri1->mVert[0].mFactorB = tmp[1];
-	tri2->mVert[0].mFactorB = tmp[2];
-	tri3->mVert[0].mFactorB = tmp[3];
-
-
-	/* Add an offset to C0, because, we need take into
-	 * account the conversion between fixed-point coordinates
-	 * (origin is the left bottom of the screen) and the pixel
-	 * coordinates(center of a pixel grid).
-	 */
-	// vertex 0: mFactorC
-	vFactor = _mm_add_epi32(_mm_slli_epi32(vY1Y2, RAST_SUBPIXEL_BITS - 1),
-							_mm_slli_epi32(vX2X1, RAST_SUBPIXEL_BITS - 1));
-	vFactor = _mm_add_epi32(vFactor, vC0);
-	_mm_store_si128((__m128i *)tmp, vFactor);
-	tri0->mVert[0].mFactorC = tmp[0];
-	tri1->mVert[0].mFactorC = tmp[1];
-	tri2->mVert[0].mFactorC = tmp[2];
-	tri3->mVert[0].mFactorC = tmp[3];
-
-	// vertex 1: mFactorA
-	vFactor = _mm_slli_epi32(vY2Y0, RAST_SUBPIXEL_BITS);
-	_mm_store_si128((__m128i *)tmp, vFactor);
-	tri0->mVert[1].mFactorA = tmp[0];
-	tri1->mVert[1].mFactorA = tmp[1];
-	tri2->mVert[1].mFactorA = tmp[2];
-	tri3->mVert[1].mFactorA = tmp[3];
-
-	// vertex 1: mFactorB
-	vFactor = _mm_slli_epi32(vX0X2, RAST_SUBPIXEL_BITS);
-	_mm_store_si128((__m128i *)tmp, vFactor);
-	tri0->mVert[1].mFactorB = tmp[0];
-	tri1->mVert[1].mFactorB = tmp[1];
-	tri2->mVert[1].mFactorB = tmp[2];
-	tri3->mVert[1].mFactorB = tmp[3];
-
-	// vertex 1: mFactorC
-	vFactor = _mm_add_epi32(_mm_slli_epi32(vY2Y0, RAST_SUBPIXEL_BITS - 1),
-							_mm_slli_epi32(vX0X2, RAST_SUBPIXEL_BITS - 1));
-	vFactor = _mm_add_epi32(vFactor, vC1);
-	_mm_store_si128((__m128i *)tmp, vFactor);
-	tri0->mVert[1].mFactorC = tmp[0];
-	tri1->mVert[1].mFactorC = tmp[1];
-	tri2->mVert[1].mFactorC = tmp[2];
-	tri3->mVert[1].mFactorC = tmp[3];
-
-	// vertex 2: mFactorA
-	vFactor = _mm_slli_epi32(vY0Y1, RAST_SUBPIXEL_BITS);
-	_mm_store_si128((__m128i *)tmp, vFactor);
-	tri0->mVert[2].mFactorA = tmp[0];
-	tri1->mVert[2].mFactorA = tmp[1];
-	tri2->mVert[2].mFactorA = tmp[2];
-	tri3->mVert[2].mFactorA = tmp[3];
-
-	// vertex 2: mFactorB
-	vFactor = _mm_slli_epi32(vX1X0, RAST_SUBPIXEL_BITS);
-	_mm_store_si128((__m128i *)tmp, vFactor);
-	tri0->mVert[2].mFactorB = tmp[0];
-	tri1->mVert[2].mFactorB = tmp[1];
-	tri2->mVert[2].mFactorB = tmp[2];
-	tri3->mVert[2].mFactorB = tmp[3];
-
-	// vertex 2: mFactorC
-	vFactor = _mm_add_epi32(_mm_slli_epi32(vY0Y1, RAST_SUBPIXEL_BITS - 1),
-							_mm_slli_epi32(vX1X0, RAST_SUBPIXEL_BITS - 1));
-	vFactor = _mm_add_epi32(vFactor, vC2);
-	_mm_store_si128((__m128i *)tmp, vFactor);
-	tri0->mVert[2].mFactorC = tmp[0];
-	tri1->mVert[2].mFactorC = tmp[1];
-	tri2->mVert[2].mFactorC = tmp[2];
-	tri3->mVert[2].mFactorC = tmp[3];
-
-
-	const int max_width_fixed  = (g_GC->mRT.width - 1)  << RAST_SUBPIXEL_BITS;
-	const int max_height_fixed = (g_GC->mRT.height - 1) << RAST_SUBPIXEL_BITS;
-	__m128i vXmin = _mm_min_epi32(_mm_min_epi32(vX0, vX1), vX2);
-	vXmin = _mm_min_epi32(_mm_max_epi32(vXmin, _mm_setzero_si128()), _mm_set1_epi32(max_width_fixed));
-	vXmin = _mm_srli_epi32(vXmin, RAST_SUBPIXEL_BITS);
-	_mm_store_si128((__m128i *)tmp, vXmin);
-	tri0->xmin = tmp[0];
-	tri1->xmin = tmp[1];
-	tri2->xmin = tmp[2];
-	tri3->xmin = tmp[3];
-
-	__m128i vXmax = _mm_max_epi32(_mm_max_epi32(vX0, vX1), vX2);
-	vXmax = _mm_min_epi32(_mm_max_epi32(vXmax, _mm_setzero_si128()), _mm_set1_epi32(max_width_fixed));
-	vXmax = _mm_srli_epi32(vXmax, RAST_SUBPIXEL_BITS);
-	_mm_store_si128((__m128i *)tmp, vXmax);
-	tri0->xmax = tmp[0];
-	tri1->xmax = tmp[1];
-	tri2->xmax = tmp[2];
-	tri3->xmax = tmp[3];
-
-	__m128i vYmin = _mm_min_epi32(_mm_min_epi32(vY0, vY1), vY2);
-	vYmin = _mm_min_epi32(_mm_max_epi32(vYmin, _mm_setzero_si128()), _mm_set1_epi32(max_height_fixed));
-	vYmin = _mm_srli_epi32(vYmin, RAST_SUBPIXEL_BITS);
-	_mm_store_si128((__m128i *)tmp, vYmin);
-	tri0->ymin = tmp[0];
-	tri1->ymin = tmp[1];
-	tri2->ymin = tmp[2];
-	tri3->ymin = tmp[3];
-
-	__m128i vYmax = _mm_max_epi32(_mm_max_epi32(vY0, vY1), vY2);
-	vYmax = _mm_min_epi32(_mm_max_epi32(vYmax, _mm_setzero_si128()), _mm_set1_epi32(max_height_fixed));
-	vYmax = _mm_srli_epi32(vYmax, RAST_SUBPIXEL_BITS);
-	_mm_store_si128((__m128i *)tmp, vYmax);
-	tri0->ymax = tmp[0];
-	tri1->ymax = tmp[1];
-	tri2->ymax = tmp[2];
-	tri3->ymax = tmp[3];
-
-	__m128 vAreaRecip = _mm_set_ps(prim3->mAreaReciprocal,
-								prim2->mAreaReciprocal,
-								prim1->mAreaReciprocal,
-								prim0->mAreaReciprocal);
-	vAreaRecip = _mm_andnot_ps(_mm_set_ps1(-0.0f), vAreaRecip);
-
-	__m128 vY1Y2f = _mm_mul_ps(_mm_sub_ps(vY1f, vY2f), vAreaRecip);
-	__m128 vY2Y0f = _mm_mul_ps(_mm_sub_ps(vY2f, vY0f), vAreaRecip);
-	__m128 vY0Y1f = _mm_mul_ps(_mm_sub_ps(vY0f, vY1f), vAreaRecip);
-
-	__m128 vX2X1f = _mm_mul_ps(_mm_sub_ps(vX2f, vX1f), vAreaRecip);
-	__m128 vX0X2f = _mm_mul_ps(_mm_sub_ps(vX0f, vX2f), vAreaRecip);
-	__m128 vX1X0f = _mm_mul_ps(_mm_sub_ps(vX1f, vX0f), vAreaRecip);
-
-	__m128 vXoffset = _mm_sub_ps(vX0f, _mm_set_ps1(0.5f));
-	__m128 vYoffset = _mm_sub_ps(vY0f, _mm_set_ps1(0.5f));
-
-	ALIGN(16) float tmpf[4];
-
-	if (tri0->mRasterStates->mIsDepthTestEnable)
-	{
-		__m128 vZ0f = _mm_set_ps(v30->position().z, v20->position().z, v10->position().z, v00->position().z);
-		__m128 vZ1f = _mm_set_ps(v31->position().z, v21->position().z, v11->position().z, v01->position().z);
-		__m128 vZ2f = _mm_set_ps(v32->position().z, v22->position().z, v12->position().z, v02->position().z);
-		__m128 vZGradientX = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vY1Y2f, vZ0f), _mm_mul_ps(vY2Y0f, vZ1f)),
-										_mm_mul_ps(vY0Y1f, vZ2f));
-		__m128 vZGradientY = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vX2X1f, vZ0f), _mm_mul_ps(vX0X2f, vZ1f)),
-										_mm_mul_ps(vX1X0f, vZ2f));
-		__m128 vZAtOrigin = _mm_sub_ps(_mm_sub_ps(vZ0f, _mm_mul_ps(vZGradientX, vXoffset)),
-									_mm_mul_ps(vZGradientY, vYoffset));
-
-		_mm_store_ps(tmpf, vZGradientX);
-		tri0->mZGradientX = tmpf[0];
-		tri1->mZGradientX = tmpf[1];
-		tri2->mZGradientX = tmpf[2];
-		tri3->mZGradientX = tmpf[3];
-
-		_mm_store_ps(tmpf, vZGradientY);
-		tri0->mZGradientY = tmpf[0];
-		tri1->mZGradientY = tmpf[1];
-		tri2->mZGradientY = tmpf[2];
-		tri3->mZGradientY = tmpf[3];
-
-		_mm_store_ps(tmpf, vZAtOrigin);
-		tri0->mZAtOrigin = tmpf[0];
-		tri1->mZAtOrigin = tmpf[1];
-		tri2->mZAtOrigin = tmpf[2];
-		tri3->mZAtOrigin = tmpf[3];
-	}
-
-	if (tri0->mRasterStates->mIsDepthOnly)
-		return;
 
-	__m128 vWReciprocal0 = _mm_rcp_ps(_mm_set_ps(v30->position().w, v20->position().w, v10->position().w, v00->position().w));
-	__m128 vWReciprocal1 = _mm_rcp_ps(_mm_set_ps(v31->position().w, v21->position().w, v11->position().w, v01->position().w));
-	__m128 vWReciprocal2 = _mm_rcp_ps(_mm_set_ps(v32->position().w, v22->position().w, v12->position().w, v02->position().w));
-
-	__m128 vLambdax0 = _mm_mul_ps(vY1Y2f, vWReciprocal0);
-	__m128 vLambdax1 = _mm_mul_ps(vY2Y0f, vWReciprocal1);
-	__m128 vLambdax2 = _mm_mul_ps(vY0Y1f, vWReciprocal2);
-
-	__m128 vLambday0 = _mm_mul_ps(vX2X1f, vWReciprocal0);
-	__m128 vLambday1 = _mm_mul_ps(vX0X2f, vWReciprocal1);
-	__m128 vLambday2 = _mm_mul_ps(vX1X0f, vWReciprocal2);
-
-	_mm_store_ps(tmpf, vLambdax0);
-	tri0->mPCBCOnW0GradientX = tmpf[0];
-	tri1->mPCBCOnW0GradientX = tmpf[1];
-	tri2->mPCBCOnW0GradientX = tmpf[2];
-	tri3->mPCBCOnW0GradientX = tmpf[3];
-
-	_mm_store_ps(tmpf, vLambday0);
-	tri0->mPCBCOnW0GradientY = tmpf[0];
-	tri1->mPCBCOnW0GradientY = tmpf[1];
-	tri2->mPCBCOnW0GradientY = tmpf[2];
-	tri3->mPCBCOnW0GradientY = tmpf[3];
-
-	__m128 vPCBCOnW0AtOrigin = _mm_sub_ps(_mm_sub_ps(vWReciprocal0, _mm_mul_ps(vLambdax0, vXoffset)),
-										_mm_mul_ps(vLambday0, vYoffset));
-	_mm_store_ps(tmpf, vPCBCOnW0AtOrigin);
-	tri0->mPCBCOnW0AtOrigin = tmpf[0];
-	tri1->mPCBCOnW0AtOrigin = tmpf[1];
-	tri2->mPCBCOnW0AtOrigin = tmpf[2];
-	tri3->mPCBCOnW0AtOrigin = tmpf[3];
-
-	_mm_store_ps(tmpf, vLambdax1);
-	tri0->mPCBCOnW1GradientX = tmpf[0];
-	tri1->mPCBCOnW1GradientX = tmpf[1];
-	tri2->mPCBCOnW1GradientX = tmpf[2];
-	tri3->mPCBCOnW1GradientX = tmpf[3];
-
-	_mm_store_ps(tmpf, vLambday1);
-	tri0->mPCBCOnW1GradientY = tmpf[0];
-	tri1->mPCBCOnW1GradientY = tmpf[1];
-	tri2->mPCBCOnW1GradientY = tmpf[2];
-	tri3->mPCBCOnW1GradientY = tmpf[3];
-
-	__m128 vPCBCOnW1AtOrigin = _mm_sub_ps(_mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(vLambdax1, vXoffset)),
-										_mm_mul_ps(vLambday1, vYoffset));
-	_mm_store_ps(tmpf, vPCBCOnW1AtOrigin);
-	tri0->mPCBCOnW1AtOrigin = tmpf[0];
-	tri1->mPCBCOnW1AtOrigin = tmpf[1];
-	tri2->mPCBCOnW1AtOrigin = tmpf[2];
-	tri3->mPCBCOnW1AtOrigin = tmpf[3];
-
-	__m128 vWRecipGradientX = _mm_add_ps(_mm_add_ps(vLambdax0, vLambdax1), vLambdax2);
-	_mm_store_ps(tmpf, vWRecipGradientX);
-	tri0->mWRecipGradientX = tmpf[0];
-	tri1->mWRecipGradientX = tmpf[1];
-	tri2->mWRecipGradientX = tmpf[2];
-	tri3->mWRecipGradientX = tmpf[3];
-
-	__m128 vWRecipGradientY = _mm_add_ps(_mm_add_ps(vLambday0, vLambday1), vLambday2);
-	_mm_store_ps(tmpf, vWRecipGradientY);
-	tri0->mWRecipGradientY = tmpf[0];
-	tri1->mWRecipGradientY = tmpf[1];
-	tri2->mWRecipGradientY = tmpf[2];
-	tri3->mWRecipGradientY = tmpf[3];
-
-	__m128 vWRecipAtOrigin = _mm_sub_ps(_mm_sub_ps(vWReciprocal0, _mm_mul_ps(vWRecipGradientX, vXoffset)),
-										_mm_mul_ps(vWRecipGradientY, vYoffset));
-	_mm_store_ps(tmpf, vWRecipAtOrigin);
-	tri0->mWRecipAtOrigin = tmpf[0];
-	tri1->mWRecipAtOrigin = tmpf[1];
-	tri2->mWRecipAtOrigin = tmpf[2];
-	tri3->mWRecipAtOrigin = tmpf[3];
-
-	// FIXME: attributes size of these triangles may be different.
-	const size_t size = v00->getRegsNum();
-	tri0->mAttrPlaneEquationA.resize(size);
-	tri0->mAttrPlaneEquationB.resize(size);
-	tri1->mAttrPlaneEquationA.resize(size);
-	tri1->mAttrPlaneEquationB.resize(size);
-	tri2->mAttrPlaneEquationA.resize(size);
-	tri2->mAttrPlaneEquationB.resize(size);
-	tri3->mAttrPlaneEquationA.resize(size);
-	tri3->mAttrPlaneEquationB.resize(size);
+private:
+	BinChunk &GetChunk(uint32_t chunk)
+	{
+		return mBlocks[chunk / BIN_ARENA_BLOCK_SIZE][chunk % BIN_ARENA_BLOCK_SIZE];
+	}
 
-	__m128 vAttr0;
-	__m128 vAttr1;
-	__m128 vAttr2;
-	for (size_t i = 1; i < size; ++i)
+	uint32_t AllocateChunk()
 	{
-		vAttr0 = _mm_load_ps((float *)&v00->getReg(i));
-		vAttr1 = _mm_load_ps((float *)&v01->getReg(i));
-		vAttr2 = _mm_load_ps((float *)&v02->getReg(i));
+		if (mUsedChunks == mBlocks.size() * BIN_ARENA_BLOCK_SIZE)
+		{
+			void *mem = malloc(sizeof(BinChunk) * BIN_ARENA_BLOCK_SIZE);
+			assert(mem);
+			mBlocks.push_back(static_cast<BinChunk *>(mem));
+		}
 
-		_mm_store_ps((float *)&(tri0->mAttrPlaneEquationA.getReg(i)), _mm_sub_ps(vAttr0, vAttr2));
-		_mm_store_ps((float *)&(tri0->mAttrPlaneEquationB.getReg(i)), _mm_sub_ps(vAttr1, vAttr2));
+		BinChunk &chunk = GetChunk(mUsedChunks);
+		chunk.mNext  = BIN_CHUNK_NONE;
+		chunk.mCount = 0;
 
-		vAttr0 = _mm_load_ps((float *)&v10->getReg(i));
-		vAttr1 = _mm_load_ps((float *)&v11->getReg(i));
-		vAttr2 = _mm_load_ps((float *)&v12->getReg(i));
+		return mUsedChunks++;
+	}
+
+	vector<Triangle *> mTriangles;
+	vector<BinChunk *> mBlocks;
+	uint32_t           mUsedChunks;
+};
 
-		_mm_store_ps((float *)&(tri1->mAttrPlaneEquationA.getReg(i)), _mm_sub_ps(vAttr0, vAttr2));
-		_mm_store_ps((float *)&(tri1->mAttrPlaneEquationB.getReg(i)), _mm_sub_ps(vAttr1, vAttr2));
+// Indexed the same way as s_DispList.
+static BinArena            *s_BinArena = nullptr;
 
-		vAttr0 = _mm_load_ps((float *)&v20->getReg(i));
-		vAttr1 = _mm_load_ps((float *)&v21->getReg(i));
-		vAttr2 = _mm_load_ps((float *)&v22->getReg(i));
+// Fixed cost of a triangle in a tile, the tile edge setup and tests.
+#define TILE_COST_PER_PRIM  (MICRO_TILE_SIZE * MICRO_TILE_SIZE)
 
-		_mm_store_ps((float *)&(tri2->mAttrPlaneEquationA.getReg(i)), _mm_sub_ps(vAttr0, vAttr2));
-		_mm_store_ps((float *)&(tri2->mAttrPlaneEquationB.getReg(i)), _mm_sub_ps(vAttr1, vAttr2));
+// Tile grid of current render pass, see TBDR::SetupTileGrid().
+static int s_TileSize       = DEFAULT_MACRO_TILE_SIZE;
+static int s_TileSizeShift  = 5;
+static int s_TilesInWidth   = 0;
+static int s_TilesInHeight  = 0;
+static int s_SuperTilesInWidth  = 0;
+static int s_SuperTilesInHeight = 0;
+static int s_Samples        = 1;
 
-		vAttr0 = _mm_load_ps((float *)&v30->getReg(i));
-		vAttr1 = _mm_load_ps((float *)&v31->getReg(i));
-		vAttr2 = _mm_load_ps((float *)&v32->getReg(i));
+// Max distance of the samples from the pixel centre, in subpixels.
+static int s_SampleExtent   = 0;
 
-		_mm_store_ps((float *)&(tri3->mAttrPlaneEquationA.getReg(i)), _mm_sub_ps(vAttr0, vAttr2));
-		_mm_store_ps((float *)&(tri3->mAttrPlaneEquationB.getReg(i)), _mm_sub_ps(vAttr1, vAttr2));
-	}
+// The standard 4x pattern(rotated grid), offsets from the pixel centre in subpixels.
+static const int s_SamplePositions[MSAA_SAMPLES][2] =
+{
+	{ -2, -6 }, { 6, -2 }, { -6, 2 }, { 2, 6 }
+};
+
+#define MSAA_SAMPLE_EXTENT  6
+
+
+Binning::Binning():
+	PipeStage("Binning", DrawEngine::getDrawEngine())
+{
+	s_DispListNum    = ThreadPool::get().getThreadsNumber() + 1;
+	s_DispList       = new vector<BinTile>[s_DispListNum];
+	s_TileActiveMask = new vector<uint64_t>[s_DispListNum];
+	s_TileCost       = new vector<uint32_t>[s_DispListNum];
+	s_SuperTileList       = new vector<BinTile>[s_DispListNum];
+	s_SuperTileActiveMask = new vector<uint64_t>[s_DispListNum];
+	s_SuperTileCost       = new vector<uint32_t>[s_DispListNum];
+	s_BinnedTriangles = new size_t[s_DispListNum]();
+	s_BinnedPrimMemory = new size_t[s_DispListNum]();
+	s_ImmediateList  = new DisplayList[s_DispListNum];
+	s_SetupArena     = new SetupArena[s_DispListNum];
+	s_AttrArena      = new AttrArena[s_DispListNum];
+	s_BinArena       = new BinArena[s_DispListNum];
 }
 
-void Binning::SetupTriangle(Triangle *tri)
+Binning::~Binning()
 {
-	Primitive &prim = tri->mPrim;
+	delete []s_BinArena;
+	delete []s_AttrArena;
+	delete []s_SetupArena;
+	delete []s_ImmediateList;
+	delete []s_BinnedPrimMemory;
+	delete []s_BinnedTriangles;
+	delete []s_SuperTileCost;
+	delete []s_SuperTileActiveMask;
+	delete []s_SuperTileList;
+	delete []s_TileCost;
+	delete []s_TileActiveMask;
+	delete []s_DispList;
+	s_BinArena       = nullptr;
+	s_AttrArena      = nullptr;
+	s_SetupArena     = nullptr;
+	s_ImmediateList  = nullptr;
+	s_BinnedTriangles = nullptr;
+	s_BinnedPrimMemory = nullptr;
+	s_SuperTileCost       = nullptr;
+	s_SuperTileActiveMask = nullptr;
+	s_SuperTileList       = nullptr;
+	s_TileCost       = nullptr;
+	s_TileActiveMask = nullptr;
+	s_DispList       = nullptr;
+	s_DispListNum    = 0;
+}
 
-	vsOutput *v0;
-	vsOutput *v1;
-	vsOutput *v2;
+void Binning::emit(void *data)
+{
+	Batch *bat = static_cast<Batch *>(data);
 
-	// Always make (v0,v1,v2) counter-closewise
-	if (prim.mAreaReciprocal > 0.0f)
-	{
-		v0 = &prim.mVert[0];
-		v1 = &prim.mVert[1];
-		v2 = &prim.mVert[2];
-	}
-	else
+	onBinning(bat);
+}
+
+/* The attributes of all the triangles of a batch are stored in one contiguous
+ * block, indexed by the triangle id in the batch, so the interpolation of a
+ * triangle reads one record instead of chasing the register files.
+ * The records are filled on the first shading, see Triangle::PrepareAttributes().
+ */
+void Binning::onBinning(Batch *bat)
+{
+	ALIGN(32) TriangleSetupInput8 in;
+	Triangle *tri[SETUP_BLOCK_SIZE];
+	int count = 0;
+
+	if (bat->mPrims.empty())
+		return;
+
+	const int regs_num = (int)bat->mPrims.front()->mVert[0].getRegsNum();
+	const size_t stride = 3 * 4 * regs_num;
+	float *attrs = nullptr;
+
+	if (!bat->mDC->mRasterStates->mIsDepthOnly)
+		attrs = s_AttrArena[ThreadPool::getThreadID()].allocate(stride * bat->mPrims.size());
+
+	for (Primitive *prim: bat->mPrims)
 	{
-		v0 = &prim.mVert[2];
-		v1 = &prim.mVert[1];
-		v2 = &prim.mVert[0];
-	}
+		Triangle *t = new(MemoryPoolMT::get()) Triangle(*prim, bat);
+
+		t->mAttrs       = attrs;
+		t->mAttrRegsNum = regs_num;
 
-	tri->mVert2 = v2;
+		if (attrs)
+			attrs += stride;
+
+		tri[count++] = t;
+
+		if (count == SETUP_BLOCK_SIZE)
+		{
+			SetupTriangles(tri, count, in);
+			count = 0;
+		}
+	}
 
-	/* Fixed point rasterization algorithm
-	 */
-	const int x0 = fixedpoint_cast<RAST_SUBPIXELS>(v0->position().x);
-	const int y0 = fixedpoint_cast<RAST_SUBPIXELS>(v0->position().y);
+	if (count)
+		SetupTriangles(tri, count, in);
+}
 
-	const int x1 = fixedpoint_cast<RAST_SUBPIXELS>(v1->position().x);
-	const int y1 = fixedpoint_cast<RAST_SUBPIXELS>(v1->position().y);
+/* Set up up to SETUP_BLOCK_SIZE triangles of one batch in one go, then bin them.
+ * The vertices are gathered into SoA layout, the unused lanes are padded
+ * with the first triangle to keep the math sane.
+ */
+void Binning::SetupTriangles(Triangle *tri[SETUP_BLOCK_SIZE], int count, TriangleSetupInput8 &in)
+{
+	const vsOutput *v[SETUP_BLOCK_SIZE][3];
 
-	const int x2 = fixedpoint_cast<RAST_SUBPIXELS>(v2->position().x);
-	const int y2 = fixedpoint_cast<RAST_SUBPIXELS>(v2->position().y);
+	for (int lane = 0; lane < SETUP_BLOCK_SIZE; ++lane)
+	{
+		Primitive &prim = tri[(lane < count) ? lane : 0]->mPrim;
 
-	const int x1x0 = x1 - x0;
-	const int x2x1 = x2 - x1;
-	const int x0x2 = x0 - x2;
+		// Always make (v0,v1,v2) counter-closewise
+		if (prim.mAreaReciprocal > 0.0f)
+		{
+			v[lane][0] = &prim.mVert[0];
+			v[lane][1] = &prim.mVert[1];
+			v[lane][2] = &prim.mVert[2];
+		}
+		else
+		{
+			v[lane][0] = &prim.mVert[2];
+			v[lane][1] = &prim.mVert[1];
+			v[lane][2] = &prim.mVert[0];
+		}
 
-	const int y0y1 = y0 - y1;
-	const int y1y2 = y1 - y2;
-	const int y2y0 = y2 - y0;
+		for (int i = 0; i < 3; ++i)
+		{
+			in.mX[i][lane] = v[lane][i]->position().x;
+			in.mY[i][lane] = v[lane][i]->position().y;
+			in.mZ[i][lane] = v[lane][i]->position().z;
+			in.mW[i][lane] = v[lane][i]->position().w;
+		}
 
-	int C0 = x1 * y2 - x2 * y1;
-	int C1 = x2 * y0 - x0 * y2;
-	int C2 = x0 * y1 - x1 * y0;
+		in.mAreaReciprocal[lane] = prim.mAreaReciprocal;
+	}
 
-	/* Apply top-left filling convention
-	 * It's worth memtioning that for shared vertices case,
-	 * the vertices will be drawn only if them are shared
-	 * between top left edges, i.e. top-left or left-left.
-	 * Other kind of shared vertices, like top-right, left-bottom,
-	 * will all be abandoned.
-	 */
-	if (y1y2 > 0 || (y1y2 == 0 && x2x1 < 0))  C0--;
-	if (y2y0 > 0 || (y2y0 == 0 && x0x2 < 0))  C1--;
-	if (y0y1 > 0 || (y0y1 == 0 && x1x0 < 0))  C2--;
+	// All the triangles are from the same batch.
+	const RasterStates *raster_states = tri[0]->mRasterStates;
 
+	TriangleSetup8 *setup = s_SetupArena[ThreadPool::getThreadID()].allocate();
 
-	/* We add an offset to C0, because, we need take into
-	 * account the conversion between fixed-point coordinates
-	 * (origin is the left bottom of the screen) and the pixel
-	 * coordinates(center of a pixel grid).
-	 */
-	tri->mVert[0].mFactorA = y1y2 << RAST_SUBPIXEL_BITS;
-	tri->mVert[0].mFactorB = x2x1 << RAST_SUBPIXEL_BITS;
-	tri->mVert[0].mFactorC = C0 + (y1y2 << (RAST_SUBPIXEL_BITS - 1)) + (x2x1 << (RAST_SUBPIXEL_BITS - 1));
+	g_Kernels.SetupTriangles(in, g_GC->mRT.width, g_GC->mRT.height, s_SampleExtent,
+							 raster_states->mIsDepthTestEnable,
+							 raster_states->mIsDepthOnly,
+							 *setup);
 
-	tri->mVert[1].mFactorA = y2y0 << RAST_SUBPIXEL_BITS;
-	tri->mVert[1].mFactorB = x0x2 << RAST_SUBPIXEL_BITS;
-	tri->mVert[1].mFactorC = C1 + (y2y0 << (RAST_SUBPIXEL_BITS - 1)) + (x0x2 << (RAST_SUBPIXEL_BITS - 1));
+	// Clip the bounding boxes against the scissor, so the tiles out of it are never binned.
+	if (raster_states->mIsScissorTestEnable)
+	{
+		for (int lane = 0; lane < count; ++lane)
+		{
+			setup->mXMin[lane] = (std::max)(setup->mXMin[lane], raster_states->mScissorXMin);
+			setup->mXMax[lane] = (std::min)(setup->mXMax[lane], raster_states->mScissorXMax);
+			setup->mYMin[lane] = (std::max)(setup->mYMin[lane], raster_states->mScissorYMin);
+			setup->mYMax[lane] = (std::min)(setup->mYMax[lane], raster_states->mScissorYMax);
+		}
+	}
 
-	tri->mVert[2].mFactorA = y0y1 << RAST_SUBPIXEL_BITS;
-	tri->mVert[2].mFactorB = x1x0 << RAST_SUBPIXEL_BITS;
-	tri->mVert[2].mFactorC = C2 + (y0y1 << (RAST_SUBPIXEL_BITS - 1)) + (x1x0 << (RAST_SUBPIXEL_BITS - 1));
+	for (int lane = 0; lane < count; ++lane)
+	{
+		// No sample inside the bounding box, nothing to draw.
+		if (setup->mXMin[lane] > setup->mXMax[lane] || setup->mYMin[lane] > setup->mYMax[lane])
+			continue;
 
-	tri->xmin = clamp((std::min)({x0, x1, x2}), 0, (g_GC->mRT.width  - 1) << RAST_SUBPIXEL_BITS) >> RAST_SUBPIXEL_BITS;
-	tri->xmax = clamp((std::max)({x0, x1, x2}), 0, (g_GC->mRT.width  - 1) << RAST_SUBPIXEL_BITS) >> RAST_SUBPIXEL_BITS;
-	tri->ymin = clamp((std::min)({y0, y1, y2}), 0, (g_GC->mRT.height - 1) << RAST_SUBPIXEL_BITS) >> RAST_SUBPIXEL_BITS;
-	tri->ymax = clamp((std::max)({y0, y1, y2}), 0, (g_GC->mRT.height - 1) << RAST_SUBPIXEL_BITS) >> RAST_SUBPIXEL_BITS;
+		tri[lane]->mSetup     = setup;
+		tri[lane]->mSetupLane = lane;
+		tri[lane]->mVert0     = v[lane][0];
+		tri[lane]->mVert1     = v[lane][1];
+		tri[lane]->mVert2     = v[lane][2];
 
+		if (s_ImmediateMode)
+		{
+			TriangleBinningPoint tbp;
+			tbp.tri        = tri[lane];
+			tbp.batch_id   = tri[lane]->mBatchID;
+			tbp.full_cover = false;
 
-	const float WReciprocal0 = 1.0f / v0->position().w;
-	const float WReciprocal1 = 1.0f / v1->position().w;
-	const float WReciprocal2 = 1.0f / v2->position().w;
+			s_ImmediateList[ThreadPool::getThreadID()].push_back(tbp);
+		}
+		else
+		{
+			CoarseRasterizing(tri[lane]);
+		}
 
-	const float area_reciprocal = fabs(prim.mAreaReciprocal);
+		s_BinnedTriangles[ThreadPool::getThreadID()]++;
+		s_BinnedPrimMemory[ThreadPool::getThreadID()] +=
+			sizeof(Primitive) + 3 * tri[lane]->mPrim.mVert[0].getRegsNum() * sizeof(glm::vec4);
+	}
+}
 
-	const float y1y2f = (v1->position().y - v2->position().y) * area_reciprocal;
-	const float y2y0f = (v2->position().y - v0->position().y) * area_reciprocal;
-	const float y0y1f = (v0->position().y - v1->position().y) * area_reciprocal;
+/* Evaluate the edge equation at the tile origin in 64 bit,
+ * along with its min/max over the samples of the tile corners.
+ */
+static inline int64_t EvaluateTileEdge(const TriangleSetup8 &setup, int lane, int i, int x, int y, int tile_size, int64_t &emin, int64_t &emax)
+{
+	const int     a  = setup.mFactorA[i][lane];
+	const int     b  = setup.mFactorB[i][lane];
+	const int64_t e  = (int64_t)a * x + (int64_t)b * y + setup.mFactorC[i][lane];
+	const int64_t dx = (int64_t)a * (tile_size - 1);
+	const int64_t dy = (int64_t)b * (tile_size - 1);
 
-	const float x2x1f = (v2->position().x - v1->position().x) * area_reciprocal;
-	const float x0x2f = (v0->position().x - v2->position().x) * area_reciprocal;
-	const float x1x0f = (v1->position().x - v0->position().x) * area_reciprocal;
+	// a and b are per pixel, the samples are off the pixel centre by subpixels.
+	const int64_t ds = (((int64_t)std::abs(a) + std::abs(b)) * s_SampleExtent) >> RAST_SUBPIXEL_BITS;
 
-	const float lambdax0 = y1y2f * WReciprocal0;
-	const float lambdax1 = y2y0f * WReciprocal1;
-	const float lambdax2 = y0y1f * WReciprocal2;
+	emin = e + (std::min)(dx, (int64_t)0) + (std::min)(dy, (int64_t)0) - ds;
+	emax = e + (std::max)(dx, (int64_t)0) + (std::max)(dy, (int64_t)0) + ds;
 
-	const float lambday0 = x2x1f * WReciprocal0;
-	const float lambday1 = x0x2f * WReciprocal1;
-	const float lambday2 = x1x0f * WReciprocal2;
+	return e;
+}
 
-	// Substracted by 0.5f because of the conversion b/w
-	// pixel index and window coodinates, this avoid per-pixel
-	// substraction.
-	const float xoffset = v0->position().x - 0.5f;
-	const float yoffset = v0->position().y - 0.5f;
+// The triangle only touches one micro tile, which is common with dense meshes,
+// see TBDR::RasterizeMicroTriangle().
+static inline bool IsMicroTriangle(const TriangleSetup8 &setup, int lane)
+{
+	return ((setup.mXMin[lane] >> MICRO_TILE_SIZE_SHIFT) == (setup.mXMax[lane] >> MICRO_TILE_SIZE_SHIFT)) &&
+		   ((setup.mYMin[lane] >> MICRO_TILE_SIZE_SHIFT) == (setup.mYMax[lane] >> MICRO_TILE_SIZE_SHIFT));
+}
 
-	tri->mPCBCOnW0GradientX = lambdax0;
-	tri->mPCBCOnW0GradientY = lambday0;
-	tri->mPCBCOnW0AtOrigin  = WReciprocal0 - tri->mPCBCOnW0GradientX * xoffset - tri->mPCBCOnW0GradientY * yoffset;
+// The pixels [x, x + w) x [y, y + h) are all inside the scissor of the draw.
+static inline bool IsTileInScissor(const RasterStates *raster_states, int x, int y, int w, int h)
+{
+	return (raster_states->mScissorXMin <= x) && (x + w - 1 <= raster_states->mScissorXMax) &&
+		   (raster_states->mScissorYMin <= y) && (y + h - 1 <= raster_states->mScissorYMax);
+}
 
-	tri->mPCBCOnW1GradientX = lambdax1;
-	tri->mPCBCOnW1GradientY = lambday1;
-	tri->mPCBCOnW1AtOrigin  = -(tri->mPCBCOnW1GradientX) * xoffset - tri->mPCBCOnW1GradientY * yoffset;
+/* Test the edges of the triangle against the macro tile at (x, y), return false
+ * if the tile is totally outside the triangle. inside is set if the tile is
+ * totally inside the triangle(and the scissor), i.e. fully covered.
+ */
+static inline bool TestTriangleTile(const Triangle *tri, int x, int y, int tile_size, bool &inside)
+{
+	const TriangleSetup8 &setup = *tri->mSetup;
+	const int lane = tri->mSetupLane;
 
-	tri->mWRecipGradientX   = lambdax0 + lambdax1 + lambdax2;
-	tri->mWRecipGradientY   = lambday0 + lambday1 + lambday2;
-	tri->mWRecipAtOrigin    = WReciprocal0 - tri->mWRecipGradientX * xoffset - tri->mWRecipGradientY * yoffset;
+	inside = true;
 
-	if (tri->mRasterStates->mIsDepthTestEnable)
+	for (int i = 0; i < 3; ++i)
 	{
-		tri->mZGradientX = y1y2f * v0->position().z + y2y0f * v1->position().z + y0y1f * v2->position().z;
-		tri->mZGradientY = x2x1f * v0->position().z + x0x2f * v1->position().z + x1x0f * v2->position().z;
-		tri->mZAtOrigin  = v0->position().z - tri->mZGradientX * xoffset - tri->mZGradientY * yoffset;
-	}
+		int64_t emin, emax;
 
-	if (tri->mRasterStates->mIsDepthOnly)
-		return;
+		EvaluateTileEdge(setup, lane, i, x, y, tile_size, emin, emax);
 
-	const size_t size = v0->getRegsNum();
-	tri->mAttrPlaneEquationA.resize(size);
-	tri->mAttrPlaneEquationB.resize(size);
+		// This macro tile is totally outside the triangle
+		if (emax < 0)
+			return false;
+
+		inside = inside && (emin >= 0);
+	}
 
-	for (size_t i = 1; i < size; ++i)
+	// The scissor is applied in the tiles it clips, see TBDR::RasterizeMaskedTriangle().
+	if (inside && tri->mRasterStates->mIsScissorTestEnable)
 	{
-		tri->mAttrPlaneEquationA.getReg(i) = v0->getReg(i) - v2->getReg(i);
-		tri->mAttrPlaneEquationB.getReg(i) = v1->getReg(i) - v2->getReg(i);
+		inside = IsTileInScissor(tri->mRasterStates, x, y,
+								 (std::min)(tile_size, g_GC->mRT.width  - x),
+								 (std::min)(tile_size, g_GC->mRT.height - y));
 	}
+
+	return true;
 }
 
 void Binning::CoarseRasterizing(Triangle *tri)
 {
-	const int xmin = ROUND_DOWN(tri->xmin, MACRO_TILE_SIZE);
-	const int ymin = ROUND_DOWN(tri->ymin, MACRO_TILE_SIZE);
-
-	__m128i vFactorA0 = _mm_set1_epi32(tri->mVert[0].mFactorA);
-	__m128i vFactorB0 = _mm_set1_epi32(tri->mVert[0].mFactorB);
-	__m128i vFactorC0 = _mm_set1_epi32(tri->mVert[0].mFactorC);
+	const TriangleSetup8 &setup = *tri->mSetup;
+	const int lane = tri->mSetupLane;
+	const int tri_xmin = setup.mXMin[lane];
+	const int tri_xmax = setup.mXMax[lane];
+	const int tri_ymin = setup.mYMin[lane];
+	const int tri_ymax = setup.mYMax[lane];
+
+	const int tile_size = s_TileSize;
+	const int xmin = ROUND_DOWN(tri_xmin, tile_size);
+	const int ymin = ROUND_DOWN(tri_ymin, tile_size);
+
+	vector<BinTile>     &disp_lists  = s_DispList      [ThreadPool::getThreadID()];
+	vector<uint64_t>    &active_mask = s_TileActiveMask[ThreadPool::getThreadID()];
+	vector<uint32_t>    &tile_cost   = s_TileCost      [ThreadPool::getThreadID()];
+	BinArena            &arena       = s_BinArena      [ThreadPool::getThreadID()];
+
+	const uint32_t entry = arena.AddTriangle(tri) << BIN_ENTRY_TRI_SHIFT;
+
+	// A micro triangle can't cross the macro tile boundary, just bin it to
+	// that tile, the tile edge tests are left to the fine rasterizer.
+	if (IsMicroTriangle(setup, lane))
+	{
+		const int tile = (tri_ymin >> s_TileSizeShift) * s_TilesInWidth + (tri_xmin >> s_TileSizeShift);
 
-	__m128i vFactorA1 = _mm_set1_epi32(tri->mVert[1].mFactorA);
-	__m128i vFactorB1 = _mm_set1_epi32(tri->mVert[1].mFactorB);
-	__m128i vFactorC1 = _mm_set1_epi32(tri->mVert[1].mFactorC);
+		arena.append(disp_lists[tile], entry);
+		tile_cost[tile] += TILE_COST_PER_PRIM + (((tri_xmax - tri_xmin + 1) * (tri_ymax - tri_ymin + 1)) >> 1);
+		active_mask[tile >> 6] |= (1ULL << (tile & 63));
+		return;
+	}
 
-	__m128i vFactorA2 = _mm_set1_epi32(tri->mVert[2].mFactorA);
-	__m128i vFactorB2 = _mm_set1_epi32(tri->mVert[2].mFactorB);
-	__m128i vFactorC2 = _mm_set1_epi32(tri->mVert[2].mFactorC);
+	const int tiles_in_bbox = ((tri_xmax >> s_TileSizeShift) - (tri_xmin >> s_TileSizeShift) + 1) *
+							  ((tri_ymax >> s_TileSizeShift) - (tri_ymin >> s_TileSizeShift) + 1);
 
-	for (int y = ymin; y <= tri->ymax; y += MACRO_TILE_SIZE)
+	if (tiles_in_bbox >= BIN_LARGE_TRIANGLE_TILES)
 	{
-		for (int x = xmin; x <= tri->xmax; x += MACRO_TILE_SIZE)
+		vector<BinTile>  &super_lists = s_SuperTileList      [ThreadPool::getThreadID()];
+		vector<uint64_t> &super_mask  = s_SuperTileActiveMask[ThreadPool::getThreadID()];
+		vector<uint32_t> &super_cost  = s_SuperTileCost      [ThreadPool::getThreadID()];
+
+		for (int y = ROUND_DOWN(tri_ymin, BIN_SUPER_TILE_SIZE); y <= tri_ymax; y += BIN_SUPER_TILE_SIZE)
 		{
-			__m128i vTileCornerX = _mm_set_epi32(x + MACRO_TILE_SIZE - 1, x, x + MACRO_TILE_SIZE - 1, x);
-			__m128i vTileCornerY = _mm_set_epi32(y + MACRO_TILE_SIZE - 1, y + MACRO_TILE_SIZE - 1, y, y);
+			for (int x = ROUND_DOWN(tri_xmin, BIN_SUPER_TILE_SIZE); x <= tri_xmax; x += BIN_SUPER_TILE_SIZE)
+			{
+				bool inside;
 
-			__m128i vArea0 = MAWrapper(vFactorB0, vTileCornerY, MAWrapper(vFactorA0, vTileCornerX, vFactorC0));
-			__m128i vTest0 = _mm_cmplt_epi32(vArea0, _mm_setzero_si128());
-			// This macro tile is totally outside the triangle
-			if (_mm_test_all_ones(vTest0))
-				continue;
+				if (!TestTriangleTile(tri, x, y, BIN_SUPER_TILE_SIZE, inside))
+					continue;
 
-			__m128i vArea1 = MAWrapper(vFactorB1, vTileCornerY, MAWrapper(vFactorA1, vTileCornerX, vFactorC1));
-			__m128i vTest1 = _mm_cmplt_epi32(vArea1, _mm_setzero_si128());
-			if (_mm_test_all_ones(vTest1))
-				continue;
+				const int super_tile = (y >> BIN_SUPER_TILE_SIZE_SHIFT) * s_SuperTilesInWidth + (x >> BIN_SUPER_TILE_SIZE_SHIFT);
+
+				arena.append(super_lists[super_tile], entry);
+				super_cost[super_tile] += TILE_COST_PER_PRIM + (inside ? tile_size * tile_size : (tile_size * tile_size) >> 1);
+				super_mask[super_tile >> 6] |= (1ULL << (super_tile & 63));
+			}
+		}
 
-			__m128i vArea2 = MAWrapper(vFactorB2, vTileCornerY, MAWrapper(vFactorA2, vTileCornerX, vFactorC2));
-			__m128i vTest2 = _mm_cmplt_epi32(vArea2, _mm_setzero_si128());
-			if (_mm_test_all_ones(vTest2))
+		return;
+	}
+
+	for (int y = ymin; y <= tri_ymax; y += tile_size)
+	{
+		for (int x = xmin; x <= tri_xmax; x += tile_size)
+		{
+			bool inside;
+
+			if (!TestTriangleTile(tri, x, y, tile_size, inside))
 				continue;
 
-			TriangleBinningPoint tbp;
-			tbp.tri = tri;
+			uint32_t cost = TILE_COST_PER_PRIM;
 
 			// This macro tile is totally inside the triangle
-			if (_mm_test_all_zeros(vTest0, _mm_set1_epi32(0xFFFFFFFF)) &&
-				_mm_test_all_zeros(vTest1, _mm_set1_epi32(0xFFFFFFFF)) &&
-				_mm_test_all_zeros(vTest2, _mm_set1_epi32(0xFFFFFFFF)))
+			if (inside)
 			{
-				tbp.full_cover = true;
+				cost += tile_size * tile_size;
 			}
 			// This macro tile totally contain the triangle(can do OPT ?),
 			// or it's clipped against the triangle edges, so need further rasterization
 			else
 			{
-				tbp.full_cover = false;
-
+				// Roughly half of the bounding box inside the tile is covered.
+				const int w = (std::min)(tri_xmax, x + tile_size - 1) - (std::max)(tri_xmin, x) + 1;
+				const int h = (std::min)(tri_ymax, y + tile_size - 1) - (std::max)(tri_ymin, y) + 1;
+				cost += (w * h) >> 1;
 			}
 
-			s_DispListLock.lock();
-			s_DispList[y >> MACRO_TILE_SIZE_SHIFT][x >> MACRO_TILE_SIZE_SHIFT].push_back(tbp);
-			s_DispListLock.unlock();
+			const int tile = (y >> s_TileSizeShift) * s_TilesInWidth + (x >> s_TileSizeShift);
+
+			arena.append(disp_lists[tile], inside ? (entry | BIN_ENTRY_FULL_COVER) : entry);
+			tile_cost[tile] += cost;
+			active_mask[tile >> 6] |= (1ULL << (tile & 63));
 		}
 	}
 }
@@ -732,20 +679,6 @@ void Binning::finalize()
 {
 }
 
-static inline void CalculatePlaneEquation(__m128 &A, __m128 &lambda0, __m128 &B, __m128 &lambda1, __m128 &C)
-{
-#if defined(__AVX2_)
-	// FMA, relaxed floating-point precision
-	C = _mm_fmadd_ps(A, lambda0, C);
-	C = _mm_fmadd_ps(B, lambda1, C);
-#else 
-	__m128 vTmp = _mm_mul_ps(A, lambda0);
-	C           = _mm_add_ps(C, vTmp);
-	vTmp        = _mm_mul_ps(B, lambda1);
-	C           = _mm_add_ps(C, vTmp);
-#endif
-}
-
 void PerspectiveCorrectInterpolater::emit(void *data)
 {
 	//onInterpolatingSISD(data);
@@ -756,80 +689,41 @@ void PerspectiveCorrectInterpolater::onInterpolatingSISD(void *data)
 {
 	Fsio &fsio = *static_cast<Fsio *>(data);
 	const Triangle *tri = static_cast<Triangle *>(fsio.m_priv0);
-	size_t size = tri->mPrim.mVert[0].getRegsNum();
+	const int size = tri->mAttrRegsNum;
+	const glm::vec4 *vert2 = reinterpret_cast<const glm::vec4 *>(tri->GetAttrVert2());
+	const glm::vec4 *ape_a = reinterpret_cast<const glm::vec4 *>(tri->GetAttrPlaneEquationA());
+	const glm::vec4 *ape_b = reinterpret_cast<const glm::vec4 *>(tri->GetAttrPlaneEquationB());
 
 	const float &stepx = (float)fsio.x;
 	const float &stepy = (float)fsio.y;
-	float w     = tri->mWRecipGradientX * stepx + tri->mWRecipGradientY * stepy + tri->mWRecipAtOrigin;
+	const TriangleSetup8 &setup = *tri->mSetup;
+	const int lane = tri->mSetupLane;
+
+	float w     = setup.mWRecipGradientX[lane] * stepx + setup.mWRecipGradientY[lane] * stepy + setup.mWRecipAtOrigin[lane];
 	w = 1.0f / w;
 
-	float pcbc0 = tri->mPCBCOnW0GradientX * stepx + tri->mPCBCOnW0GradientY * stepy + tri->mPCBCOnW0AtOrigin;
-	float pcbc1 = tri->mPCBCOnW1GradientX * stepx + tri->mPCBCOnW1GradientY * stepy + tri->mPCBCOnW1AtOrigin;
+	float pcbc0 = setup.mPCBCOnW0GradientX[lane] * stepx + setup.mPCBCOnW0GradientY[lane] * stepy + setup.mPCBCOnW0AtOrigin[lane];
+	float pcbc1 = setup.mPCBCOnW1GradientX[lane] * stepx + setup.mPCBCOnW1GradientY[lane] * stepy + setup.mPCBCOnW1AtOrigin[lane];
 
 	pcbc0 *= w;
 	pcbc1 *= w;
 
-	for (size_t i = 1; i < size; ++i)
+	for (int i = 1; i < size; ++i)
 	{
-		fsio.in[i] = tri->mVert2->getReg(i) + tri->mAttrPlaneEquationA[i] * pcbc0 + tri->mAttrPlaneEquationB[i] * pcbc1;
+		fsio.in[i] = vert2[i] + ape_a[i] * pcbc0 + ape_b[i] * pcbc1;
 	}
 }
 
 void PerspectiveCorrectInterpolater::onInterpolatingSIMD(void *data)
 {
-	Fsiosimd &fsio = *static_cast<Fsiosimd *>(data);
-	const Triangle *tri = static_cast<Triangle *>(fsio.m_priv0);
-	size_t size = tri->mPrim.mVert[0].getRegsNum();
-	__m128 vX = _mm_cvtepi32_ps(_mm_set_epi32(fsio.x + 1, fsio.x, fsio.x + 1, fsio.x));
-	__m128 vY = _mm_cvtepi32_ps(_mm_set_epi32(fsio.y + 1, fsio.y + 1, fsio.y, fsio.y));
-
-	__m128 vGradX = _mm_set_ps1(tri->mWRecipGradientX);
-	__m128 vGradY = _mm_set_ps1(tri->mWRecipGradientY);
-	__m128 vW     = _mm_set_ps1(tri->mWRecipAtOrigin);
-	CalculatePlaneEquation(vGradX, vX, vGradY, vY, vW);
-	vW = _mm_rcp_ps(vW);
-	// fsio.mInRegs[3] = vW;
-
-	vGradX        = _mm_set_ps1(tri->mPCBCOnW0GradientX);
-	vGradY        = _mm_set_ps1(tri->mPCBCOnW0GradientY);
-	__m128 vPCBC0 = _mm_set_ps1(tri->mPCBCOnW0AtOrigin);
-	CalculatePlaneEquation(vGradX, vX, vGradY, vY, vPCBC0);
-	vPCBC0 = _mm_mul_ps(vPCBC0, vW);
-
-	vGradX        = _mm_set_ps1(tri->mPCBCOnW1GradientX);
-	vGradY        = _mm_set_ps1(tri->mPCBCOnW1GradientY);
-	__m128 vPCBC1 = _mm_set_ps1(tri->mPCBCOnW1AtOrigin);
-	CalculatePlaneEquation(vGradX, vX, vGradY, vY, vPCBC1);
-	vPCBC1 = _mm_mul_ps(vPCBC1, vW);
-
-	__m128 vRes;
-	__m128 vAPEA, vAPEB;
-	for (size_t i = 1; i < size; ++i)
-	{
-		vRes   = _mm_set_ps1(tri->mVert2->getReg(i).x);
-		vAPEA = _mm_set_ps1(tri->mAttrPlaneEquationA[i].x);
-		vAPEB = _mm_set_ps1(tri->mAttrPlaneEquationB[i].x);
-		CalculatePlaneEquation(vAPEA, vPCBC0, vAPEB, vPCBC1, vRes);
-		_mm_store_ps((float *)&fsio.mInRegs[4 * i + 0], vRes);
-
-		vRes   = _mm_set_ps1(tri->mVert2->getReg(i).y);
-		vAPEA = _mm_set_ps1(tri->mAttrPlaneEquationA[i].y);
-		vAPEB = _mm_set_ps1(tri->mAttrPlaneEquationB[i].y);
-		CalculatePlaneEquation(vAPEA, vPCBC0, vAPEB, vPCBC1, vRes);
-		_mm_store_ps((float *)&fsio.mInRegs[4 * i + 1], vRes);
-
-		vRes   = _mm_set_ps1(tri->mVert2->getReg(i).z);
-		vAPEA = _mm_set_ps1(tri->mAttrPlaneEquationA[i].z);
-		vAPEB = _mm_set_ps1(tri->mAttrPlaneEquationB[i].z);
-		CalculatePlaneEquation(vAPEA, vPCBC0, vAPEB, vPCBC1, vRes);
-		_mm_store_ps((float *)&fsio.mInRegs[4 * i + 2], vRes);
-
-		vRes   = _mm_set_ps1(tri->mVert2->getReg(i).w);
-		vAPEA = _mm_set_ps1(tri->mAttrPlaneEquationA[i].w);
-		vAPEB = _mm_set_ps1(tri->mAttrPlaneEquationB[i].w);
-		CalculatePlaneEquation(vAPEA, vPCBC0, vAPEB, vPCBC1, vRes);
-		_mm_store_ps((float *)&fsio.mInRegs[4 * i + 3], vRes);
-	}
+	FsiosimdGroup &group = *static_cast<FsiosimdGroup *>(data);
+	const Triangle *tri = static_cast<Triangle *>(group.mQuads[0].m_priv0);
+
+	g_Kernels.InterpolateQuads(tri,
+							   tri->GetAttrVert2(),
+							   tri->GetAttrPlaneEquationA(),
+							   tri->GetAttrPlaneEquationB(),
+							   tri->mAttrRegsNum, group.mQuads, group.mCount);
 }
 
 void PerspectiveCorrectInterpolater::onInterpolating(
@@ -882,160 +776,1468 @@ void PerspectiveCorrectInterpolater::onInterpolating(
 }
 
 
+#define ATTR_SETUP_NONE		0
+#define ATTR_SETUP_BUSY		1
+#define ATTR_SETUP_DONE		2
+
 Triangle::Triangle(Primitive &prim, Batch *bat):
 	mPrim(prim),
 	mRasterStates(bat->mDC->mRasterStates),
-	mBatchID(bat->mBatchID)
+	mBatchID(bat->mBatchID),
+	mAttrs(nullptr),
+	mAttrRegsNum(0),
+	mAttrSetupState(ATTR_SETUP_NONE)
+{
+}
+
+void Triangle::SetupAttributes()
+{
+	const int size = mAttrRegsNum;
+	float *vert2 = mAttrs;
+	float *ape_a = vert2 + 4 * size;
+	float *ape_b = ape_a + 4 * size;
+
+	__m128 vAttr0;
+	__m128 vAttr1;
+	__m128 vAttr2;
+	for (int i = 1; i < size; ++i)
+	{
+		vAttr0 = _mm_load_ps((float *)&mVert0->getReg(i));
+		vAttr1 = _mm_load_ps((float *)&mVert1->getReg(i));
+		vAttr2 = _mm_load_ps((float *)&mVert2->getReg(i));
+
+		_mm_store_ps(vert2 + 4 * i, vAttr2);
+		_mm_store_ps(ape_a + 4 * i, _mm_sub_ps(vAttr0, vAttr2));
+		_mm_store_ps(ape_b + 4 * i, _mm_sub_ps(vAttr1, vAttr2));
+	}
+}
+
+/* OPT: most of the binned triangles are hidden in the scenes with high depth
+ * complexity, so the attribute setup is deferred from binning to here.
+ * The first thread to shade the triangle does the setup, and the others
+ * touching the same triangle in other tiles wait for it.
+ */
+inline void Triangle::PrepareAttributes()
 {
+	if (mAttrSetupState.load(std::memory_order_acquire) == ATTR_SETUP_DONE)
+		return;
+
+	int state = ATTR_SETUP_NONE;
+
+	if (mAttrSetupState.compare_exchange_strong(state, ATTR_SETUP_BUSY, std::memory_order_acquire))
+	{
+		SetupAttributes();
+		mAttrSetupState.store(ATTR_SETUP_DONE, std::memory_order_release);
+		return;
+	}
+
+	while (mAttrSetupState.load(std::memory_order_acquire) != ATTR_SETUP_DONE)
+		cpu_relax();
 }
 
 TBDR::TBDR(DrawEngine &de):
 	Rasterizer(),
 	mDE(de),
+	mRenderMode(GLSP_RENDER_MODE_AUTO),
+	mFrameTriangles(0),
+	mLastFrameTriangles(0),
+	mFrameTriangleMemory(0),
+	mLastFrameTriangleMemory(0),
+	mLastFrameValid(false),
 	mDepthClearFlag(false),
+	mColorClearFlag(false),
+	mClearColor(0),
+	mStencilClearFlag(false),
+	mClearStencil(0),
+	mStencilClearMask(0),
+	mClearXMin(0),
+	mClearYMin(0),
+	mClearXMax(-1),
+	mClearYMax(-1),
+	mStencilTestFlag(false),
 	mFlushTriggerBySwapBuffer(true),
-	mDepthOnlyPass(false)
+	mDepthOnlyPass(false),
+	mTileSize(DEFAULT_MACRO_TILE_SIZE),
+	mDepthOnlyTileSize(DEFAULT_DEPTH_ONLY_MACRO_TILE_SIZE)
 {
 	const int thread_number = ThreadPool::get().getThreadsNumber();
 
 	mPixelPrimMap = (PixelPrimMap *)malloc(sizeof(PixelPrimMap) * thread_number);
 	mZBuffer      = (ZBuffer      *)malloc(sizeof(ZBuffer     ) * thread_number);
-
-	assert(mPixelPrimMap && mZBuffer);
+	mColorBuffer  = (ColorBuffer  *)malloc(sizeof(ColorBuffer ) * thread_number);
+	mStencilBuffer = (StencilBuffer *)malloc(sizeof(StencilBuffer) * thread_number);
+	mHiZBuffer    = (HiZBuffer    *)malloc(sizeof(HiZBuffer   ) * thread_number);
+	mShadingQueue = (FsiosimdGroup *)malloc(sizeof(FsiosimdGroup) * thread_number);
+	mMultisampleTile = nullptr;
+	mMergedList   = new DisplayList[thread_number];
+	mDecodeList   = new DisplayList[thread_number];
+	mMergeRuns    = new vector<BinRun>[thread_number];
+	mImmediateRowList = new DisplayList[thread_number];
+
+	assert(mPixelPrimMap && mZBuffer && mColorBuffer && mStencilBuffer && mHiZBuffer && mShadingQueue &&
+		   mMergedList && mDecodeList && mMergeRuns && mImmediateRowList);
+
+	for (int i = 0; i < thread_number; ++i)
+		mShadingQueue[i].mCount = 0;
 }
 
 TBDR::~TBDR()
 {
+	delete []mImmediateRowList;
+	delete []mMergeRuns;
+	delete []mDecodeList;
+	delete []mMergedList;
+	_mm_free(mMultisampleTile);
+	free(mShadingQueue);
+	free(mHiZBuffer);
+	free(mStencilBuffer);
+	free(mColorBuffer);
 	free(mZBuffer);
 	free(mPixelPrimMap);
 }
 
-void TBDR::onRasterizing()
+// Interleave the lower 16 bits of x and y, x goes to the even bits.
+static inline uint32_t MortonEncode(uint32_t x, uint32_t y)
 {
-	::glsp::ThreadPool &thread_pool = ::glsp::ThreadPool::get();
+	auto spread = [] (uint32_t v)
+	{
+		v &= 0x0000FFFF;
+		v = (v | (v << 8)) & 0x00FF00FF;
+		v = (v | (v << 4)) & 0x0F0F0F0F;
+		v = (v | (v << 2)) & 0x33333333;
+		v = (v | (v << 1)) & 0x55555555;
+		return v;
+	};
+
+	return spread(x) | (spread(y) << 1);
+}
 
-	for (int y = 0; y < MAX_TILES_IN_HEIGHT; ++y)
+static inline void MortonDecode(uint32_t code, int &x, int &y)
+{
+	auto compact = [] (uint32_t v)
 	{
-		for (int x = 0; x < MAX_TILES_IN_WIDTH; ++x)
-		{
-			std::vector<TriangleBinningPoint> &disp_list = s_DispList[y][x];
+		v &= 0x55555555;
+		v = (v | (v >> 1)) & 0x33333333;
+		v = (v | (v >> 2)) & 0x0F0F0F0F;
+		v = (v | (v >> 4)) & 0x00FF00FF;
+		v = (v | (v >> 8)) & 0x0000FFFF;
+		return v;
+	};
 
-			if (!disp_list.empty() || mDepthClearFlag)
-			{
-				auto task_handler = [this, x, y](void *data)
-				{
-					this->FineRasterizing(x, y);
-				};
-				WorkItem *task = thread_pool.CreateWork(task_handler, nullptr);
-				thread_pool.AddWork(task);
-			}
-		}
-	}
+	x = (int)compact(code);
+	y = (int)compact(code >> 1);
 }
 
-template <typename T>
-static inline void _simd_mask_store(T *ptr, __m128i &vMask, T value)
+bool TBDR::SetMacroTileSize(int tile_size, int depth_only_tile_size)
 {
-	if (_mm_extract_epi32(vMask, 0))
-		*(ptr + 0) = value;
+	auto is_valid = [] (int size)
+	{
+		return (size >= MIN_MACRO_TILE_SIZE && size <= MAX_MACRO_TILE_SIZE && !(size & (size - 1)));
+	};
 
-	if (_mm_extract_epi32(vMask, 1))
-		*(ptr + 1) = value;
+	if (!is_valid(tile_size) || !is_valid(depth_only_tile_size))
+		return false;
 
-	if (_mm_extract_epi32(vMask, 2))
-		*(ptr + 2) = value;
+	mTileSize          = tile_size;
+	mDepthOnlyTileSize = depth_only_tile_size;
 
-	if (_mm_extract_epi32(vMask, 3))
-		*(ptr + 3) = value;
+	return true;
 }
 
-void TBDR::FineRasterizing(int x, int y)
+bool TBDR::IsTileGridChanged(int width, int height, bool depth_only, int samples) const
 {
-	PixelPrimMap &pp_map = mPixelPrimMap[ThreadPool::getThreadID()];
-	ZBuffer      &z_buf  = mZBuffer     [ThreadPool::getThreadID()];
+	const int tile_size = depth_only ? mDepthOnlyTileSize : mTileSize;
 
-	std::vector<TriangleBinningPoint> &disp_list = s_DispList[y][x];
+	return (tile_size != s_TileSize || samples != s_Samples ||
+			s_TilesInWidth  != (width  + tile_size - 1) / tile_size ||
+			s_TilesInHeight != (height + tile_size - 1) / tile_size);
+}
 
-	x = (x << MACRO_TILE_SIZE_SHIFT);
-	y = (y << MACRO_TILE_SIZE_SHIFT);
+void TBDR::SetupTileGrid(int width, int height, bool depth_only, int samples)
+{
+	if (!IsTileGridChanged(width, height, depth_only, samples))
+		return;
 
-	const bool has_prims = !disp_list.empty();
+	if (samples > 1 && !mMultisampleTile)
+	{
+		const int thread_number = ThreadPool::get().getThreadsNumber();
 
-	const int max_w = (std::min)(MACRO_TILE_SIZE, g_GC->mRT.width  - x);
-	const int max_h = (std::min)(MACRO_TILE_SIZE, g_GC->mRT.height - y);
+		mMultisampleTile = (MultisampleTile *)_mm_malloc(sizeof(MultisampleTile) * thread_number, 64);
+		assert(mMultisampleTile);
 
-	float *rt_zbuf = g_GC->mRT.pDepthBuffer + g_GC->mRT.width * y + x;
+		for (int i = 0; i < thread_number; ++i)
+			std::memset(mMultisampleTile[i].mSampleCoverage, 0, sizeof(mMultisampleTile[i].mSampleCoverage));
+	}
 
-	if (!has_prims)
-	{
-		// enter this only when clear flag set.
-		if (!mFlushTriggerBySwapBuffer)
-		{
-			float *dst = rt_zbuf;
+	s_Samples      = samples;
+	s_SampleExtent = (samples > 1) ? MSAA_SAMPLE_EXTENT : 0;
 
-			__m128 vDepth = _mm_set_ps1(static_cast<float>(g_GC->mState.mClearState.depth));
-			for (int i = 0; i < max_h; ++i, dst += g_GC->mRT.width)
-			{
-				float *dstx = dst;
-				for (int j = 0; j < max_w; j += 4, dstx += 4)
-				{
-					_mm_stream_ps(dstx, vDepth);
-				}
-			}
-		}
+	s_TileSize = depth_only ? mDepthOnlyTileSize : mTileSize;
 
-		return;
-	}
-	else if (mDepthClearFlag)
-	{
-		__m128 vDepth = _mm_set_ps1(static_cast<float>(g_GC->mState.mClearState.depth));
-		float *addr = &z_buf[0][0];
+	unsigned long shift;
+	_BitScanForward(&shift, (unsigned long)s_TileSize);
+	s_TileSizeShift = (int)shift;
 
-		// Assume 64 bytes cache line size
-		for (int i = 0; i < MACRO_TILE_SIZE * MACRO_TILE_SIZE; i += 16, addr += 16)
-		{
-			_mm_store_ps(addr     , vDepth);
-			_mm_store_ps(addr + 4 , vDepth);
-			_mm_store_ps(addr + 8 , vDepth);
-			_mm_store_ps(addr + 12, vDepth);
-		}
+	s_TilesInWidth  = (width  + s_TileSize - 1) >> s_TileSizeShift;
+	s_TilesInHeight = (height + s_TileSize - 1) >> s_TileSizeShift;
+
+	const int tiles_num = s_TilesInWidth * s_TilesInHeight;
+
+	s_SuperTilesInWidth  = (width  + BIN_SUPER_TILE_SIZE - 1) >> BIN_SUPER_TILE_SIZE_SHIFT;
+	s_SuperTilesInHeight = (height + BIN_SUPER_TILE_SIZE - 1) >> BIN_SUPER_TILE_SIZE_SHIFT;
+
+	const int super_tiles_num = s_SuperTilesInWidth * s_SuperTilesInHeight;
+
+	for (int i = 0; i < s_DispListNum; ++i)
+	{
+		s_DispList[i].resize(tiles_num, { BIN_CHUNK_NONE, BIN_CHUNK_NONE });
+		s_TileActiveMask[i].resize((tiles_num + 63) >> 6);
+		s_TileCost[i].resize(tiles_num);
+		s_SuperTileList[i].resize(super_tiles_num, { BIN_CHUNK_NONE, BIN_CHUNK_NONE });
+		s_SuperTileActiveMask[i].resize((super_tiles_num + 63) >> 6);
+		s_SuperTileCost[i].resize(super_tiles_num);
 	}
-	else
+}
+
+/* Mark the tiles of the active super tiles active, and add the cost of the
+ * large triangles to them. They go to the tile bitmap and cost of the main
+ * thread, which are reset along with the others in TBDR::finalize().
+ * NOTE: call it only after the geometry tasks are done.
+ */
+static void ExpandSuperTiles()
+{
+	vector<uint64_t> &active_mask = s_TileActiveMask[s_DispListNum - 1];
+	vector<uint32_t> &tile_cost   = s_TileCost      [s_DispListNum - 1];
+
+	const int tiles_in_super_tile = BIN_SUPER_TILE_SIZE >> s_TileSizeShift;
+
+	for (int i = 0; i < s_DispListNum; ++i)
 	{
-		// load on tile depth buffer from render target.
-		float *src = rt_zbuf;
+		vector<uint64_t> &super_mask = s_SuperTileActiveMask[i];
 
-		for (int i = 0; i < max_h; ++i, src += g_GC->mRT.width)
+		for (size_t w = 0; w < super_mask.size(); ++w)
 		{
-			float *srcx = src;
-			for (int j = 0; j < max_w; j += 4, srcx += 4)
+			for (uint64_t active = super_mask[w]; active; active &= active - 1)
 			{
-				__m128 vDepth = _mm_castsi128_ps(_mm_stream_load_si128((__m128i *)srcx));
-				_mm_store_ps(&z_buf[i][j], vDepth);
+				unsigned long bit;
+				_BitScanForward(&bit, active);
+
+				const int super_tile = (int)(w << 6) + (int)bit;
+				const uint32_t cost  = s_SuperTileCost[i][super_tile];
+
+				const int tx0 = (super_tile % s_SuperTilesInWidth) * tiles_in_super_tile;
+				const int ty0 = (super_tile / s_SuperTilesInWidth) * tiles_in_super_tile;
+				const int tx1 = (std::min)(tx0 + tiles_in_super_tile, s_TilesInWidth);
+				const int ty1 = (std::min)(ty0 + tiles_in_super_tile, s_TilesInHeight);
+
+				for (int ty = ty0; ty < ty1; ++ty)
+				{
+					for (int tx = tx0; tx < tx1; ++tx)
+					{
+						const int tile = ty * s_TilesInWidth + tx;
+
+						tile_cost[tile] += cost;
+						active_mask[tile >> 6] |= (1ULL << (tile & 63));
+					}
+				}
 			}
 		}
 	}
+}
 
-	// Sort triangles based on their batch id to preserve the submission orders.
-	// Also need preserve the relative order of triangles with equivalent batch id.
-	std::stable_sort(disp_list.begin(), disp_list.end(),
-			[] (const TriangleBinningPoint &t1, const TriangleBinningPoint &t2)
-			{
-				return (t1.tri->mBatchID < t2.tri->mBatchID);
+/* The tiles are queued by the estimated cost, the most expensive ones first,
+ * so that they don't end up as a long tail at the end of the frame.
+ * The tiles of similar cost(same power of 2) are queued in Morton order,
+ * so the neighbouring tiles are rendered at the same time and share the
+ * texture and framebuffer cache lines.
+ */
+void TBDR::onRasterizing()
+{
+	if (s_ImmediateMode)
+	{
+		onRasterizingImmediate();
+		return;
+	}
+
+	::glsp::ThreadPool &thread_pool = ::glsp::ThreadPool::get();
+
+	const int tiles_num = s_TilesInWidth * s_TilesInHeight;
+	const int words_num = (tiles_num + 63) >> 6;
+
+	mTileQueue.clear();
+
+	ExpandSuperTiles();
+
+	for (int w = 0; w < words_num; ++w)
+	{
+		uint64_t active = 0;
+
+		for (int i = 0; i < s_DispListNum; ++i)
+			active |= s_TileActiveMask[i][w];
+
+		// All of the tiles need to be touched to clear the depth, color or stencil.
+		if (mDepthClearFlag || mColorClearFlag || mStencilClearFlag)
+			active = (w == (tiles_num - 1) >> 6 && (tiles_num & 63)) ? ((1ULL << (tiles_num & 63)) - 1) : ~0ULL;
+
+		while (active)
+		{
+			unsigned long bit;
+			_BitScanForward(&bit, active);
+			active &= active - 1;
+
+			const int tile = (w << 6) + (int)bit;
+
+			uint32_t cost = 0;
+			for (int i = 0; i < s_DispListNum; ++i)
+				cost += s_TileCost[i][tile];
+
+			// cost class, 0 for the tiles to be cleared only
+			unsigned long cost_class = 0;
+			if (cost)
+			{
+				_BitScanReverse(&cost_class, cost);
+				cost_class += 1;
+			}
+
+			const uint32_t morton = MortonEncode(tile % s_TilesInWidth, tile / s_TilesInWidth);
+			mTileQueue.push_back(((uint64_t)(63 - cost_class) << 32) | morton);
+		}
+	}
+
+	std::sort(mTileQueue.begin(), mTileQueue.end());
+
+	for (uint64_t key: mTileQueue)
+	{
+		int x, y;
+		MortonDecode((uint32_t)key, x, y);
+
+		auto task_handler = [this, x, y](void *data)
+		{
+			this->FineRasterizing(x, y, this->GetTileDisplayList(x, y));
+		};
+		WorkItem *task = thread_pool.CreateWork(task_handler, nullptr);
+		thread_pool.AddWork(task);
+	}
+}
+
+/* Immediate mode, for the light frames: nothing is binned to the tiles, the
+ * tiles pick the triangles touching them from the flat list of the render
+ * pass. The tile rows are split into one band per thread, a tile row filters
+ * the list first so a tile only walks the triangles of its row.
+ * It saves the display lists, the tile queue sort and a task per tile.
+ */
+void TBDR::onRasterizingImmediate()
+{
+	::glsp::ThreadPool &thread_pool = ::glsp::ThreadPool::get();
+
+	mImmediateList.clear();
+	MergeImmediateLists(mImmediateList);
+
+	const int bands = (std::min)(thread_pool.getThreadsNumber(), s_TilesInHeight);
+
+	for (int band = 0; band < bands; ++band)
+	{
+		const int row_begin = s_TilesInHeight *  band      / bands;
+		const int row_end   = s_TilesInHeight * (band + 1) / bands;
+
+		auto task_handler = [this, row_begin, row_end](void *data)
+		{
+			this->RenderImmediateTileRows(row_begin, row_end);
+		};
+		WorkItem *task = thread_pool.CreateWork(task_handler, nullptr);
+		thread_pool.AddWork(task);
+	}
+}
+
+void TBDR::RenderImmediateTileRows(int row_begin, int row_end)
+{
+	const int tile_size = s_TileSize;
+
+	// All of the tiles need to be touched to clear the depth, color or stencil.
+	const bool clear = mDepthClearFlag || mColorClearFlag || mStencilClearFlag;
+
+	DisplayList &row_list  = mImmediateRowList[ThreadPool::getThreadID()];
+	DisplayList &tile_list = mMergedList      [ThreadPool::getThreadID()];
+
+	for (int row = row_begin; row < row_end; ++row)
+	{
+		const int y = row << s_TileSizeShift;
+
+		row_list.clear();
+
+		for (const TriangleBinningPoint &tbp: mImmediateList)
+		{
+			const TriangleSetup8 &setup = *tbp.tri->mSetup;
+			const int lane = tbp.tri->mSetupLane;
+
+			if (setup.mYMin[lane] < y + tile_size && setup.mYMax[lane] >= y)
+				row_list.push_back(tbp);
+		}
+
+		if (row_list.empty() && !clear)
+			continue;
+
+		for (int col = 0; col < s_TilesInWidth; ++col)
+		{
+			const int x = col << s_TileSizeShift;
+
+			tile_list.clear();
+
+			for (const TriangleBinningPoint &tbp: row_list)
+			{
+				const TriangleSetup8 &setup = *tbp.tri->mSetup;
+				const int lane = tbp.tri->mSetupLane;
+
+				if (setup.mXMin[lane] >= x + tile_size || setup.mXMax[lane] < x)
+					continue;
+
+				// Same as CoarseRasterizing(), a micro triangle is left to the fine rasterizer.
+				TriangleBinningPoint entry = tbp;
+
+				if (!IsMicroTriangle(setup, lane) && !TestTriangleTile(tbp.tri, x, y, tile_size, entry.full_cover))
+					continue;
+
+				tile_list.push_back(entry);
+			}
+
+			if (!tile_list.empty() || clear)
+				FineRasterizing(col, row, tile_list.empty() ? nullptr : &tile_list);
+		}
+	}
+}
+
+// Merge the per thread flat lists of the immediate mode in submission order.
+void TBDR::MergeImmediateLists(DisplayList &merged_list)
+{
+	vector<BinRun> runs;
+
+	for (int i = 0; i < s_DispListNum; ++i)
+	{
+		const DisplayList &list = s_ImmediateList[i];
+
+		if (!list.empty())
+			runs.push_back({list.data(), list.data() + list.size()});
+	}
+
+	MergeBatchRuns(runs, merged_list);
+}
+
+template <typename T>
+static inline void _simd_mask_store(T *ptr, __m128i &vMask, T value)
+{
+	if (_mm_extract_epi32(vMask, 0))
+		*(ptr + 0) = value;
+
+	if (_mm_extract_epi32(vMask, 1))
+		*(ptr + 1) = value;
+
+	if (_mm_extract_epi32(vMask, 2))
+		*(ptr + 2) = value;
+
+	if (_mm_extract_epi32(vMask, 3))
+		*(ptr + 3) = value;
+}
+
+/* The edges not crossing the tile are resolved here with 64 bit evaluation.
+ * The crossing ones are small enough near the tile to be stepped in 32 bit,
+ * so they're rebased to the tile origin.
+ * Return false if the tile is totally outside of the triangle.
+ */
+static inline bool SetupTileEdges(const Triangle *tri, int x, int y, int tile_size, int A[3], int B[3], int C[3])
+{
+	const TriangleSetup8 &setup = *tri->mSetup;
+	const int lane = tri->mSetupLane;
+
+	for (int i = 0; i < 3; ++i)
+	{
+		int64_t emin, emax;
+		const int64_t e = EvaluateTileEdge(setup, lane, i, x, y, tile_size, emin, emax);
+
+		if (emax < 0)
+			return false;
+
+		if (emin >= 0)
+		{
+			// Always inside this edge
+			A[i] = B[i] = C[i] = 0;
+		}
+		else
+		{
+			A[i] = setup.mFactorA[i][lane];
+			B[i] = setup.mFactorB[i][lane];
+			C[i] = static_cast<int>(e);
+		}
+	}
+
+	return true;
+}
+
+// Relative error allowed between the depth bounds and the
+// incrementally interpolated depth.
+#define HIZ_EPSILON (64.0f * FLT_EPSILON)
+
+/* Depth bounds of the triangle over the samples of pixels [x0, x1] x [y0, y1].
+ * The depth plane is evaluated at the corners, then clamped to the
+ * depth range of vertices, so small triangles get tight bounds too.
+ */
+static inline void GetDepthBounds(const Triangle *tri, int x0, int y0, int x1, int y1, float &zmin, float &zmax)
+{
+	const TriangleSetup8 &setup = *tri->mSetup;
+	const int lane = tri->mSetupLane;
+
+	const float gx = setup.mZGradientX[lane];
+	const float gy = setup.mZGradientY[lane];
+	const float z0 = setup.mZAtOrigin[lane];
+
+	const float z  = z0 + gx * x0 + gy * y0;
+	const float dx = gx * (x1 - x0);
+	const float dy = gy * (y1 - y0);
+	const float eps = (fabs(z0) + fabs(gx * x1) + fabs(gy * y1)) * HIZ_EPSILON;
+
+	// Depth change from the pixel centre to the farthest sample
+	const float ds = s_SampleExtent ? (fabs(gx) + fabs(gy)) * (s_SampleExtent * (1.0f / RAST_SUBPIXELS)) : 0.0f;
+
+	zmin = (std::max)(z + (std::min)(0.0f, dx) + (std::min)(0.0f, dy) - ds, setup.mZMin[lane]) - eps;
+	zmax = (std::min)(z + (std::max)(0.0f, dx) + (std::max)(0.0f, dy) + ds, setup.mZMax[lane]) + eps;
+}
+
+// The triangle writes every pixel of the tile that passes the depth test.
+static inline bool IsTileOccluder(const TriangleBinningPoint &tbp)
+{
+	const RasterStates *raster_states = tbp.tri->mRasterStates;
+
+	return tbp.full_cover &&
+		   !raster_states->mIsBlendEnable &&
+		   !raster_states->mIsStencilTestEnable &&
+		   !(raster_states->mFS && raster_states->mFS->getDiscardFlag()) &&
+		   (raster_states->mIsDepthTestEnable || !raster_states->mIsDepthOnly);
+}
+
+/* Index of the first display list entry of the tile which may be visible.
+ * An occluder hides all of the entries before it, if it's known to pass the
+ * depth test on every pixel, i.e. its max depth is below both the depth of the
+ * tile and the depth written by those entries, or if the depth test is off
+ * and none of those entries writes depth.
+ * The stencil tested entries can't be skipped, they may update the stencil
+ * of the pixels hidden later.
+ */
+static size_t FindFirstVisibleEntry(const DisplayList &disp_list, int x, int y, int max_w, int max_h, float tile_zmin)
+{
+	// Only need scan up to the last occluder.
+	size_t end = disp_list.size();
+
+	while (end > 1 && !IsTileOccluder(disp_list[end - 1]))
+		--end;
+
+	if (end <= 1)
+		return 0;
+
+	size_t first = 0;
+	float  zmin  = tile_zmin;
+	bool   depth_written = false;
+
+	for (size_t i = 0; i < end; ++i)
+	{
+		const TriangleBinningPoint &tbp = disp_list[i];
+		const Triangle *tri = tbp.tri;
+		const RasterStates *raster_states = tri->mRasterStates;
+		const TriangleSetup8 &setup = *tri->mSetup;
+		const int lane = tri->mSetupLane;
+
+		if (raster_states->mIsStencilTestEnable)
+			break;
+
+		float tri_zmin = 0.0f, tri_zmax = 0.0f;
+
+		if (raster_states->mIsDepthTestEnable)
+		{
+			GetDepthBounds(tri,
+						   (std::max)(x, setup.mXMin[lane]), (std::max)(y, setup.mYMin[lane]),
+						   (std::min)(x + max_w - 1, setup.mXMax[lane]), (std::min)(y + max_h - 1, setup.mYMax[lane]),
+						   tri_zmin, tri_zmax);
+		}
+
+		if (IsTileOccluder(tbp))
+		{
+			if (raster_states->mIsDepthTestEnable ? (tri_zmax < zmin) : !depth_written)
+				first = i;
+		}
+
+		if (raster_states->mIsDepthTestEnable)
+		{
+			zmin = (std::min)(zmin, tri_zmin);
+			depth_written = true;
+		}
+	}
+
+	return first;
+}
+
+// Build the HiZ from scratch after the on-tile z buffer is loaded.
+// NOTE: _mm_min/max_ps return the second operand if either is NaN,
+// so the uninitialized pixels outside of the render target are skipped.
+static void BuildHiZ(HiZBuffer &hiz, float *z_buf, int tile_size)
+{
+	for (int i = 0; i < (tile_size >> MICRO_TILE_SIZE_SHIFT); ++i)
+	{
+		for (int j = 0; j < (tile_size >> MICRO_TILE_SIZE_SHIFT); ++j)
+		{
+			float *zbuf_pos = z_buf + (i * MAX_MACRO_TILE_SIZE + j) * MICRO_TILE_SIZE;
+			__m128 vZMin = _mm_set_ps1( FLT_MAX);
+			__m128 vZMax = _mm_set_ps1(-FLT_MAX);
+
+			for (int k = 0; k < MICRO_TILE_SIZE; ++k, zbuf_pos += MAX_MACRO_TILE_SIZE)
+			{
+				for (int l = 0; l < MICRO_TILE_SIZE; l += 4)
+				{
+					__m128 vZ = _mm_load_ps(zbuf_pos + l);
+					vZMin = _mm_min_ps(vZ, vZMin);
+					vZMax = _mm_max_ps(vZ, vZMax);
+				}
+			}
+
+			hiz.mMicroZMin[i][j] = _simd_hmin_ps(vZMin);
+			hiz.mMicroZMax[i][j] = _simd_hmax_ps(vZMax);
+		}
+	}
+}
+
+// Refresh the macro tile min/max from the micro tiles inside the render target.
+static inline void UpdateHiZ(HiZBuffer &hiz, int max_w, int max_h)
+{
+	float zmin = FLT_MAX;
+	float zmax = -FLT_MAX;
+
+	for (int i = 0; i < max_h; i += MICRO_TILE_SIZE)
+	{
+		for (int j = 0; j < max_w; j += MICRO_TILE_SIZE)
+		{
+			zmin = (std::min)(zmin, hiz.mMicroZMin[i >> MICRO_TILE_SIZE_SHIFT][j >> MICRO_TILE_SIZE_SHIFT]);
+			zmax = (std::max)(zmax, hiz.mMicroZMax[i >> MICRO_TILE_SIZE_SHIFT][j >> MICRO_TILE_SIZE_SHIFT]);
+		}
+	}
+
+	hiz.mZMin = zmin;
+	hiz.mZMax = zmax;
+}
+
+// Depth plane at the window origin, moved to the sample.
+static inline float GetSampleZAtOrigin(const TriangleSetup8 &setup, int lane, int offset_x, int offset_y)
+{
+	float z = setup.mZAtOrigin[lane];
+
+	if (offset_x | offset_y)
+		z += (setup.mZGradientX[lane] * offset_x + setup.mZGradientY[lane] * offset_y) * (1.0f / RAST_SUBPIXELS);
+
+	return z;
+}
+
+// Move the tile edge equations to the sample, the edges always inside stay untouched.
+// NOTE: A and B are multiples of RAST_SUBPIXELS, so the shift is exact.
+static inline void OffsetTileEdges(int A[3], int B[3], int C[3], int offset_x, int offset_y)
+{
+	for (int i = 0; i < 3; ++i)
+		C[i] += (A[i] * offset_x + B[i] * offset_y) >> RAST_SUBPIXEL_BITS;
+}
+
+/* In the swizzled render target the SWIZZLE_BLOCK_SIZE blocks of an aligned
+ * macro tile are contiguous and in morton order, whatever the tile size is.
+ * Return the offset of the tile at (x, y) in pixels.
+ */
+static inline size_t GetSwizzledTileOffset(int x, int y)
+{
+	const int super_tiles_in_width = ROUND_UP(g_GC->mRT.width, SWIZZLE_SUPER_TILE_SIZE) / SWIZZLE_SUPER_TILE_SIZE;
+	const int super_tile = (y / SWIZZLE_SUPER_TILE_SIZE) * super_tiles_in_width + (x / SWIZZLE_SUPER_TILE_SIZE);
+	const uint32_t block = MortonEncode((x % SWIZZLE_SUPER_TILE_SIZE) / SWIZZLE_BLOCK_SIZE,
+										(y % SWIZZLE_SUPER_TILE_SIZE) / SWIZZLE_BLOCK_SIZE);
+
+	return (size_t)super_tile * SWIZZLE_SUPER_TILE_SIZE * SWIZZLE_SUPER_TILE_SIZE +
+		   (size_t)block * SWIZZLE_BLOCK_SIZE * SWIZZLE_BLOCK_SIZE;
+}
+
+/* Call row_func(i, j, row, len) for the rows of the macro tile at (x, y) in a
+ * render target buffer, (i, j) is the position of the row in the tile.
+ * The rows of a swizzled tile are the block rows, visited in memory order so
+ * the tile is one contiguous stream. They are always SWIZZLE_BLOCK_SIZE pixels
+ * and 64 bytes aligned for 32 bit pixels, the edge tiles spill to the padding.
+ */
+template <typename T, typename F>
+static inline void ForEachTileRow(T *rt_buf, int x, int y, int max_w, int max_h, F row_func)
+{
+	if (g_GC->mRT.layout == NWM_BUFFER_LAYOUT_LINEAR)
+	{
+		T *row = rt_buf + g_GC->mRT.width * y + x;
+
+		for (int i = 0; i < max_h; ++i, row += g_GC->mRT.width)
+			row_func(i, 0, row, max_w);
+	}
+	else
+	{
+		const int blocks_in_tile = s_TileSize / SWIZZLE_BLOCK_SIZE;
+		T *block_base = rt_buf + GetSwizzledTileOffset(x, y);
+
+		for (int b = 0; b < blocks_in_tile * blocks_in_tile; ++b, block_base += SWIZZLE_BLOCK_SIZE * SWIZZLE_BLOCK_SIZE)
+		{
+			int bx, by;
+			MortonDecode(b, bx, by);
+
+			const int i0 = by * SWIZZLE_BLOCK_SIZE;
+			const int j  = bx * SWIZZLE_BLOCK_SIZE;
+			if (i0 >= max_h || j >= max_w)
+				continue;
+
+			for (int k = 0; k < SWIZZLE_BLOCK_SIZE; ++k)
+				row_func(i0 + k, j, block_base + k * SWIZZLE_BLOCK_SIZE, SWIZZLE_BLOCK_SIZE);
+		}
+	}
+}
+
+// Pixels of the micro tile inside the inclusive rectangle [x0, x1] x [y0, y1],
+// which is relative to the micro tile.
+static inline uint64_t GetMicroTileRectMask(int x0, int y0, int x1, int y1)
+{
+	x0 = (std::max)(x0, 0);
+	y0 = (std::max)(y0, 0);
+	x1 = (std::min)(x1, MICRO_TILE_SIZE - 1);
+	y1 = (std::min)(y1, MICRO_TILE_SIZE - 1);
+
+	if (x0 > x1 || y0 > y1)
+		return 0;
+
+	const uint64_t row  = (0xFFULL >> (MICRO_TILE_SIZE - 1 - x1)) & (0xFFULL << x0);
+	const uint64_t rows = (~0ULL >> ((MICRO_TILE_SIZE - 1 - y1) << MICRO_TILE_SIZE_SHIFT)) & (~0ULL << (y0 << MICRO_TILE_SIZE_SHIFT));
+
+	return (row * 0x0101010101010101ULL) & rows;
+}
+
+/* Call pixel_func(i, j) for the pixels of the tile inside the inclusive
+ * rectangle [x0, x1] x [y0, y1], which is relative to the tile.
+ * Used for the partial clears of the edge tiles of the clear rectangle.
+ */
+template <typename F>
+static inline void ForEachPixelInRect(int x0, int y0, int x1, int y1, int max_w, int max_h, F pixel_func)
+{
+	for (int i = 0; i < max_h; i += MICRO_TILE_SIZE)
+	{
+		for (int j = 0; j < max_w; j += MICRO_TILE_SIZE)
+		{
+			for (uint64_t mask = GetMicroTileRectMask(x0 - j, y0 - i, x1 - j, y1 - i); mask; mask &= mask - 1)
+			{
+				unsigned long bit;
+				_BitScanForward(&bit, mask);
+
+				const int k = i + (bit >> MICRO_TILE_SIZE_SHIFT);
+				const int l = j + (bit & (MICRO_TILE_SIZE - 1));
+
+				if (k < max_h && l < max_w)
+					pixel_func(k, l);
+			}
+		}
+	}
+}
+
+/* Stream the clear color out to the tile of the render target,
+ * for the tiles with nothing drawn.
+ */
+static void ClearColorTile(int x, int y, int max_w, int max_h, uint32_t color)
+{
+	const __m128i vColor = _mm_set1_epi32(color);
+
+	ForEachTileRow((uint32_t *)g_GC->mRT.pColorBuffer, x, y, max_w, max_h,
+		[&](int, int, uint32_t *dst, int len)
+		{
+			int j = 0;
+
+			// The linear rows are only 16 bytes aligned if the width is a multiple of 4.
+			for (; j < len && ((uintptr_t)(dst + j) & 15); ++j)
+				dst[j] = color;
+
+			for (; j + 4 <= len; j += 4)
+				_mm_stream_si128((__m128i *)(dst + j), vColor);
+
+			for (; j < len; ++j)
+				dst[j] = color;
+		});
+
+	_mm_sfence();
+}
+
+/* The color is rendered in the on-tile buffer, one plane per sample.
+ * The render target is only touched by the tile load(skipped if the tile is
+ * cleared or totally overwritten) and the tile store, which is streamed out
+ * after the samples are resolved.
+ */
+static void FillTileColor(uint32_t *color_buf, int samples, int max_w, int max_h, uint32_t color)
+{
+	const __m128i vColor = _mm_set1_epi32(color);
+
+	for (int s = 0; s < samples; ++s)
+	{
+		for (int i = 0; i < max_h; ++i)
+		{
+			uint32_t *dst = color_buf + (s * MAX_MACRO_TILE_SIZE + i) * MAX_MACRO_TILE_SIZE;
+
+			for (int j = 0; j < max_w; j += 4)
+				_mm_store_si128((__m128i *)(dst + j), vColor);
+		}
+	}
+}
+
+static void LoadTileColor(uint32_t *color_buf, int samples, int x, int y, int max_w, int max_h)
+{
+	const int plane_size = MAX_MACRO_TILE_SIZE * MAX_MACRO_TILE_SIZE;
+
+	ForEachTileRow((const uint32_t *)g_GC->mRT.pColorBuffer, x, y, max_w, max_h,
+		[&](int i, int j0, const uint32_t *src, int len)
+		{
+			uint32_t *dst = color_buf + i * MAX_MACRO_TILE_SIZE + j0;
+			int j = 0;
+
+			for (; j + 4 <= len; j += 4)
+			{
+				__m128i vColor = _mm_loadu_si128((const __m128i *)(src + j));
+
+				for (int s = 0; s < samples; ++s)
+					_mm_store_si128((__m128i *)(dst + s * plane_size + j), vColor);
+			}
+
+			for (; j < len; ++j)
+			{
+				for (int s = 0; s < samples; ++s)
+					dst[s * plane_size + j] = src[j];
+			}
+		});
+}
+
+// Average the samples to the first plane.
+static void ResolveTileColor(uint32_t *color_buf, int max_w, int max_h)
+{
+	const int plane_size = MAX_MACRO_TILE_SIZE * MAX_MACRO_TILE_SIZE;
+	const __m128i vZero  = _mm_setzero_si128();
+	const __m128i vRound = _mm_set1_epi16(MSAA_SAMPLES / 2);
+
+	for (int i = 0; i < max_h; ++i)
+	{
+		uint32_t *src = color_buf + i * MAX_MACRO_TILE_SIZE;
+
+		// Sum up the 8 bit channels in 16 bit
+		for (int j = 0; j < max_w; j += 4)
+		{
+			__m128i vSumLo = vRound;
+			__m128i vSumHi = vRound;
+
+			for (int s = 0; s < MSAA_SAMPLES; ++s)
+			{
+				__m128i vColor = _mm_load_si128((const __m128i *)(src + s * plane_size + j));
+				vSumLo = _mm_add_epi16(vSumLo, _mm_unpacklo_epi8(vColor, vZero));
+				vSumHi = _mm_add_epi16(vSumHi, _mm_unpackhi_epi8(vColor, vZero));
+			}
+
+			vSumLo = _mm_srli_epi16(vSumLo, MSAA_SAMPLES_SHIFT);
+			vSumHi = _mm_srli_epi16(vSumHi, MSAA_SAMPLES_SHIFT);
+			_mm_store_si128((__m128i *)(src + j), _mm_packus_epi16(vSumLo, vSumHi));
+		}
+	}
+}
+
+static void StoreTileColor(const uint32_t *color_buf, int x, int y, int max_w, int max_h)
+{
+	ForEachTileRow((uint32_t *)g_GC->mRT.pColorBuffer, x, y, max_w, max_h,
+		[&](int i, int j0, uint32_t *dst, int len)
+		{
+			const uint32_t *src = color_buf + i * MAX_MACRO_TILE_SIZE + j0;
+			int j = 0;
+
+			// The linear rows are only 16 bytes aligned if the width is a multiple of 4.
+			for (; j < len && ((uintptr_t)(dst + j) & 15); ++j)
+				dst[j] = src[j];
+
+			for (; j + 4 <= len; j += 4)
+				_mm_stream_si128((__m128i *)(dst + j), _mm_loadu_si128((const __m128i *)(src + j)));
+
+			for (; j < len; ++j)
+				dst[j] = src[j];
+		});
+
+	_mm_sfence();
+}
+
+/* The on-tile stencil has a plane per sample like the z buffer, it's only
+ * loaded and stored in the render passes which use it. The render target is
+ * single sampled, the first sample is kept on store.
+ */
+static inline void ClearStencilRow(uint8_t *dst, int len, uint8_t stencil, uint8_t mask)
+{
+	if (mask == 0xFF)
+	{
+		std::memset(dst, stencil, len);
+	}
+	else
+	{
+		for (int j = 0; j < len; ++j)
+			dst[j] = (dst[j] & ~mask) | (stencil & mask);
+	}
+}
+
+static void ClearTileStencil(uint8_t *stencil_buf, int samples, int max_w, int max_h, uint8_t stencil, uint8_t mask)
+{
+	for (int s = 0; s < samples; ++s)
+	{
+		for (int i = 0; i < max_h; ++i)
+			ClearStencilRow(stencil_buf + (s * MAX_MACRO_TILE_SIZE + i) * MAX_MACRO_TILE_SIZE, max_w, stencil, mask);
+	}
+}
+
+// Clear the stencil of the render target directly, for the tiles with nothing drawn.
+static void ClearStencilTile(int x, int y, int max_w, int max_h, uint8_t stencil, uint8_t mask)
+{
+	ForEachTileRow((uint8_t *)g_GC->mRT.pStencilBuffer, x, y, max_w, max_h,
+		[&](int, int, uint8_t *dst, int len)
+		{
+			ClearStencilRow(dst, len, stencil, mask);
+		});
+}
+
+static void LoadTileStencil(uint8_t *stencil_buf, int samples, int x, int y, int max_w, int max_h)
+{
+	ForEachTileRow((const uint8_t *)g_GC->mRT.pStencilBuffer, x, y, max_w, max_h,
+		[&](int i, int j, const uint8_t *src, int len)
+		{
+			for (int s = 0; s < samples; ++s)
+				std::memcpy(stencil_buf + (s * MAX_MACRO_TILE_SIZE + i) * MAX_MACRO_TILE_SIZE + j, src, len);
+		});
+}
+
+static void StoreTileStencil(const uint8_t *stencil_buf, int x, int y, int max_w, int max_h)
+{
+	ForEachTileRow((uint8_t *)g_GC->mRT.pStencilBuffer, x, y, max_w, max_h,
+		[&](int i, int j, uint8_t *dst, int len)
+		{
+			std::memcpy(dst, stencil_buf + i * MAX_MACRO_TILE_SIZE + j, len);
+		});
+}
+
+/* The depth of the render target is loaded to every sample, and the nearest
+ * depth of the samples is stored back since the render target is single sampled.
+ */
+static void ClearDepthTile(int x, int y, int max_w, int max_h, float depth)
+{
+	const __m128 vDepth = _mm_set_ps1(depth);
+
+	ForEachTileRow(g_GC->mRT.pDepthBuffer, x, y, max_w, max_h,
+		[&](int, int, float *dst, int len)
+		{
+			for (int j = 0; j < len; j += 4)
+				_mm_stream_ps(dst + j, vDepth);
+		});
+}
+
+template <typename Sample>
+static void LoadTileDepth(const Sample samples[], int samples_num, int x, int y, int max_w, int max_h)
+{
+	ForEachTileRow(g_GC->mRT.pDepthBuffer, x, y, max_w, max_h,
+		[&](int i, int j0, float *src, int len)
+		{
+			for (int j = 0; j < len; j += 4)
+			{
+				__m128 vDepth = _mm_castsi128_ps(_mm_stream_load_si128((__m128i *)(src + j)));
+
+				for (int s = 0; s < samples_num; ++s)
+					_mm_store_ps(&(*samples[s].mZBuffer)[i][j0 + j], vDepth);
+			}
+		});
+}
+
+template <typename Sample>
+static void StoreTileDepth(const Sample samples[], int samples_num, int x, int y, int max_w, int max_h)
+{
+	ForEachTileRow(g_GC->mRT.pDepthBuffer, x, y, max_w, max_h,
+		[&](int i, int j0, float *dst, int len)
+		{
+			for (int j = 0; j < len; j += 4)
+			{
+				__m128 vDepth = _mm_load_ps(&(*samples[0].mZBuffer)[i][j0 + j]);
+
+				for (int s = 1; s < samples_num; ++s)
+					vDepth = _mm_min_ps(vDepth, _mm_load_ps(&(*samples[s].mZBuffer)[i][j0 + j]));
+
+				_mm_stream_ps(dst + j, vDepth);
+			}
+		});
+}
+
+/* k-way merge of whole batch runs, k is small(the number of threads).
+ * A batch is binned by one thread only, so the runs never interleave
+ * inside a batch.
+ */
+void TBDR::MergeBatchRuns(vector<BinRun> &runs, DisplayList &merged_list)
+{
+	while (!runs.empty())
+	{
+		// The list with the earliest batch.
+		size_t k = 0;
+		for (size_t i = 1; i < runs.size(); ++i)
+		{
+			if (runs[i].mCur->batch_id < runs[k].mCur->batch_id)
+				k = i;
+		}
+
+		BinRun &run = runs[k];
+		const unsigned int batch_id = run.mCur->batch_id;
+		const TriangleBinningPoint *run_end = run.mCur;
+
+		while (run_end != run.mEnd && run_end->batch_id == batch_id)
+			++run_end;
+
+		merged_list.insert(merged_list.end(), run.mCur, run_end);
+		run.mCur = run_end;
+
+		if (run.mCur == run.mEnd)
+		{
+			run = runs.back();
+			runs.pop_back();
+		}
+	}
+}
+
+static size_t GetDisplayListSize(const BinArena &arena, const BinTile &bin_tile)
+{
+	size_t size = 0;
+
+	for (uint32_t c = bin_tile.mHead; c != BIN_CHUNK_NONE; c = arena.GetChunk(c).mNext)
+		size += arena.GetChunk(c).mCount;
+
+	return size;
+}
+
+// Walks the entries of a display list in a BinArena.
+class BinCursor
+{
+public:
+	BinCursor(const BinArena &arena, const BinTile &bin_tile):
+		mArena(arena), mChunk(bin_tile.mHead), mIndex(0)
+	{
+		SkipEmptyChunks();
+	}
+
+	bool valid() const { return mChunk != BIN_CHUNK_NONE; }
+
+	uint32_t entry() const { return mArena.GetChunk(mChunk).mEntries[mIndex]; }
+
+	void next()
+	{
+		mIndex++;
+		SkipEmptyChunks();
+	}
+
+private:
+	void SkipEmptyChunks()
+	{
+		while (mChunk != BIN_CHUNK_NONE && mIndex == mArena.GetChunk(mChunk).mCount)
+		{
+			mChunk = mArena.GetChunk(mChunk).mNext;
+			mIndex = 0;
+		}
+	}
+
+	const BinArena &mArena;
+	uint32_t        mChunk;
+	uint32_t        mIndex;
+};
+
+/* Unpack the display list of tile (x, y) binned by one thread, merged with the
+ * large triangles of its super tile which touch the tile. Both lists are in the
+ * binning order of the thread, i.e. the order of the triangle index.
+ * Return the end of the output.
+ */
+static TriangleBinningPoint *DecodeDisplayList(const BinArena &arena, const BinTile &bin_tile, const BinTile &super_tile,
+											   int x, int y, TriangleBinningPoint *out)
+{
+	const int tile_size = s_TileSize;
+
+	BinCursor tile_cursor (arena, bin_tile);
+	BinCursor super_cursor(arena, super_tile);
+
+	while (tile_cursor.valid() || super_cursor.valid())
+	{
+		if (!super_cursor.valid() || (tile_cursor.valid() && tile_cursor.entry() < super_cursor.entry()))
+		{
+			const uint32_t entry = tile_cursor.entry();
+			tile_cursor.next();
+
+			out->tri        = arena.GetTriangle(entry);
+			out->batch_id   = out->tri->mBatchID;
+			out->full_cover = (entry & BIN_ENTRY_FULL_COVER) != 0;
+			++out;
+		}
+		else
+		{
+			Triangle *tri = arena.GetTriangle(super_cursor.entry());
+			super_cursor.next();
+
+			const TriangleSetup8 &setup = *tri->mSetup;
+			const int lane = tri->mSetupLane;
+			bool inside;
+
+			// The tile tests left over by CoarseRasterizing().
+			if (x + tile_size - 1 < setup.mXMin[lane] || x > setup.mXMax[lane] ||
+				y + tile_size - 1 < setup.mYMin[lane] || y > setup.mYMax[lane] ||
+				!TestTriangleTile(tri, x, y, tile_size, inside))
+				continue;
+
+			out->tri        = tri;
+			out->batch_id   = tri->mBatchID;
+			out->full_cover = inside;
+			++out;
+		}
+	}
+
+	return out;
+}
+
+/* Unpack the display lists of the tile to the per thread scratch list.
+ * Return nullptr if nothing is binned to the tile.
+ */
+const DisplayList *TBDR::GetTileDisplayList(int x, int y)
+{
+	const int tile = y * s_TilesInWidth + x;
+	const int super_shift = BIN_SUPER_TILE_SIZE_SHIFT - s_TileSizeShift;
+	const int super_tile  = (y >> super_shift) * s_SuperTilesInWidth + (x >> super_shift);
+
+	DisplayList    &merged_list = mMergedList[ThreadPool::getThreadID()];
+	DisplayList    &decode_list = mDecodeList[ThreadPool::getThreadID()];
+	vector<BinRun> &runs        = mMergeRuns [ThreadPool::getThreadID()];
+
+	size_t size = 0;
+	int    disp_list_num = 0;
+
+	for (int i = 0; i < s_DispListNum; ++i)
+	{
+		const BinTile &bin_tile  = s_DispList     [i][tile];
+		const BinTile &bin_super = s_SuperTileList[i][super_tile];
+
+		if (bin_tile.mHead != BIN_CHUNK_NONE || bin_super.mHead != BIN_CHUNK_NONE)
+		{
+			// The large triangles not touching the tile are dropped on decoding.
+			size += GetDisplayListSize(s_BinArena[i], bin_tile);
+			size += GetDisplayListSize(s_BinArena[i], bin_super);
+			disp_list_num++;
+		}
+	}
+
+	if (disp_list_num == 0)
+		return nullptr;
+
+	// A batch is binned by one thread only, and the work queue is FIFO,
+	// so each per-thread list is already in submission order, with all of
+	// the triangles of a batch in one run.
+	// Only need merge them when more than one thread touched this tile.
+	DisplayList &out_list = (disp_list_num > 1) ? decode_list : merged_list;
+	out_list.resize(size);
+
+	TriangleBinningPoint *out = out_list.data();
+	runs.clear();
+
+	const int px = x << s_TileSizeShift;
+	const int py = y << s_TileSizeShift;
+
+	for (int i = 0; i < s_DispListNum; ++i)
+	{
+		const BinTile &bin_tile  = s_DispList     [i][tile];
+		const BinTile &bin_super = s_SuperTileList[i][super_tile];
+
+		if (bin_tile.mHead != BIN_CHUNK_NONE || bin_super.mHead != BIN_CHUNK_NONE)
+		{
+			TriangleBinningPoint *begin = out;
+			out = DecodeDisplayList(s_BinArena[i], bin_tile, bin_super, px, py, out);
+
+			if (out != begin)
+				runs.push_back({begin, out});
+		}
+	}
+
+	if (runs.empty())
+		return nullptr;
+
+	if (disp_list_num > 1)
+	{
+		merged_list.clear();
+		MergeBatchRuns(runs, merged_list);
+	}
+	else
+	{
+		merged_list.resize(out - merged_list.data());
+	}
+
+	return &merged_list;
+}
+
+enum TileClearCoverage
+{
+	TILE_CLEAR_NONE = 0,
+	TILE_CLEAR_PARTIAL,
+	TILE_CLEAR_FULL
+};
+
+// How much of the tile is covered by the rectangle of the pending clears.
+int TBDR::GetTileClearCoverage(int x, int y, int max_w, int max_h) const
+{
+	if (mClearXMin > x + max_w - 1 || mClearXMax < x ||
+		mClearYMin > y + max_h - 1 || mClearYMax < y)
+		return TILE_CLEAR_NONE;
+
+	if (mClearXMin <= x && x + max_w - 1 <= mClearXMax &&
+		mClearYMin <= y && y + max_h - 1 <= mClearYMax)
+		return TILE_CLEAR_FULL;
+
+	return TILE_CLEAR_PARTIAL;
+}
+
+// Raster state bits of a triangle, the full cover bit is per tile, see TBDR::RasterizeTriangle().
+static inline int GetRasterStateBits(const RasterStates *raster_states)
+{
+	return (raster_states->mIsDepthTestEnable ? TBDR::RASTER_STATE_DEPTH_TEST : 0) |
+		   (raster_states->mIsBlendEnable     ? TBDR::RASTER_STATE_BLEND      : 0) |
+		   (raster_states->mIsDepthOnly       ? TBDR::RASTER_STATE_DEPTH_ONLY : 0);
+}
+
+void TBDR::FineRasterizing(int x, int y, const DisplayList *disp_list)
+{
+	const int samples_num = s_Samples;
+
+	// The single sample pass runs on the plain per thread buffers.
+	TileSample samples[MSAA_SAMPLES];
+
+	if (samples_num == 1)
+	{
+		samples[0].mPixelPrimMap = &mPixelPrimMap[ThreadPool::getThreadID()];
+		samples[0].mZBuffer      = &mZBuffer     [ThreadPool::getThreadID()];
+		samples[0].mStencilBuffer = &mStencilBuffer[ThreadPool::getThreadID()];
+		samples[0].mHiZBuffer    = &mHiZBuffer   [ThreadPool::getThreadID()];
+		samples[0].mIndex        = 0;
+		samples[0].mOffsetX      = 0;
+		samples[0].mOffsetY      = 0;
+	}
+	else
+	{
+		MultisampleTile &ms_tile = mMultisampleTile[ThreadPool::getThreadID()];
+
+		for (int s = 0; s < samples_num; ++s)
+		{
+			samples[s].mPixelPrimMap = &ms_tile.mPixelPrimMap[s];
+			samples[s].mZBuffer      = &ms_tile.mZBuffer[s];
+			samples[s].mStencilBuffer = &ms_tile.mStencilBuffer[s];
+			samples[s].mHiZBuffer    = &ms_tile.mHiZBuffer[s];
+			samples[s].mIndex        = s;
+			samples[s].mOffsetX      = s_SamplePositions[s][0];
+			samples[s].mOffsetY      = s_SamplePositions[s][1];
+		}
+	}
+
+	const int tile_size = s_TileSize;
+
+	x = (x << s_TileSizeShift);
+	y = (y << s_TileSizeShift);
+
+	const bool has_prims = (disp_list != nullptr);
+
+	const int max_w = (std::min)(tile_size, g_GC->mRT.width  - x);
+	const int max_h = (std::min)(tile_size, g_GC->mRT.height - y);
+
+	// The clears are limited to the scissor box, the edge tiles of the box are
+	// cleared on tile pixel by pixel. (cx0, cy0, cx1, cy1) is relative to the tile.
+	const int clear_coverage = GetTileClearCoverage(x, y, max_w, max_h);
+	const bool full_clear    = (clear_coverage == TILE_CLEAR_FULL);
+	const bool partial_clear = (clear_coverage == TILE_CLEAR_PARTIAL);
+	const int cx0 = mClearXMin - x;
+	const int cy0 = mClearYMin - y;
+	const int cx1 = mClearXMax - x;
+	const int cy1 = mClearYMax - y;
+
+	// Planes of the samples are contiguous.
+	uint8_t *stencil_buf = &(*samples[0].mStencilBuffer)[0][0];
+	const bool stencil_tile = g_GC->mRT.pStencilBuffer && (mStencilTestFlag || mStencilClearFlag);
+
+	if (!has_prims)
+	{
+		// enter this only when clear flag set.
+		if (clear_coverage == TILE_CLEAR_NONE)
+			return;
+
+		if (full_clear)
+		{
+			if (mColorClearFlag)
+				ClearColorTile(x, y, max_w, max_h, mClearColor);
+
+			if (mDepthClearFlag && !mFlushTriggerBySwapBuffer)
+				ClearDepthTile(x, y, max_w, max_h, static_cast<float>(g_GC->mState.mClearState.depth));
+
+			if (mStencilClearFlag && !mFlushTriggerBySwapBuffer && g_GC->mRT.pStencilBuffer)
+				ClearStencilTile(x, y, max_w, max_h, mClearStencil, mStencilClearMask);
+
+			return;
+		}
+
+		// The partially cleared tile is loaded, cleared and stored like the
+		// tiles with something drawn.
+		disp_list = &s_EmptyDisplayList;
+	}
+
+	if (mDepthClearFlag && full_clear)
+	{
+		__m128 vDepth = _mm_set_ps1(static_cast<float>(g_GC->mState.mClearState.depth));
+
+		for (int s = 0; s < samples_num; ++s)
+		{
+			ZBuffer   &z_buf = *samples[s].mZBuffer;
+			HiZBuffer &hiz   = *samples[s].mHiZBuffer;
+
+			for (int i = 0; i < tile_size; ++i)
+			{
+				float *addr = &z_buf[i][0];
+
+				// Assume 64 bytes cache line size
+				for (int j = 0; j < tile_size; j += 16, addr += 16)
+				{
+					_mm_store_ps(addr     , vDepth);
+					_mm_store_ps(addr + 4 , vDepth);
+					_mm_store_ps(addr + 8 , vDepth);
+					_mm_store_ps(addr + 12, vDepth);
+				}
+			}
+
+			std::fill_n(&hiz.mMicroZMin[0][0], MAX_MICRO_TILES_IN_MACRO_TILE * MAX_MICRO_TILES_IN_MACRO_TILE, _mm_cvtss_f32(vDepth));
+			std::fill_n(&hiz.mMicroZMax[0][0], MAX_MICRO_TILES_IN_MACRO_TILE * MAX_MICRO_TILES_IN_MACRO_TILE, _mm_cvtss_f32(vDepth));
+		}
+	}
+	else
+	{
+		// load on tile depth buffer from render target, to every sample.
+		LoadTileDepth(samples, samples_num, x, y, max_w, max_h);
+
+		if (mDepthClearFlag && partial_clear)
+		{
+			const float depth = static_cast<float>(g_GC->mState.mClearState.depth);
+
+			ForEachPixelInRect(cx0, cy0, cx1, cy1, max_w, max_h, [&](int i, int j)
+			{
+				for (int s = 0; s < samples_num; ++s)
+					(*samples[s].mZBuffer)[i][j] = depth;
+			});
+		}
+
+		for (int s = 0; s < samples_num; ++s)
+			BuildHiZ(*samples[s].mHiZBuffer, &(*samples[s].mZBuffer)[0][0], tile_size);
+	}
+
+	if (stencil_tile)
+	{
+		const bool stencil_clear = mStencilClearFlag && clear_coverage != TILE_CLEAR_NONE;
+
+		if (!stencil_clear || partial_clear || mStencilClearMask != 0xFF)
+			LoadTileStencil(stencil_buf, samples_num, x, y, max_w, max_h);
+
+		if (stencil_clear && full_clear)
+		{
+			ClearTileStencil(stencil_buf, samples_num, max_w, max_h, mClearStencil, mStencilClearMask);
+		}
+		else if (stencil_clear)
+		{
+			const uint8_t stencil = mClearStencil;
+			const uint8_t mask    = mStencilClearMask;
+
+			ForEachPixelInRect(cx0, cy0, cx1, cy1, max_w, max_h, [&](int i, int j)
+			{
+				for (int s = 0; s < samples_num; ++s)
+				{
+					uint8_t &dst = stencil_buf[(s * MAX_MACRO_TILE_SIZE + i) * MAX_MACRO_TILE_SIZE + j];
+					dst = (dst & ~mask) | (stencil & mask);
+				}
 			});
+		}
+	}
+
+	float tile_zmin = FLT_MAX;
+
+	for (int s = 0; s < samples_num; ++s)
+	{
+		UpdateHiZ(*samples[s].mHiZBuffer, max_w, max_h);
+		tile_zmin = (std::min)(tile_zmin, samples[s].mHiZBuffer->mZMin);
+	}
+
+	// Skip the entries hidden by a later opaque triangle covering the whole tile.
+	const size_t first = FindFirstVisibleEntry(*disp_list, x, y, max_w, max_h, tile_zmin);
+
+	uint32_t *color_buf = (samples_num == 1) ?
+						  &mColorBuffer[ThreadPool::getThreadID()][0][0] :
+						  &mMultisampleTile[ThreadPool::getThreadID()].mColorBuffer[0][0][0];
+
+	if (!mDepthOnlyPass)
+	{
+		// No need to load the tile if it is cleared, or if the first visible
+		// entry is an occluder which overwrites every pixel anyway.
+		if (mColorClearFlag && full_clear)
+		{
+			FillTileColor(color_buf, samples_num, max_w, max_h, mClearColor);
+		}
+		else if (first == 0)
+		{
+			LoadTileColor(color_buf, samples_num, x, y, max_w, max_h);
+
+			if (mColorClearFlag && partial_clear)
+			{
+				const uint32_t color = mClearColor;
+				const int plane_size = MAX_MACRO_TILE_SIZE * MAX_MACRO_TILE_SIZE;
+
+				ForEachPixelInRect(cx0, cy0, cx1, cy1, max_w, max_h, [&](int i, int j)
+				{
+					for (int s = 0; s < samples_num; ++s)
+						color_buf[s * plane_size + i * MAX_MACRO_TILE_SIZE + j] = color;
+				});
+			}
+		}
+	}
+
+	FsiosimdGroup &queue = mShadingQueue[ThreadPool::getThreadID()];
+
+	queue.mColorBuffer = color_buf;
+	queue.mColorPitch  = MAX_MACRO_TILE_SIZE;
+	queue.mColorX      = x;
+	queue.mColorY      = y;
+	queue.mSamples     = samples_num;
+	queue.mSamplePitch = MAX_MACRO_TILE_SIZE * MAX_MACRO_TILE_SIZE;
 
 	bool prim_tile_valid = false;
 
-	for (TriangleBinningPoint &tbp: disp_list)
+	// The raster states change once per run of the triangles of a draw.
+	const RasterStates *last_raster_states = nullptr;
+	int state = 0;
+
+	for (size_t n = first; n < disp_list->size(); ++n)
 	{
+		const TriangleBinningPoint &tbp = (*disp_list)[n];
 		Triangle *tri = tbp.tri;
 		const RasterStates *raster_states = tri->mRasterStates;
 
+		if (raster_states != last_raster_states)
+		{
+			state = GetRasterStateBits(raster_states);
+			last_raster_states = raster_states;
+		}
+
 		if (!prim_tile_valid && !raster_states->mIsDepthOnly && !raster_states->mIsBlendEnable)
 		{
 			// Switch from PT(punch through) mode to HSR(hidden surface removal) mode,
 			// need initialize current primtive tile here.
-			std::memset(&pp_map[0][0], 0, sizeof(PixelPrimMap));
+			for (int s = 0; s < samples_num; ++s)
+			{
+				PixelPrimMap &pp_map = *samples[s].mPixelPrimMap;
+
+				for (int i = 0; i < tile_size; ++i)
+				{
+					std::memset(&pp_map[i][0], 0, sizeof(Triangle *) * tile_size);
+				}
+			}
 
 			prim_tile_valid = true;
 		}
@@ -1043,380 +2245,801 @@ void TBDR::FineRasterizing(int x, int y)
 		{
 			// Switch from HSR(hidden surface removal) mode to PT(punch through) mode,
 			// need flush current primtive tile here.
-			for (int i = 0; i < max_h; i += 2)
-			{
-				for (int j = 0; j < max_w; j += 2)
-				{
-					RenderQuadPixels(pp_map, x, y, j, i);
-				}
-			}
+			RenderPixelPrimMaps(x, y, max_w, max_h);
 
 			prim_tile_valid = false;
 		}
 
-		if (tbp.full_cover)
+		for (int s = 0; s < samples_num; ++s)
+			RasterizeTriangle(tbp, state, x, y, max_w, max_h, samples[s]);
+
+		// The blended triangle is shaded once per pixel, after all of the samples are covered.
+		if (samples_num > 1 && raster_states->mIsBlendEnable)
+			RenderSampleCoverage(tri, x, y, max_w, max_h);
+	}
+
+	if (!mFlushTriggerBySwapBuffer)
+	{
+		// store on tile depth buffer to render target.
+		StoreTileDepth(samples, samples_num, x, y, max_w, max_h);
+
+		if (stencil_tile)
+			StoreTileStencil(stencil_buf, x, y, max_w, max_h);
+	}
+
+	// TODO: early z
+	// TODO: hierarcical stencil
+	if (prim_tile_valid)
+	{
+		RenderPixelPrimMaps(x, y, max_w, max_h);
+	}
+
+	FlushShadingQueue(queue);
+
+	// store on tile color buffer to render target.
+	if (!mDepthOnlyPass)
+	{
+		if (samples_num > 1)
+			ResolveTileColor(color_buf, max_w, max_h);
+
+		StoreTileColor(color_buf, x, y, max_w, max_h);
+	}
+}
+
+/* Rasterize one sample of the triangle in the tile, i.e. the pixel centre in
+ * a single sample pass. The edges and the depth plane are moved to the sample,
+ * the samples of a pixel are tested against their own z buffer and HiZ.
+ * state is the GetRasterStateBits() of the triangle.
+ */
+void TBDR::RasterizeTriangle(const TriangleBinningPoint &tbp, int state, int x, int y, int max_w, int max_h, const TileSample &sample)
+{
+	Triangle *tri = tbp.tri;
+	const RasterStates *raster_states = tri->mRasterStates;
+
+	if (raster_states->mIsStencilTestEnable ||
+		(raster_states->mIsScissorTestEnable && !IsTileInScissor(raster_states, x, y, max_w, max_h)))
+	{
+		RasterizeMaskedTriangle(tri, x, y, max_w, max_h, sample);
+		return;
+	}
+
+	if (IsMicroTriangle(*tri->mSetup, tri->mSetupLane))
+	{
+		RasterizeMicroTriangle(tri, x, y, max_w, max_h, sample);
+		return;
+	}
+
+	if (tbp.full_cover)
+		state |= RASTER_STATE_FULL_COVER;
+
+	(this->*s_RasterizeTriangleVariants[state])(tri, x, y, max_w, max_h, sample);
+}
+
+/* OPT: the variants are specialized on the raster states at compile time,
+ * so the branches on them are gone from the micro tile loops.
+ */
+#define RASTERIZE_TRIANGLE_VARIANTS_4(n) \
+	&TBDR::RasterizeTriangleVariant<(n)    >, &TBDR::RasterizeTriangleVariant<(n) + 1>, \
+	&TBDR::RasterizeTriangleVariant<(n) + 2>, &TBDR::RasterizeTriangleVariant<(n) + 3>
+
+const TBDR::RasterizeTriangleFunc TBDR::s_RasterizeTriangleVariants[RASTER_STATE_VARIANTS] =
+{
+	RASTERIZE_TRIANGLE_VARIANTS_4(0), RASTERIZE_TRIANGLE_VARIANTS_4(4),
+	RASTERIZE_TRIANGLE_VARIANTS_4(8), RASTERIZE_TRIANGLE_VARIANTS_4(12)
+};
+
+#undef RASTERIZE_TRIANGLE_VARIANTS_4
+
+template <int State>
+void TBDR::RasterizeTriangleVariant(Triangle *tri, int x, int y, int max_w, int max_h, const TileSample &sample)
+{
+	const bool depth_test = (State & RASTER_STATE_DEPTH_TEST) != 0;
+	const bool blend      = (State & RASTER_STATE_BLEND) != 0;
+	const bool full_cover = (State & RASTER_STATE_FULL_COVER) != 0;
+
+	const TriangleSetup8 &setup = *tri->mSetup;
+	const int lane = tri->mSetupLane;
+	const int tri_xmin = setup.mXMin[lane];
+	const int tri_xmax = setup.mXMax[lane];
+	const int tri_ymin = setup.mYMin[lane];
+	const int tri_ymax = setup.mYMax[lane];
+	const float z_gradient_x = setup.mZGradientX[lane];
+	const float z_gradient_y = setup.mZGradientY[lane];
+	const int tile_size = s_TileSize;
+
+	PixelPrimMap &pp_map = *sample.mPixelPrimMap;
+	ZBuffer      &z_buf  = *sample.mZBuffer;
+	HiZBuffer    &hiz    = *sample.mHiZBuffer;
+
+	// Whole micro tiles pass the depth test if tile_accept is set.
+	bool tile_accept = false;
+
+	if (depth_test)
+	{
+		float tri_zmin, tri_zmax;
+
+		GetDepthBounds(tri,
+					   (std::max)(x, tri_xmin), (std::max)(y, tri_ymin),
+					   (std::min)(x + max_w - 1, tri_xmax), (std::min)(y + max_h - 1, tri_ymax),
+					   tri_zmin, tri_zmax);
+
+		// The triangle is totally behind this macro tile.
+		if (tri_zmin >= hiz.mZMax)
+			return;
+
+		tile_accept = (tri_zmax < hiz.mZMin);
+	}
+
+	if (full_cover)
+	{
+		if (depth_test)
 		{
-			if (raster_states->mIsDepthTestEnable)
-			{
-				__m128 vNewZ   = _mm_set_ps1(tri->mZAtOrigin);
+			__m128 vNewZ   = _mm_set_ps1(GetSampleZAtOrigin(setup, lane, sample.mOffsetX, sample.mOffsetY));
 
-				vNewZ = MAWrapper(_mm_cvtepi32_ps(_mm_set_epi32(x + 3, x + 2, x + 1, x)), _mm_set_ps1(tri->mZGradientX), vNewZ);
-				vNewZ = MAWrapper(_mm_cvtepi32_ps(_mm_set_epi32(y, y, y, y)), _mm_set_ps1(tri->mZGradientY), vNewZ);
+			vNewZ = MAWrapper(_mm_cvtepi32_ps(_mm_set_epi32(x + 3, x + 2, x + 1, x)), _mm_set_ps1(z_gradient_x), vNewZ);
+			vNewZ = MAWrapper(_mm_cvtepi32_ps(_mm_set_epi32(y, y, y, y)), _mm_set_ps1(z_gradient_y), vNewZ);
 
-				__m128 vZStepQuadx = _mm_set_ps1(tri->mZGradientX * 4);
-				__m128 vZStepQuady = _mm_set_ps1(tri->mZGradientY);
-				__m128 vZStepMTx = _mm_set_ps1(tri->mZGradientX * MICRO_TILE_SIZE);
-				__m128 vZStepMTy = _mm_set_ps1(tri->mZGradientY * MICRO_TILE_SIZE);
+			__m128 vZStepQuadx = _mm_set_ps1(z_gradient_x * 4);
+			__m128 vZStepQuady = _mm_set_ps1(z_gradient_y);
+			__m128 vZStepMTx = _mm_set_ps1(z_gradient_x * MICRO_TILE_SIZE);
+			__m128 vZStepMTy = _mm_set_ps1(z_gradient_y * MICRO_TILE_SIZE);
 
-				for (int i = 0; i < max_h; i += MICRO_TILE_SIZE)
+			for (int i = 0; i < max_h; i += MICRO_TILE_SIZE)
+			{
+				__m128 vNewZx = vNewZ;
+
+				for (int j = 0; j < max_w; j += MICRO_TILE_SIZE, vNewZx = _mm_add_ps(vNewZx, vZStepMTx))
 				{
-					__m128 vNewZx = vNewZ;
+					uint64_t coverage_mask;
 
-					for (int j = 0; j < max_w; j += MICRO_TILE_SIZE)
-					{
-						uint64_t coverage_mask = 0;
+					float &micro_zmin = hiz.mMicroZMin[i >> MICRO_TILE_SIZE_SHIFT][j >> MICRO_TILE_SIZE_SHIFT];
+					float &micro_zmax = hiz.mMicroZMax[i >> MICRO_TILE_SIZE_SHIFT][j >> MICRO_TILE_SIZE_SHIFT];
 
-						float *zbuf_pos = &z_buf[i][j];
-						__m128 vNewZxx = vNewZx;
+					bool micro_accept = tile_accept;
 
-						for (int k = 0; k < MICRO_TILE_SIZE; ++k)
-						{
-							float *zbuf_posx = zbuf_pos;
-							__m128 vNewZxxx = vNewZxx;
+					if (!micro_accept)
+					{
+						float tri_zmin, tri_zmax;
 
-							for (int l = 0; l < MICRO_TILE_SIZE; l += 4)
-							{
-								__m128 vCurrentZ = _mm_load_ps(zbuf_posx);
-								__m128 vMask = _mm_cmp_ps(vNewZxxx, vCurrentZ, _CMP_LT_OS);
-								_mm_maskstore_ps(zbuf_posx, _mm_castps_si128(vMask), vNewZxxx);
+						GetDepthBounds(tri, x + j, y + i, x + j + MICRO_TILE_SIZE - 1, y + i + MICRO_TILE_SIZE - 1, tri_zmin, tri_zmax);
 
-								uint64_t mask = (uint64_t)_mm_movemask_ps(vMask);
-								coverage_mask |= (mask << ((k << MICRO_TILE_SIZE_SHIFT) + l));
+						// This micro tile is totally occluded
+						if (tri_zmin >= micro_zmax)
+							continue;
 
-								zbuf_posx   += 4;
-								vNewZxxx = _mm_add_ps(vNewZxxx, vZStepQuadx);
-							}
+						micro_accept = (tri_zmax < micro_zmin);
+					}
 
-							zbuf_pos   += MACRO_TILE_SIZE;
-							vNewZxx = _mm_add_ps(vNewZxx, vZStepQuady);
-						}
-						vNewZx  = _mm_add_ps(vNewZx, vZStepMTx);
+					if (micro_accept)
+					{
+						g_Kernels.DepthWriteMicroTile(&z_buf[i][j], vNewZx, vZStepQuadx, vZStepQuady, micro_zmin, micro_zmax);
+						coverage_mask = 0xFFFFFFFFFFFFFFFF;
+					}
+					else
+					{
+						coverage_mask = g_Kernels.DepthTestMicroTile(&z_buf[i][j], vNewZx, vZStepQuadx, vZStepQuady, micro_zmin, micro_zmax);
+					}
 
-						if (coverage_mask && !raster_states->mIsDepthOnly)
-						{
-							if (!raster_states->mIsBlendEnable)
-							{
-								for (int k = 0; k < MICRO_TILE_SIZE; ++k)
-								{
-									for (int l = 0; l < MICRO_TILE_SIZE; ++l)
-									{
-										if (coverage_mask & ((uint64_t)0x1 << ((k << MICRO_TILE_SIZE_SHIFT) + l)))
-										{
-											pp_map[i + k][j + l] = tri;
-										}
-									}
-								}
-							}
-							else
-							{
-								for (int k = 0; (k < MICRO_TILE_SIZE) && ((i + k) < max_h); k += 2)
-								{
-									for (int l = 0; (l < MICRO_TILE_SIZE) && ((j + l) < max_w); l += 2)
-									{
-										int shift = (k << MICRO_TILE_SIZE_SHIFT) + l;
-										int quad_mask = ((int)(coverage_mask >> shift)) & 0x3;
-										shift += MICRO_TILE_SIZE;
-										quad_mask |= ((((int)(coverage_mask >> shift)) & 0x3) << 2);
-
-										RenderQuadPixelsInOneTriangle(tri, quad_mask, x, y, (j + l), (i + k));
-									}
-								}
-							}
-						}
+					EmitMicroTileCoverage<State>(tri, coverage_mask, x, y, i, j, max_w, max_h, sample);
+				}
+				vNewZ = _mm_add_ps(vNewZ, vZStepMTy);
+			}
+		}
+		else
+		{
+			if (blend)
+			{
+				for (int i = 0; i < max_h; i += MICRO_TILE_SIZE)
+				{
+					for (int j = 0; j < max_w; j += MICRO_TILE_SIZE)
+					{
+						EmitMicroTileCoverage<State>(tri, 0xFFFFFFFFFFFFFFFF, x, y, i, j, max_w, max_h, sample);
 					}
-					vNewZ = _mm_add_ps(vNewZ, vZStepMTy);
 				}
 			}
 			else
 			{
-				if (raster_states->mIsBlendEnable)
+				for (int i = 0; i < tile_size; ++i)
+				{
+					std::fill_n(&pp_map[i][0], tile_size, tri);
+				}
+			}
+		}
+	}
+	else
+	{
+		const int minx = ROUND_DOWN((std::max)(0, tri_xmin - x), MICRO_TILE_SIZE);
+		const int miny = ROUND_DOWN((std::max)(0, tri_ymin - y), MICRO_TILE_SIZE);
+		const int maxx = (std::min)(tile_size, tri_xmax - x + 1);
+		const int maxy = (std::min)(tile_size, tri_ymax - y + 1);
+
+		// Edge equations relative to the tile origin
+		int A[3], B[3], C[3];
+
+		if (!SetupTileEdges(tri, x, y, tile_size, A, B, C))
+			return;
+
+		if (sample.mOffsetX | sample.mOffsetY)
+			OffsetTileEdges(A, B, C, sample.mOffsetX, sample.mOffsetY);
+
+		__m128 vNewZ       = _mm_setzero_ps();
+		__m128 vZStepQuadx = _mm_setzero_ps();
+		__m128 vZStepQuady = _mm_setzero_ps();
+		__m128 vZStepMTx   = _mm_setzero_ps();
+		__m128 vZStepMTy   = _mm_setzero_ps();
+		if (depth_test)
+		{
+			vNewZ = _mm_set_ps1(GetSampleZAtOrigin(setup, lane, sample.mOffsetX, sample.mOffsetY));
+
+			vNewZ = MAWrapper(_mm_cvtepi32_ps(_mm_set_epi32(x + minx + 3, x + minx + 2, x + minx + 1, x + minx)), _mm_set_ps1(z_gradient_x), vNewZ);
+			vNewZ = MAWrapper(_mm_cvtepi32_ps(_mm_set_epi32(y + miny, y + miny, y + miny, y + miny)), _mm_set_ps1(z_gradient_y), vNewZ);
+
+			vZStepQuadx = _mm_set_ps1(z_gradient_x * 4);
+			vZStepQuady = _mm_set_ps1(z_gradient_y);
+
+			vZStepMTx = _mm_set_ps1(z_gradient_x * MICRO_TILE_SIZE);
+			vZStepMTy = _mm_set_ps1(z_gradient_y * MICRO_TILE_SIZE);
+		}
+
+		__m128i vMicroTileCornerX = _mm_set_epi32(minx + MICRO_TILE_SIZE - 1, minx, minx + MICRO_TILE_SIZE - 1, minx);
+		__m128i vMicroTileCornerY = _mm_set_epi32(miny + MICRO_TILE_SIZE - 1, miny + MICRO_TILE_SIZE - 1, miny, miny);
+
+		__m128i vFactorA0 = _mm_set1_epi32(A[0]);
+		__m128i vFactorB0 = _mm_set1_epi32(B[0]);
+		__m128i vFactorC0 = _mm_set1_epi32(C[0]);
+		__m128i vArea0 = MAWrapper(vFactorB0, vMicroTileCornerY, MAWrapper(vFactorA0, vMicroTileCornerX, vFactorC0));
+
+		__m128i vFactorA1 = _mm_set1_epi32(A[1]);
+		__m128i vFactorB1 = _mm_set1_epi32(B[1]);
+		__m128i vFactorC1 = _mm_set1_epi32(C[1]);
+		__m128i vArea1 = MAWrapper(vFactorB1, vMicroTileCornerY, MAWrapper(vFactorA1, vMicroTileCornerX, vFactorC1));
+
+		__m128i vFactorA2 = _mm_set1_epi32(A[2]);
+		__m128i vFactorB2 = _mm_set1_epi32(B[2]);
+		__m128i vFactorC2 = _mm_set1_epi32(C[2]);
+		__m128i vArea2 = MAWrapper(vFactorB2, vMicroTileCornerY, MAWrapper(vFactorA2, vMicroTileCornerX, vFactorC2));
+
+		__m128i vAreaStepMTx0 = _mm_slli_epi32(vFactorA0, MICRO_TILE_SIZE_SHIFT);
+		__m128i vAreaStepMTy0 = _mm_slli_epi32(vFactorB0, MICRO_TILE_SIZE_SHIFT);
+
+		__m128i vAreaStepMTx1 = _mm_slli_epi32(vFactorA1, MICRO_TILE_SIZE_SHIFT);
+		__m128i vAreaStepMTy1 = _mm_slli_epi32(vFactorB1, MICRO_TILE_SIZE_SHIFT);
+
+		__m128i vAreaStepMTx2 = _mm_slli_epi32(vFactorA2, MICRO_TILE_SIZE_SHIFT);
+		__m128i vAreaStepMTy2 = _mm_slli_epi32(vFactorB2, MICRO_TILE_SIZE_SHIFT);
+
+		for (int i = miny; i < maxy; i += MICRO_TILE_SIZE)
+		{
+			__m128i vArea0x = vArea0;
+			__m128i vArea1x = vArea1;
+			__m128i vArea2x = vArea2;
+
+			__m128  vNewZx  = vNewZ;
+
+			for (int j = minx; j < maxx; j += MICRO_TILE_SIZE,
+				vArea0x = _mm_add_epi32(vArea0x, vAreaStepMTx0),
+				vArea1x = _mm_add_epi32(vArea1x, vAreaStepMTx1),
+				vArea2x = _mm_add_epi32(vArea2x, vAreaStepMTx2),
+				vNewZx  = _mm_add_ps(vNewZx, vZStepMTx))
+			{
+				__m128i vTest0 = _mm_cmplt_epi32(vArea0x, _mm_setzero_si128());
+				// This micro tile is totally outside the triangle
+				if (_mm_test_all_ones(vTest0))
+					continue;
+
+				__m128i vTest1 = _mm_cmplt_epi32(vArea1x, _mm_setzero_si128());
+				if (_mm_test_all_ones(vTest1))
+					continue;
+
+				__m128i vTest2 = _mm_cmplt_epi32(vArea2x, _mm_setzero_si128());
+				if (_mm_test_all_ones(vTest2))
+					continue;
+
+				uint64_t coverage_mask = 0;
+
+				float *micro_zmin = nullptr;
+				float *micro_zmax = nullptr;
+				bool micro_accept = tile_accept;
+
+				if (depth_test)
+				{
+					micro_zmin = &hiz.mMicroZMin[i >> MICRO_TILE_SIZE_SHIFT][j >> MICRO_TILE_SIZE_SHIFT];
+					micro_zmax = &hiz.mMicroZMax[i >> MICRO_TILE_SIZE_SHIFT][j >> MICRO_TILE_SIZE_SHIFT];
+
+					if (!micro_accept)
+					{
+						float tri_zmin, tri_zmax;
+
+						GetDepthBounds(tri,
+									   (std::max)(x + j, tri_xmin), (std::max)(y + i, tri_ymin),
+									   (std::min)(x + j + MICRO_TILE_SIZE - 1, tri_xmax), (std::min)(y + i + MICRO_TILE_SIZE - 1, tri_ymax),
+									   tri_zmin, tri_zmax);
+
+						// This micro tile is totally occluded
+						if (tri_zmin >= *micro_zmax)
+							continue;
+
+						micro_accept = (tri_zmax < *micro_zmin);
+					}
+				}
+
+				// This micro tile is totally inside the triangle
+				if (_mm_test_all_zeros(vTest0, _mm_set1_epi32(0xFFFFFFFF)) &&
+					_mm_test_all_zeros(vTest1, _mm_set1_epi32(0xFFFFFFFF)) &&
+					_mm_test_all_zeros(vTest2, _mm_set1_epi32(0xFFFFFFFF)))
 				{
-					for (int i = 0; i < max_h; i += 2)
+					if (depth_test)
 					{
-						for (int j = 0; j < max_w; j += 2)
+						if (micro_accept)
 						{
-							RenderQuadPixelsInOneTriangle(tri, 0xF, x, y, j, i);
+							g_Kernels.DepthWriteMicroTile(&z_buf[i][j], vNewZx, vZStepQuadx, vZStepQuady, *micro_zmin, *micro_zmax);
+							coverage_mask = 0xFFFFFFFFFFFFFFFF;
+						}
+						else
+						{
+							coverage_mask = g_Kernels.DepthTestMicroTile(&z_buf[i][j], vNewZx, vZStepQuadx, vZStepQuady, *micro_zmin, *micro_zmax);
 						}
 					}
+					else
+					{
+						coverage_mask = 0xFFFFFFFFFFFFFFFF;
+					}
 				}
 				else
 				{
-					Triangle **p = &pp_map[0][0];
-					for (int i = 0; i < MACRO_TILE_SIZE * MACRO_TILE_SIZE; ++i)
-					{
-						p[i] = tri;
-					}
+					coverage_mask = g_Kernels.RasterizeMicroTile(j, i, A, B, C, &z_buf[i][j], vNewZx, vZStepQuadx, vZStepQuady,
+																 depth_test ? micro_zmin : nullptr);
+				}
+
+				EmitMicroTileCoverage<State>(tri, coverage_mask, x, y, i, j, maxx, maxy, sample);
+			}
+			vArea0 = _mm_add_epi32(vArea0, vAreaStepMTy0);
+			vArea1 = _mm_add_epi32(vArea1, vAreaStepMTy1);
+			vArea2 = _mm_add_epi32(vArea2, vAreaStepMTy2);
+			vNewZ = _mm_add_ps(vNewZ, vZStepMTy);
+		}
+	}
+
+	if (depth_test)
+		UpdateHiZ(hiz, max_w, max_h);
+}
+
+/* Hand over the coverage of micro tile (j, i) of the sample, the pixels beyond
+ * (max_w, max_h) are dropped.
+ * The opaque triangles are resolved in the pixel prim map of the sample.
+ * The blended ones are shaded right away in a single sample pass, or the samples
+ * are collected first in a multisample pass, see RenderSampleCoverage().
+ */
+template <int State>
+inline void TBDR::EmitMicroTileCoverage(Triangle *tri, uint64_t coverage_mask, int x, int y, int i, int j,
+										int max_w, int max_h, const TileSample &sample)
+{
+	if (!coverage_mask || (State & RASTER_STATE_DEPTH_ONLY))
+		return;
+
+	if (!(State & RASTER_STATE_BLEND))
+	{
+		PixelPrimMap &pp_map = *sample.mPixelPrimMap;
+
+		for (int k = 0; k < MICRO_TILE_SIZE; ++k)
+		{
+			for (int l = 0; l < MICRO_TILE_SIZE; ++l)
+			{
+				if (coverage_mask & ((uint64_t)0x1 << ((k << MICRO_TILE_SIZE_SHIFT) + l)))
+				{
+					pp_map[i + k][j + l] = tri;
 				}
 			}
 		}
-		else
+	}
+	else if (s_Samples > 1)
+	{
+		MultisampleTile &ms_tile = mMultisampleTile[ThreadPool::getThreadID()];
+
+		for (uint64_t mask = coverage_mask; mask; mask &= mask - 1)
+		{
+			unsigned long bit;
+			_BitScanForward(&bit, mask);
+
+			const int k = i + (bit >> MICRO_TILE_SIZE_SHIFT);
+			const int l = j + (bit & (MICRO_TILE_SIZE - 1));
+
+			if (k < max_h && l < max_w)
+				ms_tile.mSampleCoverage[k][l] |= (1 << sample.mIndex);
+		}
+	}
+	else
+	{
+		for (int k = 0; (k < MICRO_TILE_SIZE) && ((i + k) < max_h); k += 2)
+		{
+			for (int l = 0; (l < MICRO_TILE_SIZE) && ((j + l) < max_w); l += 2)
+			{
+				int shift = (k << MICRO_TILE_SIZE_SHIFT) + l;
+				int quad_mask = ((int)(coverage_mask >> shift)) & 0x3;
+				shift += MICRO_TILE_SIZE;
+				quad_mask |= ((((int)(coverage_mask >> shift)) & 0x3) << 2);
+
+				if (quad_mask)
+					RenderQuadPixelsInOneTriangle(tri, quad_mask, quad_mask, x, y, (j + l), (i + k));
+			}
+		}
+	}
+}
+
+inline void TBDR::EmitMicroTileCoverage(Triangle *tri, uint64_t coverage_mask, int x, int y, int i, int j,
+										int max_w, int max_h, const TileSample &sample)
+{
+	const RasterStates *raster_states = tri->mRasterStates;
+
+	if (raster_states->mIsDepthOnly)
+		EmitMicroTileCoverage<RASTER_STATE_DEPTH_ONLY>(tri, coverage_mask, x, y, i, j, max_w, max_h, sample);
+	else if (raster_states->mIsBlendEnable)
+		EmitMicroTileCoverage<RASTER_STATE_BLEND>(tri, coverage_mask, x, y, i, j, max_w, max_h, sample);
+	else
+		EmitMicroTileCoverage<0>(tri, coverage_mask, x, y, i, j, max_w, max_h, sample);
+}
+
+/* Fast path of the micro triangles, the coverage is tested on the only micro
+ * tile touched directly, without walking down the macro/micro tile hierarchy.
+ * Only the HiZ of that micro tile is checked, and only its z min can be lowered.
+ */
+void TBDR::RasterizeMicroTriangle(Triangle *tri, int x, int y, int max_w, int max_h, const TileSample &sample)
+{
+	const RasterStates *raster_states = tri->mRasterStates;
+	const TriangleSetup8 &setup = *tri->mSetup;
+	const int lane = tri->mSetupLane;
+	const int tri_xmin = setup.mXMin[lane];
+	const int tri_xmax = setup.mXMax[lane];
+	const int tri_ymin = setup.mYMin[lane];
+	const int tri_ymax = setup.mYMax[lane];
+
+	ZBuffer   &z_buf = *sample.mZBuffer;
+	HiZBuffer &hiz   = *sample.mHiZBuffer;
+
+	// The micro tile relative to the macro tile
+	const int i = ROUND_DOWN(tri_ymin - y, MICRO_TILE_SIZE);
+	const int j = ROUND_DOWN(tri_xmin - x, MICRO_TILE_SIZE);
+
+	int A[3], B[3], C[3];
+
+	if (!SetupTileEdges(tri, x, y, s_TileSize, A, B, C))
+		return;
+
+	if (sample.mOffsetX | sample.mOffsetY)
+		OffsetTileEdges(A, B, C, sample.mOffsetX, sample.mOffsetY);
+
+	float *micro_zmin = nullptr;
+
+	__m128 vNewZ       = _mm_setzero_ps();
+	__m128 vZStepQuadx = _mm_setzero_ps();
+	__m128 vZStepQuady = _mm_setzero_ps();
+
+	if (raster_states->mIsDepthTestEnable)
+	{
+		float tri_zmin, tri_zmax;
+
+		GetDepthBounds(tri, tri_xmin, tri_ymin, tri_xmax, tri_ymax, tri_zmin, tri_zmax);
+
+		// This micro tile is totally occluded
+		if (tri_zmin >= hiz.mMicroZMax[i >> MICRO_TILE_SIZE_SHIFT][j >> MICRO_TILE_SIZE_SHIFT])
+			return;
+
+		micro_zmin = &hiz.mMicroZMin[i >> MICRO_TILE_SIZE_SHIFT][j >> MICRO_TILE_SIZE_SHIFT];
+
+		const float z_gradient_x = setup.mZGradientX[lane];
+		const float z_gradient_y = setup.mZGradientY[lane];
+
+		vNewZ = _mm_set_ps1(GetSampleZAtOrigin(setup, lane, sample.mOffsetX, sample.mOffsetY));
+		vNewZ = MAWrapper(_mm_cvtepi32_ps(_mm_set_epi32(x + j + 3, x + j + 2, x + j + 1, x + j)), _mm_set_ps1(z_gradient_x), vNewZ);
+		vNewZ = MAWrapper(_mm_cvtepi32_ps(_mm_set1_epi32(y + i)), _mm_set_ps1(z_gradient_y), vNewZ);
+
+		vZStepQuadx = _mm_set_ps1(z_gradient_x * 4);
+		vZStepQuady = _mm_set_ps1(z_gradient_y);
+	}
+
+	const uint64_t coverage_mask = g_Kernels.RasterizeMicroTile(j, i, A, B, C, &z_buf[i][j],
+																vNewZ, vZStepQuadx, vZStepQuady, micro_zmin);
+
+	// Same as UpdateHiZ(), nothing else of the HiZ is changed.
+	if (micro_zmin && *micro_zmin < hiz.mZMin)
+		hiz.mZMin = *micro_zmin;
+
+	if (!coverage_mask || raster_states->mIsDepthOnly)
+		return;
+
+	if (!raster_states->mIsBlendEnable)
+	{
+		PixelPrimMap &pp_map = *sample.mPixelPrimMap;
+
+		for (uint64_t mask = coverage_mask; mask; mask &= mask - 1)
+		{
+			unsigned long bit;
+			_BitScanForward(&bit, mask);
+
+			pp_map[i + (bit >> MICRO_TILE_SIZE_SHIFT)][j + (bit & (MICRO_TILE_SIZE - 1))] = tri;
+		}
+	}
+	else if (s_Samples > 1)
+	{
+		EmitMicroTileCoverage(tri, coverage_mask, x, y, i, j, max_w, max_h, sample);
+	}
+	else
+	{
+		// Only the quads inside the bounding box can be covered.
+		for (int k = ROUND_DOWN(tri_ymin - y - i, 2); k <= tri_ymax - y - i; k += 2)
+		{
+			for (int l = ROUND_DOWN(tri_xmin - x - j, 2); l <= tri_xmax - x - j; l += 2)
+			{
+				int shift = (k << MICRO_TILE_SIZE_SHIFT) + l;
+				int quad_mask = ((int)(coverage_mask >> shift)) & 0x3;
+				shift += MICRO_TILE_SIZE;
+				quad_mask |= ((((int)(coverage_mask >> shift)) & 0x3) << 2);
+
+				if (quad_mask)
+					RenderQuadPixelsInOneTriangle(tri, quad_mask, quad_mask, x, y, (j + l), (i + k));
+			}
+		}
+	}
+}
+
+// Stencil states of a triangle, the values are in 16 bit lanes.
+struct StencilTestState
+{
+	__m128i vRef;           // ref & value mask
+	__m128i vReplace;       // ref, the value of GL_REPLACE
+	__m128i vValueMask;
+	__m128i vWriteMask;
+
+	GLenum  func;
+	GLenum  fail;
+	GLenum  depthFail;
+	GLenum  depthPass;
+};
+
+static inline __m128i StencilFunc(GLenum func, __m128i vRef, __m128i vStencil)
+{
+	const __m128i vOnes = _mm_set1_epi16(-1);
+
+	switch (func)
+	{
+		case GL_NEVER:    return _mm_setzero_si128();
+		case GL_LESS:     return _mm_cmpgt_epi16(vStencil, vRef);
+		case GL_LEQUAL:   return _mm_xor_si128(_mm_cmpgt_epi16(vRef, vStencil), vOnes);
+		case GL_GREATER:  return _mm_cmpgt_epi16(vRef, vStencil);
+		case GL_GEQUAL:   return _mm_xor_si128(_mm_cmpgt_epi16(vStencil, vRef), vOnes);
+		case GL_EQUAL:    return _mm_cmpeq_epi16(vRef, vStencil);
+		case GL_NOTEQUAL: return _mm_xor_si128(_mm_cmpeq_epi16(vRef, vStencil), vOnes);
+		default:          return vOnes;
+	}
+}
+
+static inline __m128i StencilOp(GLenum op, __m128i vStencil, __m128i vReplace)
+{
+	const __m128i vOne = _mm_set1_epi16(1);
+	const __m128i vMax = _mm_set1_epi16(0xFF);
+
+	switch (op)
+	{
+		case GL_ZERO:      return _mm_setzero_si128();
+		case GL_REPLACE:   return vReplace;
+		case GL_INCR:      return _mm_min_epi16(_mm_add_epi16(vStencil, vOne), vMax);
+		case GL_INCR_WRAP: return _mm_and_si128(_mm_add_epi16(vStencil, vOne), vMax);
+		case GL_DECR:      return _mm_max_epi16(_mm_sub_epi16(vStencil, vOne), _mm_setzero_si128());
+		case GL_DECR_WRAP: return _mm_and_si128(_mm_sub_epi16(vStencil, vOne), vMax);
+		case GL_INVERT:    return _mm_xor_si128(vStencil, vMax);
+		default:           return vStencil;
+	}
+}
+
+/* Depth and stencil test the given pixels of a micro tile, a row of 8 pixels
+ * at a time, the stencil is widened to 16 bit lanes and the depth is tested in
+ * two quads. The stencil test is done if state is not null, the stencil of the
+ * pixels is updated with the op of the test they fail or pass, through the write
+ * mask. The depth test is done if zmin is not null, which is lowered like
+ * RasterizeMicroTile().
+ * Return the pixels passing all of the tests.
+ */
+static uint64_t TestMicroTilePixels(uint64_t coverage_mask, float *zbuf_pos,
+									__m128 vNewZ, __m128 vZStepQuadx, __m128 vZStepQuady, float *zmin,
+									uint8_t *sbuf_pos, const StencilTestState *state)
+{
+	const __m128i vLaneBits = _mm_set_epi16(0x80, 0x40, 0x20, 0x10, 0x8, 0x4, 0x2, 0x1);
+
+	uint64_t pass_mask = 0;
+	__m128 vZMin = _mm_set_ps1(FLT_MAX);
+
+	for (int k = 0; k < MICRO_TILE_SIZE; ++k,
+		sbuf_pos += MAX_MACRO_TILE_SIZE,
+		zbuf_pos += MAX_MACRO_TILE_SIZE,
+		vNewZ     = _mm_add_ps(vNewZ, vZStepQuady))
+	{
+		const int row_mask = (int)(coverage_mask >> (k << MICRO_TILE_SIZE_SHIFT)) & 0xFF;
+
+		if (!row_mask)
+			continue;
+
+		__m128i vCover       = _mm_cmpeq_epi16(_mm_and_si128(_mm_set1_epi16(row_mask), vLaneBits), vLaneBits);
+		__m128i vStencil     = _mm_setzero_si128();
+		__m128i vStencilPass = vCover;
+
+		if (state)
+		{
+			vStencil     = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)sbuf_pos));
+			vStencilPass = _mm_and_si128(StencilFunc(state->func, state->vRef, _mm_and_si128(vStencil, state->vValueMask)), vCover);
+		}
+
+		__m128i vDepthPass = vStencilPass;
+
+		if (zmin)
 		{
-			const int minx = ROUND_DOWN((std::max)(0, tri->xmin - x), MICRO_TILE_SIZE);
-			const int miny = ROUND_DOWN((std::max)(0, tri->ymin - y), MICRO_TILE_SIZE);
-			const int maxx = (std::min)(MACRO_TILE_SIZE, tri->xmax - x + 1);
-			const int maxy = (std::min)(MACRO_TILE_SIZE, tri->ymax - y + 1);
-
-			__m128 vNewZ;
-			__m128 vZStepQuadx;
-			__m128 vZStepQuady;
-			__m128 vZStepMTx;
-			__m128 vZStepMTy;
-			if (raster_states->mIsDepthTestEnable)
-			{
-				vNewZ = _mm_set_ps1(tri->mZAtOrigin);
+			__m128 vNewZ1     = _mm_add_ps(vNewZ, vZStepQuadx);
+			__m128 vCurrentZ0 = _mm_load_ps(zbuf_pos);
+			__m128 vCurrentZ1 = _mm_load_ps(zbuf_pos + 4);
 
-				vNewZ = MAWrapper(_mm_cvtepi32_ps(_mm_set_epi32(x + minx + 3, x + minx + 2, x + minx + 1, x + minx)), _mm_set_ps1(tri->mZGradientX), vNewZ);
-				vNewZ = MAWrapper(_mm_cvtepi32_ps(_mm_set_epi32(y + miny, y + miny, y + miny, y + miny)), _mm_set_ps1(tri->mZGradientY), vNewZ);
+			vDepthPass = _mm_and_si128(vDepthPass, _mm_packs_epi32(_mm_castps_si128(_mm_cmplt_ps(vNewZ , vCurrentZ0)),
+																   _mm_castps_si128(_mm_cmplt_ps(vNewZ1, vCurrentZ1))));
 
-				vZStepQuadx = _mm_set_ps1(tri->mZGradientX * 4);
-				vZStepQuady = _mm_set_ps1(tri->mZGradientY);
+			__m128 vZ0 = _mm_blendv_ps(vCurrentZ0, vNewZ , _mm_castsi128_ps(_mm_cvtepi16_epi32(vDepthPass)));
+			__m128 vZ1 = _mm_blendv_ps(vCurrentZ1, vNewZ1, _mm_castsi128_ps(_mm_cvtepi16_epi32(_mm_srli_si128(vDepthPass, 8))));
+			_mm_store_ps(zbuf_pos    , vZ0);
+			_mm_store_ps(zbuf_pos + 4, vZ1);
 
-				vZStepMTx = _mm_set_ps1(tri->mZGradientX * MICRO_TILE_SIZE);
-				vZStepMTy = _mm_set_ps1(tri->mZGradientY * MICRO_TILE_SIZE);
-			}
+			vZMin = _mm_min_ps(vZMin, _mm_min_ps(vZ0, vZ1));
+		}
 
-			__m128i vMicroTileCornerX = _mm_set_epi32(x + minx + MICRO_TILE_SIZE - 1, x + minx, x + minx + MICRO_TILE_SIZE - 1, x + minx);
-			__m128i vMicroTileCornerY = _mm_set_epi32(y + miny + MICRO_TILE_SIZE - 1, y + miny + MICRO_TILE_SIZE - 1, y + miny, y + miny);
+		if (state)
+		{
+			__m128i vResult = vStencil;
+			vResult = _mm_blendv_epi8(vResult, StencilOp(state->fail,      vStencil, state->vReplace), _mm_andnot_si128(vStencilPass, vCover));
+			vResult = _mm_blendv_epi8(vResult, StencilOp(state->depthFail, vStencil, state->vReplace), _mm_andnot_si128(vDepthPass, vStencilPass));
+			vResult = _mm_blendv_epi8(vResult, StencilOp(state->depthPass, vStencil, state->vReplace), vDepthPass);
+			vResult = _mm_or_si128(_mm_and_si128(vResult, state->vWriteMask), _mm_andnot_si128(state->vWriteMask, vStencil));
 
-			__m128i vFactorA0 = _mm_set1_epi32(tri->mVert[0].mFactorA);
-			__m128i vFactorB0 = _mm_set1_epi32(tri->mVert[0].mFactorB);
-			__m128i vFactorC0 = _mm_set1_epi32(tri->mVert[0].mFactorC);
-			__m128i vArea0 = MAWrapper(vFactorB0, vMicroTileCornerY, MAWrapper(vFactorA0, vMicroTileCornerX, vFactorC0));
+			_mm_storel_epi64((__m128i *)sbuf_pos, _mm_packus_epi16(vResult, vResult));
+		}
 
-			__m128i vFactorA1 = _mm_set1_epi32(tri->mVert[1].mFactorA);
-			__m128i vFactorB1 = _mm_set1_epi32(tri->mVert[1].mFactorB);
-			__m128i vFactorC1 = _mm_set1_epi32(tri->mVert[1].mFactorC);
-			__m128i vArea1 = MAWrapper(vFactorB1, vMicroTileCornerY, MAWrapper(vFactorA1, vMicroTileCornerX, vFactorC1));
+		const uint64_t row_pass = (uint64_t)(_mm_movemask_epi8(_mm_packs_epi16(vDepthPass, _mm_setzero_si128())) & 0xFF);
+		pass_mask |= (row_pass << (k << MICRO_TILE_SIZE_SHIFT));
+	}
 
-			__m128i vFactorA2 = _mm_set1_epi32(tri->mVert[2].mFactorA);
-			__m128i vFactorB2 = _mm_set1_epi32(tri->mVert[2].mFactorB);
-			__m128i vFactorC2 = _mm_set1_epi32(tri->mVert[2].mFactorC);
-			__m128i vArea2 = MAWrapper(vFactorB2, vMicroTileCornerY, MAWrapper(vFactorA2, vMicroTileCornerX, vFactorC2));
+	if (zmin)
+	{
+		const float micro_zmin = _simd_hmin_ps(vZMin);
+		if (micro_zmin < *zmin)
+			*zmin = micro_zmin;
+	}
 
-			__m128i vAreaStepQuadx0 = _mm_slli_epi32(vFactorA0, 2);
-			__m128i vAreaStepQuady0 = vFactorB0;
+	return pass_mask;
+}
 
-			__m128i vAreaStepQuadx1 = _mm_slli_epi32(vFactorA1, 2);
-			__m128i vAreaStepQuady1 = vFactorB1;
+/* The triangles with the stencil test on, or clipped by the scissor in this
+ * tile, walk all of the micro tiles they touch. The edge coverage is masked by
+ * the scissor first, then the depth and stencil test are done together, see
+ * TestMicroTilePixels().
+ * The stencil of the pixels failing the tests may be updated too, so HiZ can
+ * only reject a micro tile if both of the fail ops keep the stencil.
+ */
+void TBDR::RasterizeMaskedTriangle(Triangle *tri, int x, int y, int max_w, int max_h, const TileSample &sample)
+{
+	const RasterStates *raster_states = tri->mRasterStates;
+	const StencilState &stencil = raster_states->mStencilState;
+	const TriangleSetup8 &setup = *tri->mSetup;
+	const int lane = tri->mSetupLane;
+	const int tri_xmin = setup.mXMin[lane];
+	const int tri_xmax = setup.mXMax[lane];
+	const int tri_ymin = setup.mYMin[lane];
+	const int tri_ymax = setup.mYMax[lane];
+	const int tile_size = s_TileSize;
+	const bool depth_test   = raster_states->mIsDepthTestEnable;
+	const bool stencil_test = raster_states->mIsStencilTestEnable;
+	const bool scissor_test = raster_states->mIsScissorTestEnable;
+	const bool hiz_reject   = depth_test && (!stencil_test || (stencil.fail == GL_KEEP && stencil.depthFail == GL_KEEP));
+
+	ZBuffer       &z_buf = *sample.mZBuffer;
+	StencilBuffer &s_buf = *sample.mStencilBuffer;
+	HiZBuffer     &hiz   = *sample.mHiZBuffer;
+
+	int A[3], B[3], C[3];
+
+	if (!SetupTileEdges(tri, x, y, tile_size, A, B, C))
+		return;
 
-			__m128i vAreaStepQuadx2 = _mm_slli_epi32(vFactorA2, 2);
-			__m128i vAreaStepQuady2 = vFactorB2;
+	if (sample.mOffsetX | sample.mOffsetY)
+		OffsetTileEdges(A, B, C, sample.mOffsetX, sample.mOffsetY);
 
-			__m128i vAreaStepMTx0 = _mm_slli_epi32(vFactorA0, MICRO_TILE_SIZE_SHIFT);
-			__m128i vAreaStepMTy0 = _mm_slli_epi32(vFactorB0, MICRO_TILE_SIZE_SHIFT);
+	const int minx = ROUND_DOWN((std::max)(0, tri_xmin - x), MICRO_TILE_SIZE);
+	const int miny = ROUND_DOWN((std::max)(0, tri_ymin - y), MICRO_TILE_SIZE);
+	const int maxx = (std::min)(tile_size, tri_xmax - x + 1);
+	const int maxy = (std::min)(tile_size, tri_ymax - y + 1);
 
-			__m128i vAreaStepMTx1 = _mm_slli_epi32(vFactorA1, MICRO_TILE_SIZE_SHIFT);
-			__m128i vAreaStepMTy1 = _mm_slli_epi32(vFactorB1, MICRO_TILE_SIZE_SHIFT);
+	__m128 vNewZ       = _mm_setzero_ps();
+	__m128 vZStepQuadx = _mm_setzero_ps();
+	__m128 vZStepQuady = _mm_setzero_ps();
+	__m128 vZStepMTx   = _mm_setzero_ps();
+	__m128 vZStepMTy   = _mm_setzero_ps();
 
-			__m128i vAreaStepMTx2 = _mm_slli_epi32(vFactorA2, MICRO_TILE_SIZE_SHIFT);
-			__m128i vAreaStepMTy2 = _mm_slli_epi32(vFactorB2, MICRO_TILE_SIZE_SHIFT);
+	if (depth_test)
+	{
+		const float z_gradient_x = setup.mZGradientX[lane];
+		const float z_gradient_y = setup.mZGradientY[lane];
 
-			for (int i = miny; i < maxy; i += MICRO_TILE_SIZE)
-			{
-				__m128i vArea0x = vArea0;
-				__m128i vArea1x = vArea1;
-				__m128i vArea2x = vArea2;
+		vNewZ = _mm_set_ps1(GetSampleZAtOrigin(setup, lane, sample.mOffsetX, sample.mOffsetY));
+		vNewZ = MAWrapper(_mm_cvtepi32_ps(_mm_set_epi32(x + minx + 3, x + minx + 2, x + minx + 1, x + minx)), _mm_set_ps1(z_gradient_x), vNewZ);
+		vNewZ = MAWrapper(_mm_cvtepi32_ps(_mm_set1_epi32(y + miny)), _mm_set_ps1(z_gradient_y), vNewZ);
 
-				__m128  vNewZx  = vNewZ;
+		vZStepQuadx = _mm_set_ps1(z_gradient_x * 4);
+		vZStepQuady = _mm_set_ps1(z_gradient_y);
 
-				for (int j = minx; j < maxx; j += MICRO_TILE_SIZE,
-					vArea0x = _mm_add_epi32(vArea0x, vAreaStepMTx0),
-					vArea1x = _mm_add_epi32(vArea1x, vAreaStepMTx1),
-					vArea2x = _mm_add_epi32(vArea2x, vAreaStepMTx2),
-					vNewZx  = _mm_add_ps(vNewZx, vZStepMTx))
-				{
-					__m128i vTest0 = _mm_cmplt_epi32(vArea0x, _mm_setzero_si128());
-					// This micro tile is totally outside the triangle
-					if (_mm_test_all_ones(vTest0))
-						continue;
+		vZStepMTx = _mm_set_ps1(z_gradient_x * MICRO_TILE_SIZE);
+		vZStepMTy = _mm_set_ps1(z_gradient_y * MICRO_TILE_SIZE);
+	}
 
-					__m128i vTest1 = _mm_cmplt_epi32(vArea1x, _mm_setzero_si128());
-					if (_mm_test_all_ones(vTest1))
-						continue;
+	StencilTestState state;
 
-					__m128i vTest2 = _mm_cmplt_epi32(vArea2x, _mm_setzero_si128());
-					if (_mm_test_all_ones(vTest2))
-						continue;
+	if (stencil_test)
+	{
+		state.vRef       = _mm_set1_epi16((short)(stencil.ref & stencil.valueMask & 0xFF));
+		state.vReplace   = _mm_set1_epi16((short)stencil.ref);
+		state.vValueMask = _mm_set1_epi16((short)(stencil.valueMask & 0xFF));
+		state.vWriteMask = _mm_set1_epi16((short)(stencil.writeMask & 0xFF));
+		state.func       = stencil.func;
+		state.fail       = stencil.fail;
+		state.depthFail  = stencil.depthFail;
+		state.depthPass  = stencil.depthPass;
+	}
 
-					uint64_t coverage_mask = 0;
+	for (int i = miny; i < maxy; i += MICRO_TILE_SIZE, vNewZ = _mm_add_ps(vNewZ, vZStepMTy))
+	{
+		__m128 vNewZx = vNewZ;
 
-					// This micro tile is totally inside the triangle
-					if (_mm_test_all_zeros(vTest0, _mm_set1_epi32(0xFFFFFFFF)) &&
-						_mm_test_all_zeros(vTest1, _mm_set1_epi32(0xFFFFFFFF)) &&
-						_mm_test_all_zeros(vTest2, _mm_set1_epi32(0xFFFFFFFF)))
-					{
-						if (raster_states->mIsDepthTestEnable)
-						{
-							float *zbuf_pos = &z_buf[i][j];
-							__m128 vNewZxx = vNewZx;
-
-							for (int k = 0; k < MICRO_TILE_SIZE; ++k)
-							{
-								float *zbuf_posx = zbuf_pos;
-								__m128 vNewZxxx = vNewZxx;
-
-								for (int l = 0; l < MICRO_TILE_SIZE; l += 4)
-								{
-									__m128 vCurrentZ = _mm_load_ps(zbuf_posx);
-									__m128 vMask = _mm_cmp_ps(vNewZxxx, vCurrentZ, _CMP_LT_OS);
-									_mm_maskstore_ps(zbuf_posx, _mm_castps_si128(vMask), vNewZxxx);
-
-									uint64_t mask = (uint64_t)_mm_movemask_ps(vMask);
-									coverage_mask |= (mask << ((k << MICRO_TILE_SIZE_SHIFT) + l));
-
-									zbuf_posx   += 4;
-									vNewZxxx = _mm_add_ps(vNewZxxx, vZStepQuadx);
-								}
-
-								zbuf_pos   += MACRO_TILE_SIZE;
-								vNewZxx = _mm_add_ps(vNewZxx, vZStepQuady);
-							}
-						}
-						else
-						{
-							coverage_mask = 0xFFFFFFFFFFFFFFFF;
-						}
-					}
-					else
-					{
-						const int xp = x + j;
-						const int yp = y + i;
+		for (int j = minx; j < maxx; j += MICRO_TILE_SIZE, vNewZx = _mm_add_ps(vNewZx, vZStepMTx))
+		{
+			float *micro_zmin = nullptr;
 
-						__m128 vNewZxx = vNewZx;
+			if (depth_test)
+			{
+				micro_zmin = &hiz.mMicroZMin[i >> MICRO_TILE_SIZE_SHIFT][j >> MICRO_TILE_SIZE_SHIFT];
 
-						__m128i vQuadX = _mm_set_epi32(xp + 3, xp + 2, xp + 1, xp);
-						__m128i vQuadY = _mm_set_epi32(yp, yp, yp, yp);
-						__m128i vArea0xx = MAWrapper(vFactorB0, vQuadY, MAWrapper(vFactorA0, vQuadX, vFactorC0));
-						__m128i vArea1xx = MAWrapper(vFactorB1, vQuadY, MAWrapper(vFactorA1, vQuadX, vFactorC1));
-						__m128i vArea2xx = MAWrapper(vFactorB2, vQuadY, MAWrapper(vFactorA2, vQuadX, vFactorC2));
+				if (hiz_reject)
+				{
+					float tri_zmin, tri_zmax;
 
-						// OPT: narrow down to triangle's [min max] range?
-						for (int k = 0; k < MICRO_TILE_SIZE; ++k)
-						{
-							__m128  vNewZxxx  = vNewZxx;
-							__m128i vArea0xxx = vArea0xx;
-							__m128i vArea1xxx = vArea1xx;
-							__m128i vArea2xxx = vArea2xx;
-
-							for (int l = 0; l < MICRO_TILE_SIZE; l += 4,
-								vArea0xxx = _mm_add_epi32(vArea0xxx, vAreaStepQuadx0),
-								vArea1xxx = _mm_add_epi32(vArea1xxx, vAreaStepQuadx1),
-								vArea2xxx = _mm_add_epi32(vArea2xxx, vAreaStepQuadx2),
-								vNewZxxx = _mm_add_ps(vNewZxxx, vZStepQuadx))
-							{
-								__m128i vTest0x = _mm_cmplt_epi32(vArea0xxx, _mm_setzero_si128());
-								// This quad is totally outside the triangle
-								if (_mm_test_all_ones(vTest0x))
-									continue;
-
-								__m128i vTest1x = _mm_cmplt_epi32(vArea1xxx, _mm_setzero_si128());
-								if (_mm_test_all_ones(vTest1x))
-									continue;
-
-								__m128i vTest2x = _mm_cmplt_epi32(vArea2xxx, _mm_setzero_si128());
-								if (_mm_test_all_ones(vTest2x))
-									continue;
-
-								__m128i vMask = _mm_andnot_si128(_mm_or_si128(_mm_or_si128(vTest0x, vTest1x), vTest2x), _mm_set1_epi32(0xFFFFFFFF));
-
-								if (raster_states->mIsDepthTestEnable)
-								{
-									float *zbuf_pos = &z_buf[i + k][j + l];
-									__m128 vCurrentZ = _mm_load_ps(zbuf_pos);
-									__m128i vTmp = _mm_castps_si128(_mm_cmp_ps(vNewZxxx, vCurrentZ, _CMP_LT_OS));
-									vMask = _mm_and_si128(vMask, vTmp);
-									_mm_maskstore_ps(zbuf_pos, vMask, vNewZxxx);
-								}
-
-								uint64_t mask = (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(vMask));
-								coverage_mask |= (mask << ((k << MICRO_TILE_SIZE_SHIFT) + l));
-							}
-
-							vArea0xx = _mm_add_epi32(vArea0xx, vAreaStepQuady0);
-							vArea1xx = _mm_add_epi32(vArea1xx, vAreaStepQuady1);
-							vArea2xx = _mm_add_epi32(vArea2xx, vAreaStepQuady2);
-							vNewZxx = _mm_add_ps(vNewZxx, vZStepQuady);
-						}
-					}
+					GetDepthBounds(tri,
+								   (std::max)(x + j, tri_xmin), (std::max)(y + i, tri_ymin),
+								   (std::min)(x + j + MICRO_TILE_SIZE - 1, tri_xmax), (std::min)(y + i + MICRO_TILE_SIZE - 1, tri_ymax),
+								   tri_zmin, tri_zmax);
 
-					if (coverage_mask && !raster_states->mIsDepthOnly)
-					{
-						if (!raster_states->mIsBlendEnable)
-						{
-							for (int k = 0; k < MICRO_TILE_SIZE; ++k)
-							{
-								for (int l = 0; l < MICRO_TILE_SIZE; ++l)
-								{
-									if (coverage_mask & ((uint64_t)0x1 << ((k << MICRO_TILE_SIZE_SHIFT) + l)))
-									{
-										pp_map[i + k][j + l] = tri;
-									}
-								}
-							}
-						}
-						else
-						{
-							for (int k = 0; (k < MICRO_TILE_SIZE) && ((i + k) < maxy); k += 2)
-							{
-								for (int l = 0; (l < MICRO_TILE_SIZE) && ((j + l) < maxx); l += 2)
-								{
-									int shift = (k << MICRO_TILE_SIZE_SHIFT) + l;
-									int quad_mask = ((int)(coverage_mask >> shift)) & 0x3;
-									shift += MICRO_TILE_SIZE;
-									quad_mask |= ((((int)(coverage_mask >> shift)) & 0x3) << 2);
-
-									RenderQuadPixelsInOneTriangle(tri, quad_mask, x, y, (j + l), (i + k));
-								}
-							}
-						}
-					}
+					// This micro tile is totally occluded
+					if (tri_zmin >= hiz.mMicroZMax[i >> MICRO_TILE_SIZE_SHIFT][j >> MICRO_TILE_SIZE_SHIFT])
+						continue;
 				}
-				vArea0 = _mm_add_epi32(vArea0, vAreaStepMTy0);
-				vArea1 = _mm_add_epi32(vArea1, vAreaStepMTy1);
-				vArea2 = _mm_add_epi32(vArea2, vAreaStepMTy2);
-				vNewZ = _mm_add_ps(vNewZ, vZStepMTy);
 			}
-		}
-	}
 
-	if (!mFlushTriggerBySwapBuffer)
-	{
-		// store on tile depth buffer to render target.
-		float *dst = rt_zbuf;
+			// Edge coverage only, the depth is tested after the scissor.
+			uint64_t coverage_mask = g_Kernels.RasterizeMicroTile(j, i, A, B, C, nullptr,
+																  vNewZx, vZStepQuadx, vZStepQuady, nullptr);
 
-		for (int i = 0; i < max_h; ++i, dst += g_GC->mRT.width)
-		{
-			float *dstx = dst;
-			for (int j = 0; j < max_w; j += 4, dstx += 4)
+			if (scissor_test)
 			{
-				__m128 vDepth = _mm_load_ps(&z_buf[i][j]);
-				_mm_stream_ps(dstx, vDepth);
+				coverage_mask &= GetMicroTileRectMask(raster_states->mScissorXMin - x - j, raster_states->mScissorYMin - y - i,
+													  raster_states->mScissorXMax - x - j, raster_states->mScissorYMax - y - i);
 			}
-		}
-	}
 
-	// TODO: early z/stencil
-	// TODO: hierarcical z/stencil
-	if (prim_tile_valid)
-	{
-		for (int i = 0; i < max_h; i += 2)
-		{
-			for (int j = 0; j < max_w; j += 2)
+			if (!coverage_mask)
+				continue;
+
+			if (depth_test || stencil_test)
 			{
-				RenderQuadPixels(pp_map, x, y, j, i);
+				coverage_mask = TestMicroTilePixels(coverage_mask, &z_buf[i][j], vNewZx, vZStepQuadx, vZStepQuady, micro_zmin,
+													&s_buf[i][j], stencil_test ? &state : nullptr);
 			}
+
+			EmitMicroTileCoverage(tri, coverage_mask, x, y, i, j, maxx, maxy, sample);
 		}
 	}
+
+	if (depth_test)
+		UpdateHiZ(hiz, max_w, max_h);
 }
 
 void TBDR::RenderOnePixel(Triangle *tri, int x, int y, float z)
@@ -1427,12 +3050,43 @@ void TBDR::RenderOnePixel(Triangle *tri, int x, int y, float z)
 	fsio.z = z;
 	fsio.mIndex  = y * g_GC->mRT.width + x;
 	fsio.m_priv0 = tri;
-	fsio.in.resize(tri->mPrim.mVert[0].getRegsNum());
+	fsio.in.resize(tri->mAttrRegsNum);
+
+	tri->PrepareAttributes();
 
 	// TODO: Add condition check
 	mDE.mInterpolater->emit(&fsio);
 }
 
+// Shade the pixels resolved in the pixel prim maps of the tile.
+void TBDR::RenderPixelPrimMaps(int x, int y, int max_w, int max_h)
+{
+	if (s_Samples == 1)
+	{
+		PixelPrimMap &pp_map = mPixelPrimMap[ThreadPool::getThreadID()];
+
+		for (int i = 0; i < max_h; i += 2)
+		{
+			for (int j = 0; j < max_w; j += 2)
+			{
+				RenderQuadPixels(pp_map, x, y, j, i);
+			}
+		}
+	}
+	else
+	{
+		MultisampleTile &ms_tile = mMultisampleTile[ThreadPool::getThreadID()];
+
+		for (int i = 0; i < max_h; i += 2)
+		{
+			for (int j = 0; j < max_w; j += 2)
+			{
+				RenderQuadSamples(ms_tile, x, y, j, i);
+			}
+		}
+	}
+}
+
 void TBDR::RenderQuadPixels(PixelPrimMap pp_map, int x, int y, int i, int j)
 {
 	int quad_mask = 0xf;
@@ -1461,44 +3115,163 @@ void TBDR::RenderQuadPixels(PixelPrimMap pp_map, int x, int y, int i, int j)
 		for (int s = 0; s < 4; s++)
 		{
 			if (tri[s] == tri[idx])
-				coverage_mask = 1 << idx;
+				coverage_mask |= 1 << s;
 		}
 
 		quad_mask &= ~coverage_mask;
 
-		RenderQuadPixelsInOneTriangle(tri[idx], coverage_mask, x, y, i, j);
+		RenderQuadPixelsInOneTriangle(tri[idx], coverage_mask, coverage_mask, x, y, i, j);
 	}
 }
 
-void TBDR::RenderQuadPixelsInOneTriangle(Triangle *tri, int coverage_mask, int x, int y, int i, int j)
+/* Same as RenderQuadPixels(), but each pixel may be covered by a triangle
+ * per sample. A pixel is shaded once for each of the triangles, and the
+ * color goes to the samples covered by that triangle.
+ */
+void TBDR::RenderQuadSamples(MultisampleTile &ms_tile, int x, int y, int i, int j)
 {
-	/* NOTE:
-	 * Put fsio at stack to optimize memory allocation.
-	 * However, since Fsiosimd is a large structure containing the shader input/output registers,
-	 * need take care if the max register number is increased.
-	 */
-	ALIGN(16) Fsiosimd fsio;
+	// Sample s of pixel p is at bit (s * 4 + p), the same as Fsiosimd::mSampleMask.
+	Triangle *tri[MSAA_SAMPLES * 4];
+	int sample_mask = 0;
 
-	FragmentShader *pFS = tri->mRasterStates->mFS;
-	size_t fsin_num     = tri->mPrim.mVert[0].getRegsNum();
-	size_t fsout_num    = pFS->getOutRegsNum();
+	for (int s = 0; s < MSAA_SAMPLES; ++s)
+	{
+		PixelPrimMap &pp_map = ms_tile.mPixelPrimMap[s];
+
+		tri[(s << 2) + 0] = pp_map[j + 0][i + 0];
+		tri[(s << 2) + 1] = pp_map[j + 0][i + 1];
+		tri[(s << 2) + 2] = pp_map[j + 1][i + 0];
+		tri[(s << 2) + 3] = pp_map[j + 1][i + 1];
+	}
+
+	for (int k = 0; k < MSAA_SAMPLES * 4; ++k)
+	{
+		if (tri[k])
+			sample_mask |= (1 << k);
+	}
+
+	unsigned long idx;
+	while (_BitScanForward(&idx, (unsigned long)sample_mask))
+	{
+		int tri_sample_mask = 0;
+		for (int k = 0; k < MSAA_SAMPLES * 4; k++)
+		{
+			if (tri[k] == tri[idx])
+				tri_sample_mask |= 1 << k;
+		}
+
+		sample_mask &= ~tri_sample_mask;
+
+		const int coverage_mask = (tri_sample_mask | (tri_sample_mask >> 4) |
+								   (tri_sample_mask >> 8) | (tri_sample_mask >> 12)) & 0xF;
+
+		RenderQuadPixelsInOneTriangle(tri[idx], coverage_mask, tri_sample_mask, x, y, i, j);
+	}
+}
+
+// Shade the samples of the blended triangle collected by EmitMicroTileCoverage(), and clear them.
+void TBDR::RenderSampleCoverage(Triangle *tri, int x, int y, int max_w, int max_h)
+{
+	MultisampleTile &ms_tile = mMultisampleTile[ThreadPool::getThreadID()];
+
+	const TriangleSetup8 &setup = *tri->mSetup;
+	const int lane = tri->mSetupLane;
+
+	// Nothing is covered out of the bounding box.
+	const int minx = ROUND_DOWN((std::max)(0, setup.mXMin[lane] - x), 2);
+	const int miny = ROUND_DOWN((std::max)(0, setup.mYMin[lane] - y), 2);
+	const int maxx = (std::min)(max_w, setup.mXMax[lane] - x + 1);
+	const int maxy = (std::min)(max_h, setup.mYMax[lane] - y + 1);
+
+	for (int i = miny; i < maxy; i += 2)
+	{
+		for (int j = minx; j < maxx; j += 2)
+		{
+			uint8_t *coverage[4] =
+			{
+				&ms_tile.mSampleCoverage[i + 0][j + 0],
+				&ms_tile.mSampleCoverage[i + 0][j + 1],
+				&ms_tile.mSampleCoverage[i + 1][j + 0],
+				&ms_tile.mSampleCoverage[i + 1][j + 1]
+			};
+
+			int coverage_mask = 0;
+			int sample_mask   = 0;
+
+			for (int p = 0; p < 4; ++p)
+			{
+				if (!*coverage[p])
+					continue;
+
+				coverage_mask |= (1 << p);
+
+				for (int s = 0; s < MSAA_SAMPLES; ++s)
+				{
+					if (*coverage[p] & (1 << s))
+						sample_mask |= (1 << ((s << 2) + p));
+				}
+
+				*coverage[p] = 0;
+			}
+
+			if (coverage_mask)
+				RenderQuadPixelsInOneTriangle(tri, coverage_mask, sample_mask, x, y, j, i);
+		}
+	}
+}
+
+/* The quad is queued, and shaded along with the other quads of the same triangle
+ * when the queue is full, another triangle comes, or the tile is done.
+ */
+void TBDR::RenderQuadPixelsInOneTriangle(Triangle *tri, int coverage_mask, int sample_mask, int x, int y, int i, int j)
+{
+	FsiosimdGroup &queue = mShadingQueue[ThreadPool::getThreadID()];
+
+	if (queue.mCount == MAX_QUADS_IN_GROUP ||
+		(queue.mCount && queue.mQuads[0].m_priv0 != tri))
+	{
+		FlushShadingQueue(queue);
+	}
+
+	Fsiosimd &fsio = queue.mQuads[queue.mCount++];
 
-	fsio.mInRegsNum  = fsin_num;
-	fsio.mOutRegsNum = fsout_num;
 	fsio.x = x + i;
 	fsio.y = y + j;
 	fsio.mCoverageMask = coverage_mask;
+	fsio.mSampleMask   = sample_mask;
 	fsio.m_priv0 = tri;
+}
+
+void TBDR::FlushShadingQueue(FsiosimdGroup &queue)
+{
+	if (!queue.mCount)
+		return;
+
+	Triangle *tri = static_cast<Triangle *>(queue.mQuads[0].m_priv0);
+
+	tri->PrepareAttributes();
+
+	FragmentShader *pFS = tri->mRasterStates->mFS;
+	const int fsin_num  = tri->mAttrRegsNum;
+	const int fsout_num = (int)pFS->getOutRegsNum();
+
+	for (int i = 0; i < queue.mCount; ++i)
+	{
+		queue.mQuads[i].mInRegsNum  = fsin_num;
+		queue.mQuads[i].mOutRegsNum = fsout_num;
+	}
 
 	// TODO: elaborate the pipe stages order
-	mDE.mInterpolater->emit(&fsio);
+	mDE.mInterpolater->emit(&queue);
 
-	pFS->emit(&fsio);
+	pFS->emit(&queue);
 
 	if (tri->mRasterStates->mIsBlendEnable)
-		mDE.mBlender->emit(&fsio);
+		mDE.mBlender->emit(&queue);
 	else
-		mDE.mFBWriter->emit(&fsio);
+		mDE.mFBWriter->emit(&queue);
+
+	queue.mCount = 0;
 }
 
 void TBDR::finalize()
@@ -1507,18 +3280,135 @@ void TBDR::finalize()
 
 	MemoryPoolMT::get().BoostReclaimAll();
 
-	for (int y = 0; y < MAX_TILES_IN_HEIGHT; ++y)
+	for (int i = 0; i < s_DispListNum; ++i)
+	{
+		s_SetupArena[i].reset();
+		s_AttrArena[i].reset();
+		s_BinArena[i].reset();
+		s_ImmediateList[i].clear();
+		s_BinnedTriangles[i] = 0;
+		s_BinnedPrimMemory[i] = 0;
+	}
+
+	// Only the active tiles need to be reset.
+	for (int i = 0; i < s_DispListNum; ++i)
 	{
-		for (int x = 0; x < MAX_TILES_IN_WIDTH; ++x)
+		vector<uint64_t> &active_mask = s_TileActiveMask[i];
+
+		for (size_t w = 0; w < active_mask.size(); ++w)
+		{
+			for (uint64_t active = active_mask[w]; active; active &= active - 1)
+			{
+				unsigned long bit;
+				_BitScanForward(&bit, active);
+
+				const int tile = (int)(w << 6) + (int)bit;
+				s_DispList[i][tile].mHead = BIN_CHUNK_NONE;
+				s_DispList[i][tile].mTail = BIN_CHUNK_NONE;
+				s_TileCost[i][tile] = 0;
+			}
+
+			active_mask[w] = 0;
+		}
+
+		vector<uint64_t> &super_mask = s_SuperTileActiveMask[i];
+
+		for (size_t w = 0; w < super_mask.size(); ++w)
 		{
-			std::vector<TriangleBinningPoint> &disp_list = s_DispList[y][x];
+			for (uint64_t active = super_mask[w]; active; active &= active - 1)
+			{
+				unsigned long bit;
+				_BitScanForward(&bit, active);
+
+				const int super_tile = (int)(w << 6) + (int)bit;
+				s_SuperTileList[i][super_tile].mHead = BIN_CHUNK_NONE;
+				s_SuperTileList[i][super_tile].mTail = BIN_CHUNK_NONE;
+				s_SuperTileCost[i][super_tile] = 0;
+			}
 
-			disp_list.clear();
+			super_mask[w] = 0;
 		}
 	}
 
 	if (mDepthClearFlag)
 		mDepthClearFlag = false;
+
+	mColorClearFlag = false;
+	mStencilClearFlag = false;
+	mStencilTestFlag = false;
+}
+
+/* The memory held by the triangles binned since the last flush, the
+ * primitives they reference and their setup and attribute blocks, the same
+ * in both render modes.
+ * The triangles and primitives live in MemoryPoolMT until the flush, so they
+ * are counted rather than measured from the pool, which also serves the
+ * transient primitives of the geometry stages.
+ * NOTE: call it only after the geometry tasks are done.
+ */
+size_t TBDR::GetTriangleMemorySize() const
+{
+	size_t size = 0;
+
+	for (int i = 0; i < s_DispListNum; ++i)
+	{
+		size += s_BinnedTriangles[i] * sizeof(Triangle);
+		size += s_BinnedPrimMemory[i];
+		size += s_SetupArena[i].size() * sizeof(TriangleSetup8);
+		size += s_AttrArena[i].size();
+	}
+
+	return size;
+}
+
+/* The memory held by the primitives binned since the last flush: the
+ * triangles and the display list entries of the tiles or of the immediate mode.
+ * NOTE: call it only after the geometry tasks are done.
+ */
+size_t TBDR::GetBinMemorySize() const
+{
+	size_t size = GetTriangleMemorySize();
+
+	for (int i = 0; i < s_DispListNum; ++i)
+	{
+		size += s_BinArena[i].size();
+		size += s_ImmediateList[i].size() * sizeof(TriangleBinningPoint);
+	}
+
+	return size;
+}
+
+bool TBDR::IsMultisample() const
+{
+	return s_Samples > 1;
+}
+
+void TBDR::SetClearRect(int xmin, int ymin, int xmax, int ymax)
+{
+	mClearXMin = xmin;
+	mClearYMin = ymin;
+	mClearXMax = xmax;
+	mClearYMax = ymax;
+}
+
+bool TBDR::IsClearRectChanged(int xmin, int ymin, int xmax, int ymax) const
+{
+	if (!mDepthClearFlag && !mColorClearFlag && !mStencilClearFlag)
+		return false;
+
+	return (xmin != mClearXMin || ymin != mClearYMin ||
+			xmax != mClearXMax || ymax != mClearYMax);
+}
+
+void TBDR::SetStencilClearFlag(uint8_t stencil, uint8_t mask)
+{
+	// Merge with the pending clear, if any.
+	if (!mStencilClearFlag)
+		mStencilClearMask = 0;
+
+	mClearStencil      = (mClearStencil & ~mask) | (stencil & mask);
+	mStencilClearMask |= mask;
+	mStencilClearFlag  = true;
 }
 
 void TBDR::FlushDisplayLists(bool swap_buffer, bool depth_only)
@@ -1526,9 +3416,149 @@ void TBDR::FlushDisplayLists(bool swap_buffer, bool depth_only)
 	mFlushTriggerBySwapBuffer = swap_buffer;
 	mDepthOnlyPass = depth_only;
 
+	for (int i = 0; i < s_DispListNum; ++i)
+		mFrameTriangles += s_BinnedTriangles[i];
+
+	mFrameTriangleMemory += GetTriangleMemorySize();
+
 	onRasterizing();
 
 	finalize();
+
+	if (swap_buffer)
+	{
+		mLastFrameTriangles      = mFrameTriangles;
+		mLastFrameTriangleMemory = mFrameTriangleMemory;
+		mLastFrameValid          = true;
+		mFrameTriangles          = 0;
+		mFrameTriangleMemory     = 0;
+	}
+
+	// Nothing is binned now, so the mode can be switched.
+	PickRenderMode();
+}
+
+bool TBDR::SetRenderMode(int mode)
+{
+	if (mode != GLSP_RENDER_MODE_AUTO &&
+		mode != GLSP_RENDER_MODE_DEFERRED &&
+		mode != GLSP_RENDER_MODE_IMMEDIATE)
+		return false;
+
+	mRenderMode = mode;
+
+	// Apply it right now if nothing is binned.
+	if (mDE.mDrawCount == 0)
+		PickRenderMode();
+
+	return true;
+}
+
+bool TBDR::IsImmediateModeOverrun() const
+{
+	if (!s_ImmediateMode || mRenderMode != GLSP_RENDER_MODE_AUTO)
+		return false;
+
+	size_t triangles = 0;
+	for (int i = 0; i < s_DispListNum; ++i)
+		triangles += s_BinnedTriangles[i];
+
+	return (triangles > IMMEDIATE_MODE_MAX_TRIANGLES ||
+			GetTriangleMemorySize() > IMMEDIATE_MODE_MAX_TRIANGLE_MEMORY);
+}
+
+void TBDR::PickRenderMode()
+{
+	switch (mRenderMode)
+	{
+	case GLSP_RENDER_MODE_DEFERRED:
+		s_ImmediateMode = false;
+		break;
+
+	case GLSP_RENDER_MODE_IMMEDIATE:
+		s_ImmediateMode = true;
+		break;
+
+	default:
+	{
+		// The cost of the frame is estimated from the last frame, or from the
+		// render passes of current frame so far if they are already heavier.
+		// Every tile row of an immediate mode render pass walks the whole
+		// triangle list, which should stay in the cache.
+		// Without the last frame, e.g. the first one, it's deferred.
+		if (!mLastFrameValid)
+		{
+			s_ImmediateMode = false;
+			break;
+		}
+
+		const size_t triangles = (std::max)(mLastFrameTriangles, mFrameTriangles);
+		const size_t memory    = (std::max)(mLastFrameTriangleMemory, mFrameTriangleMemory);
+
+		s_ImmediateMode = (triangles <= IMMEDIATE_MODE_MAX_TRIANGLES &&
+						   memory    <= IMMEDIATE_MODE_MAX_TRIANGLE_MEMORY);
+		break;
+	}
+	}
+}
+
+/* The detile is split by super tile rows over the thread pool, each block row
+ * is copied to the display buffer with 16 bytes loads/stores.
+ */
+void TBDR::DetileColorBuffer()
+{
+	::glsp::ThreadPool &thread_pool = ::glsp::ThreadPool::get();
+
+	const int width  = g_GC->mRT.width;
+	const int height = g_GC->mRT.height;
+	const int super_tiles_in_width  = ROUND_UP(width,  SWIZZLE_SUPER_TILE_SIZE) / SWIZZLE_SUPER_TILE_SIZE;
+	const int super_tiles_in_height = ROUND_UP(height, SWIZZLE_SUPER_TILE_SIZE) / SWIZZLE_SUPER_TILE_SIZE;
+	const int blocks_in_super_tile  = SWIZZLE_SUPER_TILE_SIZE / SWIZZLE_BLOCK_SIZE;
+
+	const uint32_t *src_base = (const uint32_t *)g_GC->mRT.pColorBuffer;
+	uint32_t *dst_base = (uint32_t *)g_GC->mRT.pDisplayBuffer;
+
+	for (int ty = 0; ty < super_tiles_in_height; ++ty)
+	{
+		auto task_handler = [=](void *data)
+		{
+			const uint32_t *src = src_base + (size_t)ty * super_tiles_in_width * SWIZZLE_SUPER_TILE_SIZE * SWIZZLE_SUPER_TILE_SIZE;
+
+			for (int tx = 0; tx < super_tiles_in_width; ++tx)
+			{
+				for (int b = 0; b < blocks_in_super_tile * blocks_in_super_tile; ++b, src += SWIZZLE_BLOCK_SIZE * SWIZZLE_BLOCK_SIZE)
+				{
+					int bx, by;
+					MortonDecode(b, bx, by);
+
+					const int x = tx * SWIZZLE_SUPER_TILE_SIZE + bx * SWIZZLE_BLOCK_SIZE;
+					const int y = ty * SWIZZLE_SUPER_TILE_SIZE + by * SWIZZLE_BLOCK_SIZE;
+					if (x >= width || y >= height)
+						continue;
+
+					const int max_w = (std::min)(SWIZZLE_BLOCK_SIZE, width  - x);
+					const int max_h = (std::min)(SWIZZLE_BLOCK_SIZE, height - y);
+
+					for (int i = 0; i < max_h; ++i)
+					{
+						const uint32_t *srcx = src + i * SWIZZLE_BLOCK_SIZE;
+						uint32_t *dstx = dst_base + (size_t)width * (y + i) + x;
+						int j = 0;
+
+						for (; j + 4 <= max_w; j += 4)
+							_mm_storeu_si128((__m128i *)(dstx + j), _mm_load_si128((const __m128i *)(srcx + j)));
+
+						for (; j < max_w; ++j)
+							dstx[j] = srcx[j];
+					}
+				}
+			}
+		};
+		WorkItem *task = thread_pool.CreateWork(task_handler, nullptr);
+		thread_pool.AddWork(task);
+	}
+
+	thread_pool.waitForAllTaskDone();
 }
 
 } // namespace glsp
@@ -1,30 +1,48 @@
 #pragma once
 
+#include <atomic>
+
 #include "Rasterizer.h"
 #include "PipeStage.h"
 #include "utils.h"
 
 
-// 32x32
-#define MACRO_TILE_SIZE           32
-#define MACRO_TILE_SIZE_SHIFT     5
+/* Macro tile size is chosen per render pass at runtime,
+ * it must be a power of 2 in [MIN_MACRO_TILE_SIZE, MAX_MACRO_TILE_SIZE].
+ * The tile grid is sized from the render target, so there is
+ * no limitation on the rasterization size any more.
+ */
+#define MIN_MACRO_TILE_SIZE       16
+#define MAX_MACRO_TILE_SIZE       128
+
+// Default tile size for color pass and depth only(e.g. shadow map) pass.
+#define DEFAULT_MACRO_TILE_SIZE            32
+#define DEFAULT_DEPTH_ONLY_MACRO_TILE_SIZE 64
+
+// Swizzled render target(see NWMBufferLayout), the block is the smallest
+// macro tile and the super tile the largest one.
+#define SWIZZLE_BLOCK_SIZE        MIN_MACRO_TILE_SIZE
+#define SWIZZLE_SUPER_TILE_SIZE   MAX_MACRO_TILE_SIZE
+
+// A frame with no more triangles than this, and no more triangle memory(the
+// triangles with their setup and attributes), is rendered in immediate mode,
+// see GLSP_RENDER_MODE_AUTO.
+#define IMMEDIATE_MODE_MAX_TRIANGLES        512
+#define IMMEDIATE_MODE_MAX_TRIANGLE_MEMORY  (256 * 1024)
 
 // 8x8
 #define MICRO_TILE_SIZE           8
 #define MICRO_TILE_SIZE_SHIFT     3
 
-#define MICRO_TILES_IN_MACRO_TILE (MACRO_TILE_SIZE / MICRO_TILE_SIZE)
-
-// support 720p window at maximum
-#define MAX_RASTERIZATION_WIDTH   2048
-#define MAX_RASTERIZATION_HEIGHT  2048
-
-#define MAX_TILES_IN_WIDTH        (MAX_RASTERIZATION_WIDTH  >> MACRO_TILE_SIZE_SHIFT)
-#define MAX_TILES_IN_HEIGHT       (MAX_RASTERIZATION_HEIGHT >> MACRO_TILE_SIZE_SHIFT)
+#define MAX_MICRO_TILES_IN_MACRO_TILE (MAX_MACRO_TILE_SIZE / MICRO_TILE_SIZE)
 
 #define RAST_SUBPIXEL_BITS  FIXED_POINT4_SHIFT
 #define RAST_SUBPIXELS      FIXED_POINT4
 
+// Sample count of a multisample render pass.
+#define MSAA_SAMPLES        4
+#define MSAA_SAMPLES_SHIFT  2
+
 
 namespace glsp {
 
@@ -33,9 +51,80 @@ class Batch;
 class Triangle;
 using std::vector;
 
+struct TriangleBinningPoint
+{
+	Triangle     *tri;
+	unsigned int  batch_id;   // Copy of tri->mBatchID, the merge key of the per thread lists.
+	bool          full_cover; // Indicate this triangle fully cover a macro tile.
+};
+
+typedef vector<TriangleBinningPoint> DisplayList;
+
+// Number of triangles set up in one go, see TriangleSetup8.
+#define SETUP_BLOCK_SIZE    8
+
+/* Input of the triangle setup, the window coordinates of the vertices
+ * of SETUP_BLOCK_SIZE triangles in SoA layout, counter-clockwise.
+ */
+struct ALIGN(32) TriangleSetupInput8
+{
+	float				mX[3][SETUP_BLOCK_SIZE];
+	float				mY[3][SETUP_BLOCK_SIZE];
+	float				mZ[3][SETUP_BLOCK_SIZE];
+	float				mW[3][SETUP_BLOCK_SIZE];
+	float				mAreaReciprocal[SETUP_BLOCK_SIZE];
+};
+
+/* Setup result of SETUP_BLOCK_SIZE triangles in SoA layout, filled 8-wide by the
+ * setup kernel, and read by the rasterizer directly. A triangle is a lane of it.
+ */
+struct ALIGN(32) TriangleSetup8
+{
+	// Edge equations, edge i is the one opposite to vertex i.
+	// NOTE: mFactorC is the cross product of *.4 fixed-point coordinates,
+	// which overflows 32 bit with large guard band.
+	int					mFactorA[3][SETUP_BLOCK_SIZE];
+	int					mFactorB[3][SETUP_BLOCK_SIZE];
+	int64_t				mFactorC[3][SETUP_BLOCK_SIZE];
+
+	// Bounding box of the pixels with a sample which may be covered,
+	// it is empty(min > max) if there is none.
+	int					mXMin[SETUP_BLOCK_SIZE];
+	int					mXMax[SETUP_BLOCK_SIZE];
+	int					mYMin[SETUP_BLOCK_SIZE];
+	int					mYMax[SETUP_BLOCK_SIZE];
+
+	// Depth plane equation, used for fast depth interpolation.
+	// Only set up when depth test is enabled.
+	float				mZGradientX[SETUP_BLOCK_SIZE];
+	float				mZGradientY[SETUP_BLOCK_SIZE];
+	float				mZAtOrigin[SETUP_BLOCK_SIZE];
+
+	// Depth range of the three vertices, used to bound the depth plane.
+	float				mZMin[SETUP_BLOCK_SIZE];
+	float				mZMax[SETUP_BLOCK_SIZE];
+
+	// Plane equation, used for fast computation of perspective corrected barycentric coordinates.
+	// Not set up for depth only pass.
+	float				mPCBCOnW0GradientX[SETUP_BLOCK_SIZE];
+	float				mPCBCOnW0GradientY[SETUP_BLOCK_SIZE];
+	float				mPCBCOnW0AtOrigin[SETUP_BLOCK_SIZE];
+
+	float				mPCBCOnW1GradientX[SETUP_BLOCK_SIZE];
+	float				mPCBCOnW1GradientY[SETUP_BLOCK_SIZE];
+	float				mPCBCOnW1AtOrigin[SETUP_BLOCK_SIZE];
+
+	float				mWRecipGradientX[SETUP_BLOCK_SIZE];
+	float				mWRecipGradientY[SETUP_BLOCK_SIZE];
+	float				mWRecipAtOrigin[SETUP_BLOCK_SIZE];
+};
+
 class Binning: public PipeStage
 {
 public:
+	// Bins the triangles of an immediate mode render pass falling back to deferred.
+	friend class TBDR;
+
 	Binning();
 	virtual ~Binning();
 
@@ -45,20 +134,9 @@ public:
 private:
 	void onBinning(Batch *bat);
 
-	void SetupTriangle(Triangle *tri);
-	void SetupTriangleSIMD(Triangle *tri0, Triangle *tri1, Triangle *tri2, Triangle *tri3);
+	void SetupTriangles(Triangle *tri[SETUP_BLOCK_SIZE], int count, TriangleSetupInput8 &in);
 
-	void CoarseRasterizing(Triangle *tri);
-};
-
-
-class IntermVertex
-{
-public:
-	// Used to calculate edge equation.
-	int			mFactorA;
-	int			mFactorB;
-	int			mFactorC;
+	static void CoarseRasterizing(Triangle *tri);
 };
 
 class Triangle
@@ -67,45 +145,40 @@ public:
 	Triangle(Primitive &prim, Batch *bat);
 	~Triangle() = default;
 
-	// Plane equation, used for fast computation of perspective corrected barycentric coordinates.
-	float				mPCBCOnW0GradientX;
-	float				mPCBCOnW0GradientY;
-	float				mPCBCOnW0AtOrigin;
-
-	float				mPCBCOnW1GradientX;
-	float				mPCBCOnW1GradientY;
-	float				mPCBCOnW1AtOrigin;
-
-	float				mWRecipGradientX;
-	float				mWRecipGradientY;
-	float				mWRecipAtOrigin;
+	// Set up the attribute plane equations once, on the first shading of the triangle.
+	inline void PrepareAttributes();
 
-	// Depth plane equation, used for fast depth interpolation.
-	float				mZGradientX;
-	float				mZGradientY;
-	float				mZAtOrigin;
-
-	// Bounding box.
-	int					xmin;
-	int					xmax;
-	int					ymin;
-	int					ymax;
+	// Setup result, it's the lane mSetupLane of mSetup.
+	const TriangleSetup8 *mSetup;
+	int					mSetupLane;
 
 	Primitive	       &mPrim;
 
-	// Store the vert2(in counter-clockwise) for later attribute plane equation.
+	// Store the verts(in counter-clockwise) for later attribute plane equation.
+	const vsOutput     *mVert0;
+	const vsOutput     *mVert1;
 	const vsOutput     *mVert2;
 	const RasterStates *mRasterStates;
 
-	// NOTE: the order may be changed from the original order
-	// in Primitive to keep counter-clockwise
-	IntermVertex		mVert[3];
-
 	unsigned int		mBatchID;
 
-	// Attributes plane equation, used for fast attributes interpolation.
-	vsOutput			mAttrPlaneEquationA;
-	vsOutput			mAttrPlaneEquationB;
+	/* The record of the triangle in the attribute block of its batch, see
+	 * Binning::onBinning(). Three planes of mAttrRegsNum vec4 each: the attributes
+	 * of vert2 and the attributes plane equation A/B, used for fast attributes
+	 * interpolation.
+	 */
+	float			   *mAttrs;
+	int					mAttrRegsNum;
+
+	const float *GetAttrVert2() const { return mAttrs; }
+	const float *GetAttrPlaneEquationA() const { return mAttrs + 4 * mAttrRegsNum; }
+	const float *GetAttrPlaneEquationB() const { return mAttrs + 8 * mAttrRegsNum; }
+
+private:
+	void SetupAttributes();
+
+	// ATTR_SETUP_NONE/BUSY/DONE, a triangle may be shaded by several tile threads at once.
+	std::atomic_int		mAttrSetupState;
 
 #if 0
 	// used to compute texture mipmap lambda. Refer to:
@@ -114,6 +187,19 @@ public:
 #endif
 };
 
+// Hierarchical z of the on-tile z buffer.
+// Depth can only decrease with the LESS depth func, so a stale mMicroZMax
+// is still a conservative upper bound.
+struct HiZBuffer
+{
+	float				mMicroZMin[MAX_MICRO_TILES_IN_MACRO_TILE][MAX_MICRO_TILES_IN_MACRO_TILE];
+	float				mMicroZMax[MAX_MICRO_TILES_IN_MACRO_TILE][MAX_MICRO_TILES_IN_MACRO_TILE];
+
+	// min/max of the whole macro tile
+	float				mZMin;
+	float				mZMax;
+};
+
 class TBDR: public Rasterizer
 {
 public:
@@ -124,22 +210,178 @@ public:
 
 	void FlushDisplayLists(bool swap_buffer, bool depth_only);
 	void SetDepthClearFlag() { mDepthClearFlag = true; }
+	void SetColorClearFlag(uint32_t color) { mColorClearFlag = true; mClearColor = color; }
+	void SetStencilClearFlag(uint8_t stencil, uint8_t mask);
 
-private:
-	typedef Triangle  *PixelPrimMap[MACRO_TILE_SIZE][MACRO_TILE_SIZE];
-	typedef float           ZBuffer[MACRO_TILE_SIZE][MACRO_TILE_SIZE];
+	// The pending clears only cover the inclusive rectangle, i.e. the scissor box.
+	// A clear with another rectangle needs the pending ones flushed first.
+	void SetClearRect(int xmin, int ymin, int xmax, int ymax);
+	bool IsClearRectChanged(int xmin, int ymin, int xmax, int ymax) const;
+	void SetStencilTestFlag() { mStencilTestFlag = true; }
+
+	bool SetMacroTileSize(int tile_size, int depth_only_tile_size);
+
+	size_t GetBinMemorySize() const;
+	bool IsMultisample() const;
+
+	// Render mode(GLSPRenderMode), takes effect from next render pass.
+	bool SetRenderMode(int mode);
+
+	// Called once a draw is binned, true if an automatic immediate mode render
+	// pass turns out heavy. It's then flushed, and the rest of the frame deferred.
+	bool IsImmediateModeOverrun() const;
 
+	// Convert the swizzled color buffer of the render target to its linear display buffer.
+	void DetileColorBuffer();
+
+	// Size the tile grid for the render target and sample count of current render pass.
+	// NOTE: caller should make sure that nothing is binned yet.
+	bool IsTileGridChanged(int width, int height, bool depth_only, int samples) const;
+	void SetupTileGrid(int width, int height, bool depth_only, int samples);
+
+	// Raster state bits the RasterizeTriangleVariant() kernels are specialized on.
+	enum RasterStateBits
+	{
+		RASTER_STATE_DEPTH_TEST = 0x1,
+		RASTER_STATE_BLEND      = 0x2,
+		RASTER_STATE_DEPTH_ONLY = 0x4,
+		RASTER_STATE_FULL_COVER = 0x8,
+		RASTER_STATE_VARIANTS   = 0x10
+	};
+
+private:
+	// Allocated for the max tile size, only the top-left corner is used for smaller tiles.
+	typedef Triangle  *PixelPrimMap[MAX_MACRO_TILE_SIZE][MAX_MACRO_TILE_SIZE];
+	typedef float           ZBuffer[MAX_MACRO_TILE_SIZE][MAX_MACRO_TILE_SIZE];
+	typedef uint32_t    ColorBuffer[MAX_MACRO_TILE_SIZE][MAX_MACRO_TILE_SIZE];
+	typedef uint8_t   StencilBuffer[MAX_MACRO_TILE_SIZE][MAX_MACRO_TILE_SIZE];
+
+	// One sample of the on-tile buffers, the pixel centre only in a single sample pass.
+	struct TileSample
+	{
+		PixelPrimMap  *mPixelPrimMap;
+		ZBuffer       *mZBuffer;
+		StencilBuffer *mStencilBuffer;
+		HiZBuffer     *mHiZBuffer;
+		int            mIndex;
+
+		// Offset from the pixel centre, in subpixels.
+		int            mOffsetX;
+		int            mOffsetY;
+	};
+
+	/* On-tile buffers of a multisample pass, one plane per sample.
+	 * The color samples are resolved to the first plane on tile store.
+	 */
+	struct MultisampleTile
+	{
+		PixelPrimMap   mPixelPrimMap[MSAA_SAMPLES];
+		ZBuffer        mZBuffer     [MSAA_SAMPLES];
+		StencilBuffer  mStencilBuffer[MSAA_SAMPLES];
+		HiZBuffer      mHiZBuffer   [MSAA_SAMPLES];
+		ColorBuffer    mColorBuffer [MSAA_SAMPLES];
+
+		// Samples covered by the blended triangle being rasterized, a bit per sample.
+		// Always cleared once the triangle is shaded.
+		uint8_t        mSampleCoverage[MAX_MACRO_TILE_SIZE][MAX_MACRO_TILE_SIZE];
+	};
+
+	// A sorted run of display list being merged.
+	struct BinRun
+	{
+		const TriangleBinningPoint *mCur;
+		const TriangleBinningPoint *mEnd;
+	};
+
+	typedef void (TBDR::*RasterizeTriangleFunc)(Triangle *tri, int x, int y, int max_w, int max_h, const TileSample &sample);
+
+	// Indexed by the raster state bits.
+	static const RasterizeTriangleFunc s_RasterizeTriangleVariants[RASTER_STATE_VARIANTS];
+
+	size_t GetTriangleMemorySize() const;
+	void PickRenderMode();
 	virtual void onRasterizing();
-	void FineRasterizing(int x, int y);
+	void onRasterizingImmediate();
+	void RenderImmediateTileRows(int row_begin, int row_end);
+	static void MergeBatchRuns(vector<BinRun> &runs, DisplayList &merged_list);
+	void MergeImmediateLists(DisplayList &merged_list);
+	const DisplayList *GetTileDisplayList(int x, int y);
+	int  GetTileClearCoverage(int x, int y, int max_w, int max_h) const;
+	void FineRasterizing(int x, int y, const DisplayList *disp_list);
+	void RasterizeTriangle(const TriangleBinningPoint &tbp, int state, int x, int y, int max_w, int max_h, const TileSample &sample);
+	template <int State>
+	void RasterizeTriangleVariant(Triangle *tri, int x, int y, int max_w, int max_h, const TileSample &sample);
+	void RasterizeMicroTriangle(Triangle *tri, int x, int y, int max_w, int max_h, const TileSample &sample);
+	void RasterizeMaskedTriangle(Triangle *tri, int x, int y, int max_w, int max_h, const TileSample &sample);
+	inline void EmitMicroTileCoverage(Triangle *tri, uint64_t coverage_mask, int x, int y, int i, int j,
+									  int max_w, int max_h, const TileSample &sample);
+	template <int State>
+	inline void EmitMicroTileCoverage(Triangle *tri, uint64_t coverage_mask, int x, int y, int i, int j,
+									  int max_w, int max_h, const TileSample &sample);
 	void RenderOnePixel(Triangle *tri, int x, int y, float z);
+	void RenderPixelPrimMaps(int x, int y, int max_w, int max_h);
 	void RenderQuadPixels(PixelPrimMap pp_map, int x, int y, /* float z, */ int i, int j);
-	inline void RenderQuadPixelsInOneTriangle(Triangle *tri, int coverage_mask, int x, int y, int i, int j);
+	void RenderQuadSamples(MultisampleTile &ms_tile, int x, int y, int i, int j);
+	void RenderSampleCoverage(Triangle *tri, int x, int y, int max_w, int max_h);
+	inline void RenderQuadPixelsInOneTriangle(Triangle *tri, int coverage_mask, int sample_mask, int x, int y, int i, int j);
+	void FlushShadingQueue(FsiosimdGroup &queue);
 
 	DrawEngine    &mDE;
 	PixelPrimMap  *mPixelPrimMap;
 	ZBuffer       *mZBuffer;
+	ColorBuffer   *mColorBuffer;
+	StencilBuffer *mStencilBuffer;
+	HiZBuffer     *mHiZBuffer;
+
+	// Per thread, allocated by the first multisample pass.
+	MultisampleTile *mMultisampleTile;
+
+	// Per thread queue of the quads to be shaded, see RenderQuadPixelsInOneTriangle().
+	FsiosimdGroup *mShadingQueue;
+
+	// Per thread scratch lists, used to unpack and merge the per thread display lists of one tile.
+	DisplayList   *mMergedList;
+	DisplayList   *mDecodeList;
+	vector<BinRun> *mMergeRuns;
+
+	// Triangles of an immediate mode render pass in submission order, and the
+	// per thread scratch list of the triangles touching a tile row.
+	DisplayList    mImmediateList;
+	DisplayList   *mImmediateRowList;
+
+	int            mRenderMode;
+
+	// Triangles binned in the render passes of current frame, and of the last frame,
+	// along with their memory, see GetTriangleMemorySize().
+	size_t         mFrameTriangles;
+	size_t         mLastFrameTriangles;
+	size_t         mFrameTriangleMemory;
+	size_t         mLastFrameTriangleMemory;
+	bool           mLastFrameValid;
+
+	// Tiles to be rendered, sorted by cost class and Morton order, see onRasterizing().
+	vector<uint64_t> mTileQueue;
 
 	bool           mDepthClearFlag;
+	bool           mColorClearFlag;
+
+	// RGBA8 clear color, taken when glClear is called.
+	uint32_t       mClearColor;
+
+	// Only the bits of mStencilClearMask are cleared to mClearStencil.
+	bool           mStencilClearFlag;
+	uint8_t        mClearStencil;
+	uint8_t        mStencilClearMask;
+
+	// Inclusive rectangle of the pending clears, in pixels.
+	int            mClearXMin;
+	int            mClearYMin;
+	int            mClearXMax;
+	int            mClearYMax;
+
+	// Set if any draw of this render pass has the stencil test on,
+	// the on-tile stencil is only loaded and stored if it's used.
+	bool           mStencilTestFlag;
 
 	// Used to optimize the depth buffer store.
 	// In the case where flush is triggered by swap buffer,
@@ -147,6 +389,10 @@ private:
 	// This is the very zero depth store implemented in HW.
 	bool           mFlushTriggerBySwapBuffer;
 	bool           mDepthOnlyPass;
+
+	// Macro tile size of color pass and depth only pass
+	int            mTileSize;
+	int            mDepthOnlyTileSize;
 };
 
 class PerspectiveCorrectInterpolater: public Interpolater
@@ -65,19 +65,30 @@ static inline __m128 _simd_lerp_ps(__m128 val1, __m128 val2, float weight)
 	return _mm_add_ps(val1, val2);
 }
 
+// horizontal min/max of the 4 lanes
+static inline float _simd_hmin_ps(__m128 v)
+{
+	v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+	v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+	return _mm_cvtss_f32(v);
+}
+
+static inline float _simd_hmax_ps(__m128 v)
+{
+	v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+	v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+	return _mm_cvtss_f32(v);
+}
+
+// NOTE: there is no integer FMA in x86
 static inline __m128i MAWrapper(const __m128i &v, const __m128i &stride, const __m128i &h)
 {
-#if defined(__AVX2__)
-	// FMA, relaxed floating-point precision
-	return _mm_fmadd_epi32(v, stride, h);
-#else
 	return _mm_add_epi32(_mm_mullo_epi32(v, stride), h);
-#endif
 }
 
 static inline __m128 MAWrapper(const __m128 &v, const __m128 &stride, const __m128 &h)
 {
-#if defined(__AVX2__)
+#if defined(__FMA__)
 	// FMA, relaxed floating-point precision
 	return _mm_fmadd_ps(v, stride, h);
 #else
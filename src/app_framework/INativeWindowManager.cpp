@@ -55,7 +55,7 @@ bool INativeWindowManager::NWMCreateWindow(int width, int height, const char *na
 	mWNDName   = name;
 
 	// TODO: pass format
-	NWMWindowInfo win_info = {width, height, 0};
+	NWMWindowInfo win_info = {width, height, 0, NWM_BUFFER_LAYOUT_LINEAR};
 	glspSetNativeWindowInfo(&win_info);
 
 	return true;